@@ -0,0 +1,698 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2018 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Micro benchmarks of the core mesh functions.
+ *
+ * Run with 'goxel --bench', preferably on a release build.
+ */
+
+#include "goxel.h"
+
+#define N BLOCK_SIZE
+
+static uint32_t bench_rand(uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+static void bench_report(const char *name, double t, int nb)
+{
+    LOG_I("%-32s %8.2f ns/op (%d ops, %.3f s)", name, t * 1e9 / nb, nb, t);
+}
+
+// The hash table that we used to index the blocks before, kept here so
+// that we can compare the two.
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+} uthash_block_t;
+
+static void bench_block_index(void)
+{
+    const int size[3] = {32, 32, 8}; // In blocks.
+    const int nb = 4 * 1000 * 1000;
+    int i, x, y, z, pos[3], (*positions)[3];
+    uint32_t seed = 1;
+    uint8_t v[4];
+    mesh_t *mesh;
+    uthash_block_t *table = NULL, *item, *tmp;
+    double t;
+    volatile int found = 0;
+
+    mesh = mesh_new();
+    for (z = 0; z < size[2]; z++)
+    for (y = 0; y < size[1]; y++)
+    for (x = 0; x < size[0]; x++) {
+        vec3_set(pos, x * N, y * N, z * N);
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){255, 255, 255, 255});
+        item = calloc(1, sizeof(*item));
+        memcpy(item->pos, pos, sizeof(pos));
+        HASH_ADD(hh, table, pos, sizeof(item->pos), item);
+    }
+
+    // Random voxels positions, half of them outside of any block.
+    positions = malloc(nb * sizeof(*positions));
+    for (i = 0; i < nb; i++) {
+        positions[i][0] = bench_rand(&seed) % (size[0] * N * 2) - size[0] * N;
+        positions[i][1] = bench_rand(&seed) % (size[1] * N);
+        positions[i][2] = bench_rand(&seed) % (size[2] * N);
+    }
+
+    t = sys_get_time();
+    for (i = 0; i < nb; i++) {
+        pos[0] = positions[i][0] & ~(int)(N - 1);
+        pos[1] = positions[i][1] & ~(int)(N - 1);
+        pos[2] = positions[i][2] & ~(int)(N - 1);
+        HASH_FIND(hh, table, pos, sizeof(pos), item);
+        found += item ? 1 : 0;
+    }
+    bench_report("block lookup (uthash)", sys_get_time() - t, nb);
+
+    t = sys_get_time();
+    for (i = 0; i < nb; i++) {
+        pos[0] = positions[i][0] & ~(int)(N - 1);
+        pos[1] = positions[i][1] & ~(int)(N - 1);
+        pos[2] = positions[i][2] & ~(int)(N - 1);
+        found += mesh_get_block_data(mesh, NULL, pos, NULL, NULL) ? 1 : 0;
+    }
+    bench_report("block lookup (mesh)", sys_get_time() - t, nb);
+
+    t = sys_get_time();
+    for (i = 0; i < nb; i++) {
+        mesh_get_at(mesh, NULL, positions[i], v);
+        found += v[3] ? 1 : 0;
+    }
+    bench_report("mesh_get_at (no accessor)", sys_get_time() - t, nb);
+
+    HASH_ITER(hh, table, item, tmp) {
+        HASH_DEL(table, item);
+        free(item);
+    }
+    free(positions);
+    mesh_delete(mesh);
+}
+
+// Fill a cube of blocks with random colors taken from a given number of
+// different values.
+static mesh_t *bench_fill_mesh(int size, int nb_colors, uint32_t *seed)
+{
+    mesh_t *mesh = mesh_new();
+    mesh_accessor_t accessor = mesh_get_accessor(mesh);
+    int pos[3];
+    uint32_t c;
+    for (pos[2] = 0; pos[2] < size; pos[2]++)
+    for (pos[1] = 0; pos[1] < size; pos[1]++)
+    for (pos[0] = 0; pos[0] < size; pos[0]++) {
+        c = bench_rand(seed) % nb_colors;
+        mesh_set_at(mesh, &accessor, pos,
+                    (uint8_t[]){c, c >> 8, c >> 16, 255});
+    }
+    return mesh;
+}
+
+// Compare the voxels access speed with the different blocks encodings.
+static void bench_block_encoding(void)
+{
+    const int size = 8 * N;
+    const int nb_colors[] = {1, 2, 16, 256, 1 << 24};
+    const char *names[] = {"uniform", "1 bit", "4 bits", "8 bits", "rgba"};
+    int i, j, nb, pos[3];
+    uint32_t seed = 1;
+    mesh_t *mesh;
+    mesh_iterator_t iter;
+    mesh_memory_stats_t stats;
+    uint8_t v[4], *data;
+    const uint8_t (*row)[4];
+    char name[64];
+    double t;
+    volatile int sum = 0;
+
+    data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
+    for (i = 0; i < ARRAY_SIZE(nb_colors); i++) {
+        t = sys_get_time();
+        mesh = bench_fill_mesh(size, nb_colors[i], &seed);
+        sprintf(name, "mesh_set_at (%s)", names[i]);
+        bench_report(name, sys_get_time() - t, size * size * size);
+        mesh_get_memory_stats(&stats);
+        LOG_I("%-32s %8.2f KiB/block", "memory",
+              stats.bytes / 1024. / (stats.nb_blocks ?: 1));
+
+        t = sys_get_time();
+        iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
+        while (mesh_iter(&iter, pos)) {
+            mesh_get_at(mesh, &iter, pos, v);
+            sum += v[0];
+        }
+        sprintf(name, "mesh_get_at (%s)", names[i]);
+        bench_report(name, sys_get_time() - t, size * size * size);
+
+        t = sys_get_time();
+        iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
+        while ((nb = mesh_iter_rows(&iter, pos, &row))) {
+            for (j = 0; j < nb; j++) sum += row[j][0];
+        }
+        sprintf(name, "mesh_iter_rows (%s)", names[i]);
+        bench_report(name, sys_get_time() - t, size * size * size);
+
+        t = sys_get_time();
+        nb = 0;
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, pos)) {
+            vec3_set(pos, pos[0] - 1, pos[1] - 1, pos[2] - 1);
+            mesh_read_region(mesh, pos, (int[]){N + 2, N + 2, N + 2}, data);
+            nb++;
+        }
+        sprintf(name, "mesh_read_region (%s)", names[i]);
+        bench_report(name, sys_get_time() - t, nb);
+        mesh_delete(mesh);
+    }
+    free(data);
+}
+
+// Copy on write churn: copy a mesh and modify a voxel in each block, as
+// we do for each step of a brush stroke.
+static void bench_mesh_copy(void)
+{
+    const int size = 8 * N, nb = 200;
+    int i, pos[3];
+    uint32_t seed = 1;
+    mesh_t *mesh, *copy;
+    mesh_iterator_t iter;
+    mesh_memory_stats_t stats;
+    double t;
+
+    mesh = bench_fill_mesh(size, 1 << 24, &seed);
+    t = sys_get_time();
+    for (i = 0; i < nb; i++) {
+        copy = mesh_copy(mesh);
+        iter = mesh_get_iterator(copy, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, pos))
+            mesh_set_at(copy, NULL, pos, (uint8_t[]){i, 0, 0, 255});
+        mesh_delete(copy);
+    }
+    bench_report("mesh copy and write", sys_get_time() - t, nb);
+    mesh_delete(mesh);
+
+    // Copy a big mesh and only modify a single voxel, as for a brush dab.
+    mesh = mesh_new();
+    for (pos[2] = 0; pos[2] < 16 * N; pos[2] += N)
+    for (pos[1] = 0; pos[1] < 64 * N; pos[1] += N)
+    for (pos[0] = 0; pos[0] < 64 * N; pos[0] += N)
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){255, 255, 255, 255});
+    t = sys_get_time();
+    for (i = 0; i < nb * 10; i++) {
+        copy = mesh_copy(mesh);
+        vec3_set(pos, bench_rand(&seed) % (64 * N),
+                      bench_rand(&seed) % (64 * N),
+                      bench_rand(&seed) % (16 * N));
+        mesh_set_at(copy, NULL, pos, (uint8_t[]){i, 0, 0, 255});
+        mesh_delete(copy);
+    }
+    bench_report("mesh copy and write one voxel", sys_get_time() - t,
+                 nb * 10);
+    mesh_delete(mesh);
+    mesh_get_memory_stats(&stats);
+    LOG_I("%-32s %8.2f MiB", "blocks memory peak",
+          stats.peak_bytes / (1024. * 1024.));
+}
+
+// Compare the shape functions evaluated one voxel at a time, as we used
+// to do in mesh_op, with the batch versions.
+static void bench_shape_funcs(void)
+{
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    const float size[3] = {40, 30, 20};
+    // Run the 64^3 grid several times, so that the timing is not noise.
+    const int nb_loops = 16;
+    const int nb = 64 * 64 * 64 * nb_loops;
+    int i, j, l, x, y, z;
+    float p[3], row[3][N], k[N];
+    char name[64];
+    double t;
+    volatile float sum = 0;
+
+    for (i = 0; i < ARRAY_SIZE(shapes); i++) {
+        t = sys_get_time();
+        for (l = 0; l < nb_loops; l++)
+        for (z = 0; z < 64; z++)
+        for (y = 0; y < 64; y++)
+        for (x = 0; x < 64; x++) {
+            vec3_set(p, x - 31.5, y - 31.5, z - 31.5);
+            sum += shapes[i]->func(p, size, 0);
+        }
+        sprintf(name, "shape func (%s)", shapes[i]->id);
+        bench_report(name, sys_get_time() - t, nb);
+
+        t = sys_get_time();
+        for (l = 0; l < nb_loops; l++)
+        for (z = 0; z < 64; z++)
+        for (y = 0; y < 64; y++)
+        for (x = 0; x < 64; x += N) {
+            for (j = 0; j < N; j++) {
+                row[0][j] = x + j - 31.5;
+                row[1][j] = y - 31.5;
+                row[2][j] = z - 31.5;
+            }
+            shapes[i]->func_batch(N, row[0], row[1], row[2], size, 0, k);
+            sum += k[0];
+        }
+        sprintf(name, "shape func batch (%s)", shapes[i]->id);
+        bench_report(name, sys_get_time() - t, nb);
+    }
+}
+
+// Paint a big shape with all the modes on top of an other one, so that
+// many blocks are on the surface of the shapes.
+static void bench_mesh_op(void)
+{
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_PAINT, MODE_MAX,
+                         MODE_SUB_CLAMP, MODE_MULT_ALPHA, MODE_INTERSECT};
+    const char *modes_names[] = {"over", "sub", "paint", "max", "sub clamp",
+                                 "mult alpha", "intersect"};
+    int i, j;
+    mesh_t *mesh, *copy;
+    painter_t painter = {
+        .color = {255, 128, 0, 200},
+    };
+    float box[4][4];
+    char name[64];
+    double t;
+
+    for (i = 0; i < ARRAY_SIZE(shapes); i++) {
+        mesh = mesh_new();
+        painter.shape = shapes[i];
+        painter.mode = MODE_OVER;
+        mat4_set_identity(box);
+        mat4_iscale(box, 100, 80, 60);
+        t = sys_get_time();
+        mesh_op(mesh, &painter, box);
+        sprintf(name, "mesh_op (%s, fill)", shapes[i]->id);
+        bench_report(name, sys_get_time() - t, 1);
+        mat4_itranslate(box, 0.3, 0.2, 0.1);
+        mat4_irotate(box, 0.5, 0, 0, 1);
+        for (j = 0; j < ARRAY_SIZE(modes); j++) {
+            copy = mesh_copy(mesh);
+            painter.mode = modes[j];
+            t = sys_get_time();
+            mesh_op(copy, &painter, box);
+            sprintf(name, "mesh_op (%s, %s)", shapes[i]->id, modes_names[j]);
+            bench_report(name, sys_get_time() - t, 1);
+            mesh_delete(copy);
+        }
+        mesh_delete(mesh);
+    }
+}
+
+// Paint a sphere with the different symmetries.
+static void bench_mesh_op_symmetry(void)
+{
+    const char *names[] = {"none", "x", "xy", "xyz"};
+    const int symmetries[] = {0, 1, 3, 7};
+    int i;
+    mesh_t *mesh;
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_OVER,
+        .color = {255, 128, 0, 255},
+    };
+    float box[4][4];
+    char name[64];
+    double t;
+
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        mesh = mesh_new();
+        painter.symmetry = symmetries[i];
+        mat4_set_identity(box);
+        mat4_itranslate(box, 40, 30, 20);
+        mat4_iscale(box, 30, 30, 30);
+        t = sys_get_time();
+        mesh_op(mesh, &painter, box);
+        sprintf(name, "mesh_op (symmetry %s)", names[i]);
+        bench_report(name, sys_get_time() - t, 1);
+        mesh_delete(mesh);
+    }
+}
+
+// Paint a brush segment of increasing length, once as a single stroke
+// and once as a sphere every diameter along the segment.
+static void bench_mesh_op_stroke(void)
+{
+    const float lengths[] = {5, 50, 200};
+    const float r = 10;
+    int i, j, nb;
+    mesh_t *mesh;
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_MAX,
+        .color = {255, 255, 255, 255},
+    };
+    float box[4][4], points[2][3], pos[3];
+    char name[64];
+    double t;
+
+    for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+        vec3_set(points[0], 0, 0, 0);
+        vec3_set(points[1], lengths[i], lengths[i] / 2, 0);
+
+        mesh = mesh_new();
+        bbox_from_extents(box, VEC(0, 0, 0), r, r, r);
+        t = sys_get_time();
+        mesh_op_stroke(mesh, &painter, box, 2, points);
+        sprintf(name, "mesh_op_stroke (length %g)", lengths[i]);
+        bench_report(name, sys_get_time() - t, 1);
+        mesh_delete(mesh);
+
+        mesh = mesh_new();
+        nb = max(ceil(vec3_dist(points[0], points[1]) / (2 * r)), 1);
+        t = sys_get_time();
+        for (j = 0; j < nb; j++) {
+            vec3_mix(points[0], points[1], (j + 1.0) / nb, pos);
+            bbox_from_extents(box, pos, r, r, r);
+            mesh_op(mesh, &painter, box);
+        }
+        sprintf(name, "mesh_op dabs (length %g)", lengths[i]);
+        bench_report(name, sys_get_time() - t, 1);
+        mesh_delete(mesh);
+    }
+}
+
+// Merge two overlapping spheres, with a color so that all the blocks have
+// to be computed.
+static void bench_mesh_merge(void)
+{
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_PAINT, MODE_MAX,
+                         MODE_SUB_CLAMP, MODE_MULT_ALPHA, MODE_INTERSECT};
+    const char *modes_names[] = {"over", "sub", "paint", "max", "sub clamp",
+                                 "mult alpha", "intersect"};
+    int i;
+    mesh_t *mesh, *other, *copy;
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_OVER,
+        .color = {255, 128, 0, 200},
+    };
+    float box[4][4];
+    char name[64];
+    double t;
+
+    mesh = mesh_new();
+    other = mesh_new();
+    mat4_set_identity(box);
+    mat4_iscale(box, 80, 80, 80);
+    mesh_op(mesh, &painter, box);
+    mat4_itranslate(box, 0.3, 0.1, 0.2);
+    mesh_op(other, &painter, box);
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        copy = mesh_copy(mesh);
+        t = sys_get_time();
+        mesh_merge(copy, other, modes[i], (uint8_t[]){255, 255, 255, 100 + i});
+        sprintf(name, "mesh_merge (%s)", modes_names[i]);
+        bench_report(name, sys_get_time() - t, 1);
+        mesh_delete(copy);
+    }
+    mesh_delete(other);
+    mesh_delete(mesh);
+}
+
+// Move a sphere with the different kinds of transformations.
+static void bench_mesh_move(void)
+{
+    const char *names[] = {"block translation", "translation", "rotation",
+                           "flip", "generic"};
+    int i;
+    mesh_t *mesh, *copy;
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_OVER,
+        .color = {255, 128, 0, 255},
+    };
+    float box[4][4], mat[4][4];
+    char name[64];
+    double t;
+
+    mesh = mesh_new();
+    mat4_set_identity(box);
+    mat4_iscale(box, 60, 60, 60);
+    mesh_op(mesh, &painter, box);
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        mat4_set_identity(mat);
+        if (i == 0) mat4_itranslate(mat, 32, -16, 48);
+        if (i == 1) mat4_itranslate(mat, 5, -3, 7);
+        if (i == 2) mat4_irotate(mat, M_PI / 2, 0, 0, 1);
+        if (i == 3) mat4_iscale(mat, -1, 1, 1);
+        if (i == 4) mat4_irotate(mat, 0.3, 1, 1, 0);
+        copy = mesh_copy(mesh);
+        t = sys_get_time();
+        mesh_move(copy, mat);
+        sprintf(name, "mesh_move (%s)", names[i]);
+        bench_report(name, sys_get_time() - t, 1);
+        mesh_delete(copy);
+    }
+    mesh_delete(mesh);
+}
+
+// Per voxel transformations of a big painted sphere, as when we drag the
+// shift alpha slider.
+static void bench_mesh_map(void)
+{
+    int i;
+    mesh_t *mesh, *copy;
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_OVER,
+        .color = {255, 128, 0, 255},
+    };
+    float box[4][4];
+    double t;
+
+    mesh = mesh_new();
+    mat4_set_identity(box);
+    mat4_iscale(box, 100, 100, 100);
+    mesh_op(mesh, &painter, box);
+    // Paint some parts so that not all the blocks are uniform.
+    painter.mode = MODE_PAINT;
+    painter.color[1] = 0;
+    for (i = 0; i < 8; i++) {
+        mat4_set_identity(box);
+        mat4_itranslate(box, i * 20 - 80, 0, 0);
+        mat4_iscale(box, 13, 80, 80);
+        mesh_op(mesh, &painter, box);
+    }
+    copy = mesh_new();
+    t = sys_get_time();
+    for (i = 0; i < 10; i++) {
+        mesh_set(copy, mesh);
+        mesh_shift_alpha(copy, -i - 1);
+    }
+    bench_report("mesh_shift_alpha", sys_get_time() - t, 10);
+    t = sys_get_time();
+    mesh_set(copy, mesh);
+    mesh_shift_brightness(copy, 20);
+    bench_report("mesh_shift_brightness", sys_get_time() - t, 1);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+// Extrude the top face of a box, as the extrude tool does.
+static void bench_mesh_extrude(void)
+{
+    mesh_t *mesh, *copy;
+    painter_t painter = {
+        .shape = &shape_cube,
+        .mode = MODE_OVER,
+        .color = {255, 128, 0, 255},
+    };
+    float box[4][4], plane[4][4];
+    double t;
+
+    mesh = mesh_new();
+    mat4_set_identity(box);
+    mat4_iscale(box, 100, 100, 1);
+    mesh_op(mesh, &painter, box);
+    plane_from_normal(plane, VEC(0, 0, 0.5), VEC(0, 0, 1));
+    bbox_from_extents(box, VEC(0, 0, 150), 100, 100, 150);
+    copy = mesh_copy(mesh);
+    t = sys_get_time();
+    mesh_extrude(copy, plane, box);
+    bench_report("mesh_extrude (200x200x300)", sys_get_time() - t, 1);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+// Paint small dabs on a layer in the middle of an image with many layers,
+// and update the merged layers after each dab.
+static void bench_layers(void)
+{
+    const int nb_layers = 32, nb_dabs = 20;
+    int i;
+    layer_t *layer, *middle = NULL;
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_OVER,
+        .color = {255, 128, 0, 255},
+    };
+    float box[4][4];
+    double t;
+
+    goxel.image = image_new();
+    goxel.layers_mesh = goxel.layers_mesh ?: mesh_new();
+    goxel.render_mesh = goxel.render_mesh ?: mesh_new();
+    for (i = 0; i < nb_layers; i++) {
+        layer = image_add_layer(goxel.image);
+        mat4_set_identity(box);
+        mat4_itranslate(box, (i % 4) * 40, (i / 4 % 4) * 40, (i / 16) * 40);
+        mat4_iscale(box, 30, 30, 30);
+        mesh_op(layer->mesh, &painter, box);
+        if (i == nb_layers / 2) middle = layer;
+    }
+    goxel_update_meshes(-1);
+    for (i = 0, t = 0; i < nb_dabs; i++) {
+        mat4_set_identity(box);
+        mat4_itranslate(box, i * 3, 0, 0);
+        mat4_iscale(box, 5, 5, 5);
+        mesh_op(middle->mesh, &painter, box);
+        t -= sys_get_time();
+        goxel_update_meshes(-1);
+        t += sys_get_time();
+    }
+    bench_report("update meshes (32 layers, dab)", t, nb_dabs);
+}
+
+// Same condition as the extrude tool: select the connected voxels of the
+// face pointing up.
+static int select_face_cond(const uint8_t value[4],
+                            const uint8_t neighboors[6][4],
+                            const uint8_t mask[6],
+                            void *user)
+{
+    int i;
+    if (!value[3] || neighboors[3][3]) return 0;
+    for (i = 0; i < 6; i++)
+        if (i / 2 != 1 && mask[i]) return 255;
+    return 0;
+}
+
+// Select all the connected visible voxels.
+static int select_visible_cond(const uint8_t value[4],
+                               const uint8_t neighboors[6][4],
+                               const uint8_t mask[6],
+                               void *user)
+{
+    return value[3] ? 255 : 0;
+}
+
+// Flood fill selections of more than 100k voxels.
+static void bench_mesh_select(void)
+{
+    mesh_t *mesh, *selection = mesh_new();
+    painter_t painter = {
+        .shape = &shape_cube,
+        .mode = MODE_OVER,
+        .color = {255, 128, 0, 255},
+    };
+    float box[4][4];
+    double t;
+
+    // Top face of a 400x400 box.
+    mesh = mesh_new();
+    mat4_set_identity(box);
+    mat4_iscale(box, 200, 200, 8);
+    mesh_op(mesh, &painter, box);
+    t = sys_get_time();
+    mesh_select(mesh, (int[]){0, 0, 7}, select_face_cond, NULL, selection);
+    bench_report("mesh_select (box face)", sys_get_time() - t, 1);
+    mesh_delete(mesh);
+
+    // Sphere shell of radius 100 and thickness 3.
+    mesh = mesh_new();
+    painter.shape = &shape_sphere;
+    mat4_set_identity(box);
+    mat4_iscale(box, 100, 100, 100);
+    mesh_op(mesh, &painter, box);
+    painter.mode = MODE_SUB;
+    mat4_set_identity(box);
+    mat4_iscale(box, 97, 97, 97);
+    mesh_op(mesh, &painter, box);
+    t = sys_get_time();
+    mesh_select(mesh, (int[]){0, 0, 99}, select_visible_cond, NULL,
+                selection);
+    bench_report("mesh_select (sphere shell)", sys_get_time() - t, 1);
+    mesh_delete(mesh);
+    mesh_delete(selection);
+}
+
+// Generate the vertices of all the blocks of a sphere, with and without
+// marching cubes.
+static void bench_vertices(void)
+{
+    const int effects[] = {0, EFFECT_MARCHING_CUBES};
+    const char *names[] = {"mesh_generate_vertices",
+                           "mesh_generate_vertices (mc)"};
+    int i, nb, size, subdivide, pos[3];
+    mesh_t *mesh;
+    mesh_iterator_t iter;
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_OVER,
+        .color = {255, 255, 255, 255},
+    };
+    float box[4][4] = MAT4_IDENTITY;
+    voxel_vertex_t *vertices;
+    double t;
+
+    mesh = mesh_new();
+    mat4_iscale(box, 64, 64, 64);
+    mesh_op(mesh, &painter, box);
+    vertices = calloc(N * N * N * 6 * 4, sizeof(*vertices));
+    for (i = 0; i < ARRAY_SIZE(effects); i++) {
+        t = sys_get_time();
+        nb = 0;
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, pos)) {
+            mesh_generate_vertices(mesh, pos, effects[i], vertices,
+                                   &size, &subdivide);
+            nb++;
+        }
+        bench_report(names[i], sys_get_time() - t, nb);
+    }
+    free(vertices);
+    mesh_delete(mesh);
+}
+
+void bench_run(void)
+{
+    // The benches run before goxel_init.
+    shapes_init();
+    bench_block_index();
+    bench_block_encoding();
+    bench_mesh_copy();
+    bench_shape_funcs();
+    bench_mesh_op();
+    bench_mesh_op_symmetry();
+    bench_mesh_op_stroke();
+    bench_mesh_merge();
+    bench_mesh_move();
+    bench_mesh_map();
+    bench_mesh_extrude();
+    bench_layers();
+    bench_mesh_select();
+    bench_vertices();
+}
@@ -18,65 +18,134 @@
 
 #include "goxel.h"
 
+/*
+ * The items are kept both in a hash table for the lookups, and in a doubly
+ * linked list sorted from the least to the most recently used, so that
+ * getting or evicting an item never has to walk or rehash anything.
+ *
+ * All the caches are also in a global list, so that we can keep the sum
+ * of their sizes under a global budget: when we go over it, we evict the
+ * least recently used item of all the caches, using a global clock.
+ */
+
 typedef struct item item_t;
 struct item {
     UT_hash_handle  hh;
+    item_t          *prev, *next;   // LRU list.
     char            key[256];
     void            *data;
-    int             cost;
+    int64_t         cost;
     uint64_t        last_used;
     int             (*delfunc)(void *data);
 };
 
 struct cache {
-    item_t *items;
-    uint64_t clock;
-    int size;
-    int max_size;
+    cache_t         *next;          // Global list of all the caches.
+    item_t          *items;         // Hash table.
+    item_t          *lru;           // Least recently used item first.
+    cache_stats_t   stats;
 };
 
-cache_t *cache_create(int size)
+static cache_t *g_caches = NULL;
+static uint64_t g_clock = 0;
+static int64_t g_size = 0;
+static int64_t g_budget = CACHE_DEFAULT_BUDGET;
+
+cache_t *cache_create(const char *name, int64_t size)
 {
     cache_t *cache = calloc(1, sizeof(*cache));
-    cache->max_size = size;
+    cache->stats.name = name;
+    cache->stats.max_bytes = size;
+    LL_APPEND(g_caches, cache);
     return cache;
 }
 
-static void cleanup(cache_t *cache)
+static void evict(cache_t *cache)
 {
-    item_t *item;
-    while (cache->size >= cache->max_size) {
-        item = cache->items;
-        HASH_DEL(cache->items, item);
-        item->delfunc(item->data);
-        cache->size -= item->cost;
-        free(item);
+    item_t *item = cache->lru;
+    DL_DELETE(cache->lru, item);
+    HASH_DEL(cache->items, item);
+    item->delfunc(item->data);
+    cache->stats.bytes -= item->cost;
+    cache->stats.nb_items--;
+    cache->stats.evictions++;
+    g_size -= item->cost;
+    free(item);
+}
+
+// Evict items until the cache (if not NULL) and all the caches are under
+// their budgets, but never the item 'keep'.
+static void cleanup(cache_t *cache, const item_t *keep)
+{
+    cache_t *c, *oldest;
+    while (cache && cache->stats.bytes > cache->stats.max_bytes &&
+           cache->lru != keep) {
+        evict(cache);
+    }
+    while (g_budget && g_size > g_budget) {
+        oldest = NULL;
+        LL_FOREACH(g_caches, c) {
+            if (!c->lru || c->lru == keep) continue;
+            if (!oldest || c->lru->last_used < oldest->lru->last_used)
+                oldest = c;
+        }
+        if (!oldest) break;
+        evict(oldest);
     }
 }
 
 void cache_add(cache_t *cache, const void *key, int len, void *data,
-               int cost, int (*delfunc)(void *data))
+               int64_t cost, int (*delfunc)(void *data))
 {
     item_t *item = calloc(1, sizeof(*item));
     assert(len <= sizeof(item->key));
     memcpy(item->key, key, len);
     item->data = data;
-    item->cost = cost;
-    item->last_used = cache->clock++;
+    item->cost = cost + sizeof(*item);
+    item->last_used = g_clock++;
     item->delfunc = delfunc;
     HASH_ADD(hh, cache->items, key, len, item);
-    cache->size += cost;
-    if (cache->size >= cache->max_size) cleanup(cache);
+    DL_APPEND(cache->lru, item);
+    cache->stats.bytes += item->cost;
+    cache->stats.nb_items++;
+    g_size += item->cost;
+    cleanup(cache, item);
 }
 
 void *cache_get(cache_t *cache, const void *key, int keylen)
 {
     item_t *item;
     HASH_FIND(hh, cache->items, key, keylen, item);
-    if (!item) return NULL;
-    item->last_used = cache->clock++;
-    // Reinsert item on top of the hash list so that it stays sorted.
-    HASH_DEL(cache->items, item);
-    HASH_ADD(hh, cache->items, key, keylen, item);
+    if (!item) {
+        cache->stats.misses++;
+        return NULL;
+    }
+    cache->stats.hits++;
+    item->last_used = g_clock++;
+    // Move the item to the end of the LRU list.
+    if (item->next) {
+        DL_DELETE(cache->lru, item);
+        DL_APPEND(cache->lru, item);
+    }
     return item->data;
 }
+
+void cache_set_budget(int64_t size)
+{
+    g_budget = size;
+    cleanup(NULL, NULL);
+}
+
+int64_t cache_get_budget(void)
+{
+    return g_budget;
+}
+
+void caches_iter(int (*f)(const cache_stats_t *stats, void *user),
+                 void *user)
+{
+    cache_t *cache;
+    LL_FOREACH(g_caches, cache) {
+        if (f(&cache->stats, user)) return;
+    }
+}
@@ -339,7 +339,7 @@ static void dicom_import(const char *dirpath)
     w = dicom.columns;
     h = dicom.rows;
     d = utarray_len(all_files);
-    data = calloc(w * h * d, 2);
+    data = calloc((size_t)w * h * d, 2);
 
     dptr = NULL;
     while( (dptr = (dicom_t*)utarray_next(all_files, dptr))) {
@@ -352,7 +352,7 @@ static void dicom_import(const char *dirpath)
 
     // Generate 4 * 8bit RGBA values.
     // XXX: we should maybe support voxel data in 2 bytes monochrome.
-    cube = malloc(w * h * d * sizeof(*cube));
+    cube = malloc((size_t)w * h * d * sizeof(*cube));
     for (i = 0; i < w * h * d; i++) {
         vec4_set(cube[i], 255, 255, 255, clamp(data[i], 0, 255));
     }
@@ -76,7 +76,9 @@
 // ids get written only once.
 typedef struct {
     UT_hash_handle  hh;
-    void            *v;
+    void            *v;         // Voxels data, only used when loading.
+    const mesh_t    *mesh;      // Mesh and position of the block, only
+    int             pos[3];     // used when saving.
     uint64_t        uid;
     int             index;
 } block_hash_t;
@@ -219,7 +221,7 @@ void save_to_file(const char *path, bool with_preview)
     int nb_blocks, index, size, bpos[3];
     uint64_t uid;
     FILE *out;
-    uint8_t *png, *preview;
+    uint8_t *png, *preview, *voxels;
     camera_t *camera;
     mesh_iterator_t iter;
 
@@ -247,17 +249,20 @@ void save_to_file(const char *path, bool with_preview)
         free(png);
     }
 
+    // Blocks with the same data are only saved once.
+    image_intern_blocks(goxel.image);
+
     // Add all the blocks data into the hash table.
     index = 0;
     DL_FOREACH(goxel.image->layers, layer) {
         iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
         while (mesh_iter(&iter, bpos)) {
-            mesh_get_block_data(layer->mesh, &iter, bpos, &uid);
+            mesh_get_block_data(layer->mesh, &iter, bpos, &uid, NULL);
             HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
             if (data) continue;
             data = calloc(1, sizeof(*data));
-            data->v = mesh_get_block_data(layer->mesh, &iter, bpos, NULL);
-            assert(data->v);
+            data->mesh = layer->mesh;
+            memcpy(data->pos, bpos, sizeof(bpos));
             data->uid = uid;
             data->index = index++;
             HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
@@ -265,11 +270,14 @@ void save_to_file(const char *path, bool with_preview)
     }
 
     // Write all the blocks chunks.
+    voxels = malloc(BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 4);
     HASH_ITER(hh, blocks_table, data, data_tmp) {
-        png = img_write_to_mem((uint8_t*)data->v, 64, 64, 4, &size);
+        mesh_get_block_data(data->mesh, NULL, data->pos, NULL, voxels);
+        png = img_write_to_mem(voxels, 64, 64, 4, &size);
         chunk_write_all(out, "BL16", (char*)png, size);
         free(png);
     }
+    free(voxels);
 
     // Write all the layers.
     DL_FOREACH(goxel.image->layers, layer) {
@@ -285,7 +293,7 @@ void save_to_file(const char *path, bool with_preview)
         if (!layer->base_id) {
             iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
             while (mesh_iter(&iter, bpos)) {
-                mesh_get_block_data(layer->mesh, &iter, bpos, &uid);
+                mesh_get_block_data(layer->mesh, &iter, bpos, &uid, NULL);
                 HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
                 assert(data);
                 chunk_write_int32(&c, out, data->index);
@@ -520,6 +528,7 @@ int load_from_file(const char *path)
     }
 
     goxel.image->path = strdup(path);
+    image_intern_blocks(goxel.image);
     goxel.image->saved_key = image_get_key(goxel.image);
     goxel_update_meshes(-1);
     fclose(in);
@@ -24,10 +24,10 @@ static void export_as_pov(const char *path, int w, int h)
 {
     FILE *file;
     layer_t *layer;
-    int size, p[3];
+    int i, n, size, p[3];
     char *buf;
     const char *template;
-    uint8_t v[4];
+    const uint8_t (*row)[4];
     float modelview[4][4], light_dir[3];
     mustache_t *m, *m_cam, *m_light, *m_voxels, *m_voxel;
     camera_t camera = goxel.camera;
@@ -70,15 +70,16 @@ static void export_as_pov(const char *path, int w, int h)
 
     m_voxels = mustache_add_list(m, "voxels");
     DL_FOREACH(goxel.image->layers, layer) {
-        iter = mesh_get_iterator(layer->mesh, MESH_ITER_VOXELS);
-        while (mesh_iter(&iter, p)) {
-            mesh_get_at(layer->mesh, &iter, p, v);
-            if (v[3] < 127) continue;
-            m_voxel = mustache_add_dict(m_voxels, NULL);
-            mustache_add_str(m_voxel, "pos", "<%d, %d, %d>",
-                             p[0], p[1], p[2]);
-            mustache_add_str(m_voxel, "color", "<%d, %d, %d>",
-                             v[0], v[1], v[2]);
+        iter = mesh_get_iterator(layer->mesh, MESH_ITER_SKIP_EMPTY);
+        while ((n = mesh_iter_rows(&iter, p, &row))) {
+            for (i = 0; i < n; i++) {
+                if (row[i][3] < 127) continue;
+                m_voxel = mustache_add_dict(m_voxels, NULL);
+                mustache_add_str(m_voxel, "pos", "<%d, %d, %d>",
+                                 p[0] + i, p[1], p[2]);
+                mustache_add_str(m_voxel, "color", "<%d, %d, %d>",
+                                 row[i][0], row[i][1], row[i][2]);
+            }
         }
     }
 
@@ -22,8 +22,8 @@ static void export_as_txt(const char *path)
 {
     FILE *out;
     mesh_t *mesh = goxel.layers_mesh;
-    int p[3];
-    uint8_t v[4];
+    int i, n, p[3];
+    const uint8_t (*row)[4];
     mesh_iterator_t iter;
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
@@ -35,12 +35,13 @@ static void export_as_txt(const char *path)
     fprintf(out, "# One line per voxel\n");
     fprintf(out, "# X Y Z RRGGBB\n");
 
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, p)) {
-        mesh_get_at(mesh, &iter, p, v);
-        if (v[3] < 127) continue;
-        fprintf(out, "%d %d %d %02x%02x%02x\n",
-                p[0], p[1], p[2], v[0], v[1], v[2]);
+    iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
+    while ((n = mesh_iter_rows(&iter, p, &row))) {
+        for (i = 0; i < n; i++) {
+            if (row[i][3] < 127) continue;
+            fprintf(out, "%d %d %d %02x%02x%02x\n", p[0] + i, p[1], p[2],
+                    row[i][0], row[i][1], row[i][2]);
+        }
     }
     fclose(out);
 }
@@ -52,9 +52,9 @@ static void vox_import_old(const char *path)
     h = READ(uint32_t, file);
     w = READ(uint32_t, file);
 
-    voxels = calloc(w * h * d, 1);
+    voxels = calloc((size_t)w * h * d, 1);
     palette = calloc(256, sizeof(*palette));
-    cube = calloc(w * h * d, sizeof(*cube));
+    cube = calloc((size_t)w * h * d, sizeof(*cube));
     for (i = 0; i < w * h * d; i++) {
         voxels[i] = READ(uint8_t, file);
     }
@@ -216,13 +216,14 @@ static int voxel_cmp(const void *a_, const void *b_)
 static void vox_export(const mesh_t *mesh, const char *path)
 {
     FILE *file;
-    int children_size, nb_vox = 0, i, pos[3];
+    int children_size, nb_vox = 0, i, j, n, pos[3];
     int xmin = INT_MAX, ymin = INT_MAX, zmin = INT_MAX;
     int xmax = INT_MIN, ymax = INT_MIN, zmax = INT_MIN;
     uint8_t (*palette)[4];
     bool use_default_palette = true;
     uint8_t *voxels;
     uint8_t v[4];
+    const uint8_t (*row)[4];
     mesh_iterator_t iter;
 
     palette = calloc(256, sizeof(*palette));
@@ -230,20 +231,22 @@ static void vox_export(const mesh_t *mesh, const char *path)
         hexcolor(VOX_DEFAULT_PALETTE[i], palette[i]);
 
     // Iter all the voxels to get the count and the size.
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        use_default_palette = use_default_palette &&
-                            get_color_index(v, palette, true) != -1;
-        nb_vox++;
-        xmin = min(xmin, pos[0]);
-        ymin = min(ymin, pos[1]);
-        zmin = min(zmin, pos[2]);
-        xmax = max(xmax, pos[0] + 1);
-        ymax = max(ymax, pos[1] + 1);
-        zmax = max(zmax, pos[2] + 1);
+    iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
+    while ((n = mesh_iter_rows(&iter, pos, &row))) {
+        for (j = 0; j < n; j++) {
+            if (row[j][3] < 127) continue;
+            memcpy(v, row[j], 3);
+            v[3] = 255;
+            use_default_palette = use_default_palette &&
+                                get_color_index(v, palette, true) != -1;
+            nb_vox++;
+            xmin = min(xmin, pos[0] + j);
+            ymin = min(ymin, pos[1]);
+            zmin = min(zmin, pos[2]);
+            xmax = max(xmax, pos[0] + j + 1);
+            ymax = max(ymax, pos[1] + 1);
+            zmax = max(zmax, pos[2] + 1);
+        }
     }
     if (!use_default_palette)
         quantization_gen_palette(mesh, 255, (void*)(palette + 1));
@@ -273,22 +276,21 @@ static void vox_export(const mesh_t *mesh, const char *path)
 
     voxels = calloc(nb_vox, 4);
     i = 0;
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (v[3] < 127) continue;
-        pos[0] -= xmin;
-        pos[1] -= ymin;
-        pos[2] -= zmin;
-        assert(pos[0] >= 0 && pos[0] < 255);
-        assert(pos[1] >= 0 && pos[1] < 255);
-        assert(pos[2] >= 0 && pos[2] < 255);
-
-        voxels[i * 4 + 0] = pos[0];
-        voxels[i * 4 + 1] = pos[1];
-        voxels[i * 4 + 2] = pos[2];
-        voxels[i * 4 + 3] = get_color_index(v, palette, false);
-        i++;
+    iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
+    while ((n = mesh_iter_rows(&iter, pos, &row))) {
+        for (j = 0; j < n; j++) {
+            if (row[j][3] < 127) continue;
+            memcpy(v, row[j], 4);
+            assert(pos[0] + j - xmin >= 0 && pos[0] + j - xmin < 255);
+            assert(pos[1] - ymin >= 0 && pos[1] - ymin < 255);
+            assert(pos[2] - zmin >= 0 && pos[2] - zmin < 255);
+
+            voxels[i * 4 + 0] = pos[0] + j - xmin;
+            voxels[i * 4 + 1] = pos[1] - ymin;
+            voxels[i * 4 + 2] = pos[2] - zmin;
+            voxels[i * 4 + 3] = get_color_index(v, palette, false);
+            i++;
+        }
     }
     qsort(voxels, nb_vox, 4, voxel_cmp);
     for (i = 0; i < nb_vox; i++)
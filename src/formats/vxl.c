@@ -243,9 +243,9 @@ static void export_as_vxl(const char *path)
     uint8_t (*map)[512][512][64];
     uint32_t (*color)[512][512][64];
     const mesh_t *mesh = goxel.layers_mesh;
-    mesh_iterator_t iter = {0};
-    uint8_t c[4];
-    int x, y, z, pos[3];
+    uint8_t (*slice)[512][4];
+    const uint8_t *c;
+    int x, y, z;
 
     map = calloc(1, sizeof(*map));
     color = calloc(1, sizeof(*color));
@@ -254,18 +254,21 @@ static void export_as_vxl(const char *path)
                     "vxl\0*.vxl\0", NULL, "untitled.vxl");
     if (!path) return;
 
-    for (z = 0; z < 64; z++)
-    for (y = 0; y < 512; y++)
-    for (x = 0; x < 512; x++) {
-        pos[0] = 256 - x;
-        pos[1] = y - 256;
-        pos[2] = 31 - z;
-        mesh_get_at(mesh, &iter, pos, c);
-        if (c[3] <= 127) continue;
-        (*map)[x][y][z] = 1;
-        memcpy(&((*color)[x][y][z]), c, 4);
+    // Read the mesh one slice at a time.  The x axis is inverted.
+    slice = calloc(512 * 512, 4);
+    for (z = 0; z < 64; z++) {
+        mesh_read_region(mesh, (int[]){-255, -256, 31 - z},
+                         (int[]){512, 512, 1}, (uint8_t*)slice);
+        for (y = 0; y < 512; y++)
+        for (x = 0; x < 512; x++) {
+            c = slice[y][511 - x];
+            if (c[3] <= 127) continue;
+            (*map)[x][y][z] = 1;
+            memcpy(&((*color)[x][y][z]), c, 4);
+        }
     }
     write_map(path, *map, *color);
+    free(slice);
     free(map);
     free(color);
 }
@@ -792,32 +792,131 @@ void goxel_render_view(const float viewport[4])
     render_submit(&goxel.rend, rect, goxel.back_color);
 }
 
+/*
+ * Incremental merge of the layers meshes.
+ *
+ * We keep a copy of each mesh used in the last merge, so that the next
+ * time we only have to merge again the columns of blocks that changed in
+ * any of the meshes.  Since the meshes share their unmodified blocks with
+ * the copies, finding the changes only costs the size of the edit.  When
+ * the number of meshes changes we merge everything again.
+ */
+typedef struct {
+    mesh_t  *mesh;      // The result of the merge.
+    int     nb;         // Number of merged meshes.
+    mesh_t  **sources;  // Copies of the merged meshes.
+} layers_merge_t;
+
+static layers_merge_t g_layers_merge = {};
+static layers_merge_t g_render_merge = {};
+
+typedef struct {
+    int nb;
+    int (*bpos)[3];
+} bpos_list_t;
+
+static void bpos_list_add(const int bpos[3], void *user)
+{
+    bpos_list_t *list = user;
+    if (list->nb % 64 == 0) {
+        list->bpos = realloc(list->bpos,
+                             (list->nb + 64) * sizeof(*list->bpos));
+    }
+    memcpy(list->bpos[list->nb++], bpos, sizeof(*list->bpos));
+}
+
+static int bpos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    if (a[2] != b[2]) return a[2] < b[2] ? -1 : +1;
+    if (a[1] != b[1]) return a[1] < b[1] ? -1 : +1;
+    if (a[0] != b[0]) return a[0] < b[0] ? -1 : +1;
+    return 0;
+}
+
+static void layers_merge_update(layers_merge_t *m,
+                                int nb, const mesh_t **meshes)
+{
+    int i, n;
+    bpos_list_t list = {};
+
+    if (!m->mesh) m->mesh = mesh_new();
+    if (nb != m->nb) {
+        for (i = 0; i < m->nb; i++) mesh_delete(m->sources[i]);
+        m->sources = realloc(m->sources, nb * sizeof(*m->sources));
+        m->nb = nb;
+        mesh_clear(m->mesh);
+        for (i = 0; i < nb; i++) {
+            mesh_merge(m->mesh, meshes[i], MODE_OVER, NULL);
+            m->sources[i] = mesh_copy(meshes[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < nb; i++)
+        mesh_diff_blocks(m->sources[i], meshes[i], bpos_list_add, &list);
+    if (!list.nb) return;
+
+    // Remove the duplicated positions.
+    qsort(list.bpos, list.nb, sizeof(*list.bpos), bpos_cmp);
+    for (i = 1, n = 1; i < list.nb; i++) {
+        if (bpos_cmp(list.bpos[i], list.bpos[n - 1]) == 0) continue;
+        memcpy(list.bpos[n++], list.bpos[i], sizeof(*list.bpos));
+    }
+
+    // Merge the columns of blocks again, starting from the first mesh.
+    for (i = 0; i < n; i++)
+        mesh_copy_block(meshes[0], list.bpos[i], m->mesh, list.bpos[i]);
+    for (i = 1; i < nb; i++) {
+        mesh_merge_blocks(m->mesh, meshes[i], MODE_OVER, NULL, n,
+                          (const int (*)[3])list.bpos);
+    }
+    for (i = 0; i < nb; i++) mesh_set(m->sources[i], meshes[i]);
+    free(list.bpos);
+}
+
+// Return the list of the visible layers meshes, with the active layer mesh
+// optionally replaced by an other mesh.
+static const mesh_t **get_visible_meshes(const mesh_t *active, int *nb)
+{
+    layer_t *layer;
+    const mesh_t **ret;
+    int n = 0;
+
+    DL_FOREACH(goxel.image->layers, layer) n++;
+    ret = calloc(n + 1, sizeof(*ret));
+    *nb = 0;
+    DL_FOREACH(goxel.image->layers, layer) {
+        if (!layer->visible) continue;
+        if (active && layer == goxel.image->active_layer)
+            ret[(*nb)++] = active;
+        else
+            ret[(*nb)++] = layer->mesh;
+    }
+    return ret;
+}
+
 void image_update(image_t *img);
 void goxel_update_meshes(int mask)
 {
-    layer_t *layer;
-    mesh_t *mesh;
+    const mesh_t **meshes;
+    int nb;
 
     image_update(goxel.image);
 
     if (    (mask & MESH_LAYERS) || (mask & MESH_PICK) ||
             ((mask & MESH_RENDER) && !goxel.tool_mesh)) {
-        mesh_clear(goxel.layers_mesh);
-        DL_FOREACH(goxel.image->layers, layer) {
-            if (!layer->visible) continue;
-            mesh_merge(goxel.layers_mesh, layer->mesh, MODE_OVER, NULL);
-        }
+        meshes = get_visible_meshes(NULL, &nb);
+        layers_merge_update(&g_layers_merge, nb, meshes);
+        mesh_set(goxel.layers_mesh, g_layers_merge.mesh);
+        free(meshes);
     }
 
     if ((mask & MESH_RENDER) && goxel.tool_mesh) {
-        mesh_clear(goxel.render_mesh);
-        DL_FOREACH(goxel.image->layers, layer) {
-            if (!layer->visible) continue;
-            mesh = layer->mesh;
-            if (mesh == goxel.image->active_layer->mesh)
-                mesh = goxel.tool_mesh;
-            mesh_merge(goxel.render_mesh, mesh, MODE_OVER, NULL);
-        }
+        meshes = get_visible_meshes(goxel.tool_mesh, &nb);
+        layers_merge_update(&g_render_merge, nb, meshes);
+        mesh_set(goxel.render_mesh, g_render_merge.mesh);
+        free(meshes);
     }
     if ((mask & MESH_RENDER) && !goxel.tool_mesh)
         mesh_set(goxel.render_mesh, goxel.layers_mesh);
@@ -936,6 +1035,7 @@ static int goxel_import_file(const char *path)
     actions_iter(search_action_for_format_cb, USER_PASS(path, "import_", &a));
     if (!a) return -1;
     action_exec(a, "p", path);
+    image_intern_blocks(goxel.image);
     return 0;
 }
 
@@ -844,6 +844,15 @@ enum {
 typedef struct shape {
     const char *id;
     float (*func)(const float p[3], const float s[3], float smoothness);
+    // Same as func for n points given as separate x, y and z arrays.
+    void (*func_batch)(int n, const float *x, const float *y,
+                       const float *z, const float s[3], float smoothness,
+                       float *out);
+    // Optional conservative test of a box of points against the shape.
+    // Returns +1 if func >= smoothness for all the points of the box, -1
+    // if func <= -smoothness (< 0 if smoothness is zero), or 0 if we
+    // don't know.
+    int (*bound)(const float box[2][3], const float s[3], float smoothness);
 } shape_t;
 
 void shapes_init(void);
@@ -936,7 +945,37 @@ void mesh_get_box(const mesh_t *mesh, bool exact, float box[4][4]);
  */
 void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4]);
 
-// XXX: to cleanup.
+/* Function: mesh_op_stroke
+ * Apply a paint operation with a shape swept along a polyline.
+ *
+ * All the shapes of the stroke are rendered in a single pass, combined
+ * with their max value.  Round spheres give a chain of capsules, the other
+ * shapes are repeated along the segments at steps no larger than their
+ * smallest width.
+ *
+ * Parameters:
+ *   mesh    - The mesh we paint into.
+ *   painter - Defines the paint operation to apply.
+ *   box     - The shape box, relative to each point of the stroke.
+ *   nb      - Number of points of the stroke, at least one.
+ *   points  - The points of the stroke.
+ */
+void mesh_op_stroke(mesh_t *mesh, const painter_t *painter,
+                    const float box[4][4], int nb, const float (*points)[3]);
+
+/*
+ * Function: mesh_extrude
+ * Extrude a slice of a mesh into a box.
+ *
+ * Each voxel of the box gets the value of the voxel with the same position
+ * projected into the plane.  The voxels outside of the box are removed.
+ * Planes aligned with an axis are extruded block by block.
+ *
+ * Parameters:
+ *   mesh  - The mesh to extrude.
+ *   plane - The plane of the slice we extrude.
+ *   box   - The box we extrude into.
+ */
 void mesh_extrude(mesh_t *mesh,
                   const float plane[4][4],
                   const float box[4][4]);
@@ -955,7 +994,9 @@ void mesh_extrude(mesh_t *mesh,
  *   w    - Width of the data.
  *   h    - Height of the data.
  *   d    - Depth of the data.
- *   iter - Optional iterator for optimized access.
+ *   iter - Unused.
+ *
+ * See <mesh_write_region>.
  */
 void mesh_blit(mesh_t *mesh, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
@@ -963,8 +1004,38 @@ void mesh_blit(mesh_t *mesh, const uint8_t *data,
 
 void mesh_move(mesh_t *mesh, const float mat[4][4]);
 
+/*
+ * Function: mesh_map_voxels
+ * Apply a function to all the voxels of a mesh, in place.
+ *
+ * The function gets each voxel value and modifies it.  It is called for
+ * all the voxels of the non empty blocks, including the invisible ones,
+ * and must only depend on the value, since it can be called only once for
+ * several voxels with the same value.  The blocks are processed on the
+ * worker threads, so the function has to be thread safe.
+ *
+ * Parameters:
+ *   mesh - The mesh to modify.
+ *   f    - Function applied to each voxel value.
+ *   user - User data passed to the function.
+ */
+void mesh_map_voxels(mesh_t *mesh, void (*f)(uint8_t v[4], void *user),
+                     void *user);
+
+// Add a value to the alpha of all the voxels.
 void mesh_shift_alpha(mesh_t *mesh, int v);
 
+// Replace all the voxels of a given color.
+void mesh_replace_color(mesh_t *mesh, const uint8_t color[4],
+                        const uint8_t new_color[4]);
+
+// Add a value to the RGB components of all the visible voxels.
+void mesh_shift_brightness(mesh_t *mesh, int v);
+
+// Remove the voxels with an alpha lower than a threshold, and make the
+// others opaque.
+void mesh_threshold_alpha(mesh_t *mesh, int threshold);
+
 // Compute the selection mask for a given condition.
 int mesh_select(const mesh_t *mesh,
                 const int start_pos[3],
@@ -988,6 +1059,18 @@ int mesh_select(const mesh_t *mesh,
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
                 const uint8_t color[4]);
 
+/*
+ * Function: mesh_merge_blocks
+ * Same as <mesh_merge>, but only for a list of blocks.
+ *
+ * Parameters:
+ *   nb     - Number of blocks in the list.
+ *   bpos   - Positions of the blocks.  Each position should only be in the
+ *            list once.
+ */
+void mesh_merge_blocks(mesh_t *mesh, const mesh_t *other, int mode,
+                       const uint8_t color[4], int nb, const int (*bpos)[3]);
+
 /*
  * Function: mesh_generate_vertices
  * Generate a vertice array for rendering a mesh block.
@@ -1517,6 +1600,10 @@ struct image {
 
     image_t *history;
     image_t *history_next, *history_prev;
+    // Set when the layers of an undo snapshot have been compacted.
+    history_t *history_diff;
+    int64_t  history_size;      // Memory used by the undo snapshot.
+    uint64_t history_size_key;  // Key of the next snapshot for history_size.
 };
 
 image_t *image_new(void);
@@ -1529,6 +1616,38 @@ void image_merge_visible_layers(image_t *img);
 void image_history_push(image_t *img);
 void image_undo(image_t *img);
 void image_redo(image_t *img);
+
+// Default value of the max memory used by the undo history.
+#define IMAGE_HISTORY_DEFAULT_BUDGET (1LL * GB)
+
+// Statistics of the undo history of an image.
+typedef struct {
+    int         nb_entries;     // Number of undo snapshots.
+    int         nb_compacted;   // Snapshots stored as compressed diffs.
+    int         nb_spilled;     // Compacted snapshots moved to the disk.
+    int64_t     bytes;          // Memory used by the snapshots.
+    int64_t     disk_bytes;     // Size of the spilled snapshots.
+} image_history_stats_t;
+
+// Set the max memory used by the undo history (in byte), or zero for no
+// limit.  Over the budget, the oldest snapshots are compacted into
+// compressed block diffs against the next snapshot, and if spill is set,
+// moved to a temporary file.  They are restored when we undo to them.
+// The new budget is applied to the current image right away.
+void image_history_set_budget(int64_t size, bool spill);
+int64_t image_history_get_budget(bool *spill);
+void image_history_get_stats(image_t *img,
+                             image_history_stats_t *stats);
+
+// Share the data of the blocks with the same content across all the
+// layers, using mesh_intern_blocks, so that repetitive models only keep
+// each different block once.  This is done on the history push, the save
+// and the import, if enabled (disabled by default).
+void image_intern_blocks(image_t *img);
+void image_intern_set_enabled(bool enabled);
+bool image_intern_get_enabled(void);
+// Memory currently saved by the blocks interning, in bytes.
+int64_t image_intern_get_saved(void);
 bool image_layer_can_edit(const image_t *img, const layer_t *layer);
 
 /*
@@ -1877,24 +1996,60 @@ int mustache_render(const mustache_t *m, const char *templ, char *out);
 void mustache_free(mustache_t *m);
 
 // ####### Cache manager #########################
-// Allow to cache blocks merge operations.
+// Keep the results of the costly operations, like the mesh merges.
 typedef struct cache cache_t;
-// Create a new cache with a given max size (in byte).
-cache_t *cache_create(int size);
-// Add an item into the cache.
+// Default value of the max total size of all the caches.
+#define CACHE_DEFAULT_BUDGET (2LL * GB)
+// Statistics of a cache.
+typedef struct {
+    const char      *name;
+    int64_t         hits;
+    int64_t         misses;
+    int64_t         evictions;
+    int64_t         bytes;          // Total cost of the items.
+    int64_t         max_bytes;
+    int             nb_items;
+} cache_stats_t;
+// Create a new cache with a given name and max size (in byte).
+cache_t *cache_create(const char *name, int64_t size);
+// Add an item into the cache.  When the cache, or all the caches together,
+// go over their max size, the least recently used items are evicted.
 // Inputs:
 //  key, keylen     Define the unique key for the cache item.
 //  data            Pointer to the item data.  The cache takes ownership.
-//  cost            Cost of the data used to compute the cache usage.
-//                  It doesn't have to be the size.
+//  cost            Size in bytes of the data, including anything it keeps
+//                  alive, like the blocks of a mesh.  The size of the
+//                  cache item itself is added to it.
 //  delfunc         Function that the cache can use to free the data.
 void cache_add(cache_t *cache, const void *key, int keylen, void *data,
-               int cost, int (*delfunc)(void *data));
+               int64_t cost, int (*delfunc)(void *data));
 // Return an item from the cache.
 // Returns
 //  The data owned by the cache, or NULL if no item with this key is in
 //  the cache.
 void *cache_get(cache_t *cache, const void *key, int keylen);
+// Set the max total size of all the caches (in byte), or zero for no
+// limit.
+void cache_set_budget(int64_t size);
+int64_t cache_get_budget(void);
+// Call a function with the statistics of all the caches, until it returns
+// a non zero value.
+void caches_iter(int (*f)(const cache_stats_t *stats, void *user),
+                 void *user);
+
+// ####### Worker pool ###########################
+// Run the heavy mesh operations on several threads.
+// Return the number of threads used by worker_parallel_for, including the
+// calling thread.
+int worker_get_count(void);
+// Call a function for all the indices in [0, n) using the worker threads,
+// and return once all the calls are done.
+// Inputs:
+//  func            Function to call for each index.  'worker' is the index
+//                  of the thread running it, in [0, worker_get_count()).
+//  user            Passed to the function.
+void worker_parallel_for(int n, void (*func)(int i, int worker, void *user),
+                         void *user);
 
 // ####### Sound #################################
 void sound_init(void);
@@ -1916,5 +2071,11 @@ void cycles_render(uint8_t *buffer, int *w, int *h, const camera_t *cam,
  * Run all the unit tests */
 void tests_run(void);
 
+// Section: bench
+
+/* Function: bench_run
+ * Run all the micro benchmarks and log the results. */
+void bench_run(void);
+
 
 #endif // GOXEL_H
@@ -991,9 +991,53 @@ static void cameras_panel(void)
     gui_group_end();
 }
 
+static int debug_cache_stats(const cache_stats_t *stats, void *user)
+{
+    int64_t nb = stats->hits + stats->misses;
+    ImGui::Text("%s: %d items, %.1f / %.0f MiB", stats->name,
+                stats->nb_items, stats->bytes / (1024. * 1024.),
+                stats->max_bytes / (1024. * 1024.));
+    ImGui::Text("    hits: %d%%, evictions: %d",
+                nb ? (int)(stats->hits * 100 / nb) : 0,
+                (int)stats->evictions);
+    return 0;
+}
+
 static void debug_panel(void)
 {
+    mesh_memory_stats_t stats;
+    image_history_stats_t history;
+    float budget;
+    bool spill, intern;
     ImGui::Text("FPS: %d", (int)round(goxel.fps));
+    mesh_get_memory_stats(&stats);
+    ImGui::Text("Blocks: %d (%d data)",
+                (int)stats.nb_blocks, (int)stats.nb_datas);
+    ImGui::Text("Blocks mem: %.1f MiB (peak %.1f)",
+                stats.bytes / (1024. * 1024.),
+                stats.peak_bytes / (1024. * 1024.));
+    budget = cache_get_budget() / MB;
+    if (gui_input_float("Caches MiB", &budget, 64, 0, 1 << 20, "%.0f"))
+        cache_set_budget((int64_t)budget * MB);
+    caches_iter(debug_cache_stats, NULL);
+    budget = image_history_get_budget(&spill) / MB;
+    if (gui_input_float("Undo MiB", &budget, 64, 0, 1 << 20, "%.0f"))
+        image_history_set_budget((int64_t)budget * MB, spill);
+    if (gui_checkbox("Undo spill to disk", &spill, NULL))
+        image_history_set_budget(image_history_get_budget(NULL), spill);
+    image_history_get_stats(goxel.image, &history);
+    ImGui::Text("Undo: %d snapshots, %.1f MiB", history.nb_entries,
+                history.bytes / (1024. * 1024.));
+    ImGui::Text("    compacted: %d, spilled: %d (%.1f MiB)",
+                history.nb_compacted, history.nb_spilled,
+                history.disk_bytes / (1024. * 1024.));
+    intern = image_intern_get_enabled();
+    if (gui_checkbox("Share identical blocks", &intern, NULL))
+        image_intern_set_enabled(intern);
+    if (intern) {
+        ImGui::Text("    saved: %.1f MiB",
+                    image_intern_get_saved() / (1024. * 1024.));
+    }
     if (!DEFINED(GLES2))
         gui_checkbox("Show wireframe", &goxel.show_wireframe, NULL);
 }
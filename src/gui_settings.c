@@ -102,11 +102,28 @@ static int settings_ini_handler(void *user, const char *section,
                                 int lineno)
 {
     action_t *a;
+    bool spill;
     if (strcmp(section, "ui") == 0) {
         if (strcmp(name, "theme") == 0) {
             theme_set(value);
         }
     }
+    if (strcmp(section, "memory") == 0) {
+        if (strcmp(name, "cache_budget") == 0) {
+            cache_set_budget(atoll(value) * MB);
+        }
+        if (strcmp(name, "history_budget") == 0) {
+            image_history_get_budget(&spill);
+            image_history_set_budget(atoll(value) * MB, spill);
+        }
+        if (strcmp(name, "history_spill") == 0) {
+            image_history_set_budget(image_history_get_budget(NULL),
+                                     atoi(value));
+        }
+        if (strcmp(name, "intern_blocks") == 0) {
+            image_intern_set_enabled(atoi(value));
+        }
+    }
     if (strcmp(section, "shortcuts") == 0) {
         if ((a = action_get(name))) {
             strncpy(a->shortcut, value, sizeof(a->shortcut));
@@ -140,12 +157,20 @@ static void settings_save(void)
 {
     char *path;
     FILE *file;
+    bool spill;
     asprintf(&path, "%s/settings.ini", sys_get_user_dir());
     sys_make_dir(path);
     file = fopen(path, "w");
     fprintf(file, "[ui]\n");
     fprintf(file, "theme=%s\n", theme_get()->name);
 
+    fprintf(file, "[memory]\n");
+    fprintf(file, "cache_budget=%d\n", (int)(cache_get_budget() / MB));
+    fprintf(file, "history_budget=%d\n",
+            (int)(image_history_get_budget(&spill) / MB));
+    fprintf(file, "history_spill=%d\n", spill);
+    fprintf(file, "intern_blocks=%d\n", image_intern_get_enabled());
+
     fprintf(file, "[shortcuts]\n");
     actions_iter(shortcut_save_callback, file);
 
@@ -18,6 +18,8 @@
 
 #include "goxel.h"
 
+#include <zlib.h>
+
 /* History
     the images undo history is stored in a linked list.  Every time we call
     image_history_push, we add the current image snapshot in the list.
@@ -46,6 +48,15 @@
     +--------+       +--------+       +--------+     +--------+
 
 
+    The snapshots share most of their blocks, so each one only costs the
+    memory of the blocks it doesn't share with the next one.  When the
+    total goes over the history budget, the oldest snapshots are compacted:
+    their layers meshes are replaced by the list of blocks that differ
+    from the next snapshot, each compressed with zlib.  They can also be
+    spilled into a temporary file.  A compacted snapshot is rebuilt from
+    the next one just before that next one becomes the current image, so
+    the compacted snapshots always form the start of the list, and the
+    snapshots after img are never compacted.
 */
 
 static layer_t *img_get_layer(const image_t *img, int id)
@@ -178,12 +189,16 @@ static image_t *image_snap(image_t *other)
             img->active_layer = layer;
     }
     img->history_next = img->history_prev = NULL;
+    img->history_diff = NULL;
+    img->history_size = 0;
+    img->history_size_key = 0;
     assert(img->active_layer);
     return img;
 }
 
 
 static void image_delete_camera(image_t *img, camera_t *cam);
+static void history_free_diff(image_t *snap);
 
 void image_delete(image_t *img)
 {
@@ -195,6 +210,7 @@ void image_delete(image_t *img)
     free(img->path);
     hist = img->history;
     DL_FOREACH_SAFE2(hist, snap, snap_tmp, history_next) {
+        history_free_diff(snap);
         DL_FOREACH_SAFE(snap->layers, layer, layer_tmp) {
             DL_DELETE(snap->layers, layer);
             layer_delete(layer);
@@ -401,28 +417,496 @@ static void debug_print_history(image_t *img)
 static void debug_print_history(image_t *img) {}
 #endif
 
-void image_history_push(image_t *img)
+// Compacted layers meshes of an undo snapshot.  For each layer, the data
+// contains the layer id, its mesh key, the number of blocks, and then for
+// each block its position and compressed size followed by the compressed
+// voxels.  A size of zero means that the block is uniform, followed by its
+// color, and a size of -1 that there is no block.
+struct history {
+    uint8_t     *data;      // NULL if spilled into the file.
+    int64_t     size;
+    long        offset;     // Position in the spill file.
+};
+
+static int64_t g_history_budget = IMAGE_HISTORY_DEFAULT_BUDGET;
+static bool g_history_spill = false;
+static FILE *g_spill_file = NULL;
+static int g_nb_spilled = 0;
+
+typedef struct {
+    uint8_t     *data;
+    int64_t     size;
+    int64_t     allocated;
+} buffer_t;
+
+static void buffer_write(buffer_t *buf, const void *data, int64_t size)
+{
+    if (buf->size + size > buf->allocated) {
+        buf->allocated = max(buf->allocated * 2, buf->size + size);
+        buf->data = realloc(buf->data, buf->allocated);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+typedef struct {
+    const mesh_t    *mesh;
+    int             nb;
+    int             (*bpos)[3];
+    uint8_t         **datas;    // Compressed voxels.
+    int             *sizes;
+    uint8_t         (*colors)[4];
+} compact_ctx_t;
+
+static void compact_block(int i, int worker, void *user)
+{
+    compact_ctx_t *ctx = user;
+    uint8_t *voxels;
+    uLongf size;
+    const uLong len = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 4;
+
+    if (!mesh_get_block_data(ctx->mesh, NULL, ctx->bpos[i], NULL, NULL)) {
+        ctx->sizes[i] = -1;
+        return;
+    }
+    if (mesh_get_block_color(ctx->mesh, NULL, ctx->bpos[i], ctx->colors[i]))
+        return;
+    voxels = malloc(len);
+    mesh_get_block_data(ctx->mesh, NULL, ctx->bpos[i], NULL, voxels);
+    size = compressBound(len);
+    ctx->datas[i] = malloc(size);
+    if (compress2(ctx->datas[i], &size, voxels, len, Z_BEST_SPEED) != Z_OK) {
+        free(ctx->datas[i]);
+        ctx->datas[i] = NULL;
+        ctx->sizes[i] = -2; // Error.
+    } else {
+        ctx->sizes[i] = size;
+    }
+    free(voxels);
+}
+
+static void compact_add_block(const int bpos[3], void *user)
+{
+    compact_ctx_t *ctx = user;
+    if (ctx->nb % 64 == 0)
+        ctx->bpos = realloc(ctx->bpos, (ctx->nb + 64) * sizeof(*ctx->bpos));
+    memcpy(ctx->bpos[ctx->nb++], bpos, sizeof(*ctx->bpos));
+}
+
+static layer_t *history_get_layer(const image_t *img, int id)
+{
+    layer_t *layer;
+    DL_FOREACH(img->layers, layer)
+        if (layer->id == id) return layer;
+    return NULL;
+}
+
+// Replace the layers meshes of a snapshot by their differences with the
+// next one.  Return false if the snapshot could not be compacted, in which
+// case it is left untouched.
+static bool history_compact(image_t *snap)
+{
+    layer_t *layer, *base;
+    mesh_t *empty = mesh_new();
+    buffer_t buf = {0};
+    compact_ctx_t ctx;
+    uint64_t key;
+    int i, nb;
+    bool ok = true;
+
+    DL_FOREACH(snap->layers, layer) {
+        base = history_get_layer(snap->history_next, layer->id);
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.mesh = layer->mesh;
+        // Positions reported twice just give the same block twice.
+        mesh_diff_blocks(layer->mesh, base ? base->mesh : empty,
+                         compact_add_block, &ctx);
+        nb = ctx.nb;
+        ctx.datas = calloc(nb, sizeof(*ctx.datas));
+        ctx.sizes = calloc(nb, sizeof(*ctx.sizes));
+        ctx.colors = calloc(nb, sizeof(*ctx.colors));
+        worker_parallel_for(nb, compact_block, &ctx);
+        for (i = 0; i < nb; i++)
+            if (ctx.sizes[i] == -2) ok = false;
+
+        key = mesh_get_key(layer->mesh);
+        buffer_write(&buf, &layer->id, sizeof(layer->id));
+        buffer_write(&buf, &key, sizeof(key));
+        buffer_write(&buf, &nb, sizeof(nb));
+        for (i = 0; i < nb; i++) {
+            buffer_write(&buf, ctx.bpos[i], sizeof(ctx.bpos[i]));
+            buffer_write(&buf, &ctx.sizes[i], sizeof(ctx.sizes[i]));
+            if (ctx.sizes[i] == 0)
+                buffer_write(&buf, ctx.colors[i], sizeof(ctx.colors[i]));
+            if (ctx.sizes[i] > 0)
+                buffer_write(&buf, ctx.datas[i], ctx.sizes[i]);
+            free(ctx.datas[i]);
+        }
+        free(ctx.bpos);
+        free(ctx.datas);
+        free(ctx.sizes);
+        free(ctx.colors);
+        if (!ok) break;
+    }
+    mesh_delete(empty);
+    if (!ok) {
+        LOG_W("Cannot compress the undo history");
+        free(buf.data);
+        return false;
+    }
+
+    DL_FOREACH(snap->layers, layer) {
+        mesh_delete(layer->mesh);
+        layer->mesh = NULL;
+    }
+    snap->history_diff = calloc(1, sizeof(*snap->history_diff));
+    snap->history_diff->data = realloc(buf.data, buf.size);
+    snap->history_diff->size = buf.size;
+    return true;
+}
+
+// Move the data of a compacted snapshot into the spill file.
+static bool history_spill(image_t *snap)
+{
+    history_t *diff = snap->history_diff;
+    if (!g_spill_file) g_spill_file = tmpfile();
+    if (!g_spill_file) {
+        LOG_W("Cannot create the undo history spill file");
+        return false;
+    }
+    fseek(g_spill_file, 0, SEEK_END);
+    diff->offset = ftell(g_spill_file);
+    if (fwrite(diff->data, diff->size, 1, g_spill_file) != 1) {
+        LOG_W("Cannot write the undo history spill file");
+        return false;
+    }
+    free(diff->data);
+    diff->data = NULL;
+    g_nb_spilled++;
+    return true;
+}
+
+static void history_free_diff(image_t *snap)
+{
+    history_t *diff = snap->history_diff;
+    if (!diff) return;
+    if (!diff->data) {
+        // The temporary file is deleted once nothing uses it anymore.
+        if (--g_nb_spilled == 0) {
+            fclose(g_spill_file);
+            g_spill_file = NULL;
+        }
+    }
+    free(diff->data);
+    free(diff);
+    snap->history_diff = NULL;
+}
+
+typedef struct {
+    const uint8_t   **datas;
+    int             *sizes;
+    block_data_t    **blocks;   // Stay NULL if the voxels are corrupted.
+} restore_ctx_t;
+
+static void restore_block(int i, int worker, void *user)
+{
+    restore_ctx_t *ctx = user;
+    uint8_t *voxels;
+    const uLong size = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 4;
+    uLongf len = size;
+
+    if (ctx->sizes[i] <= 0) return;
+    voxels = malloc(size);
+    if (uncompress(voxels, &len, ctx->datas[i], ctx->sizes[i]) == Z_OK &&
+            len == size)
+        ctx->blocks[i] = mesh_block_data_new(voxels);
+    free(voxels);
+}
+
+// Read a value from the compacted data, checking that it is not truncated.
+static bool read_value(const uint8_t **p, const uint8_t *end,
+                       void *out, int size)
+{
+    if (end - *p < size) return false;
+    memcpy(out, *p, size);
+    *p += size;
+    return true;
+}
+
+// Rebuild the mesh of one layer of a compacted snapshot.
+static bool history_restore_layer(image_t *snap, layer_t *layer,
+                                  const uint8_t **p, const uint8_t *end)
+{
+    layer_t *base;
+    mesh_t *empty;
+    restore_ctx_t ctx = {0};
+    uint64_t key;
+    int i, id, nb;
+    int (*bpos)[3];
+    bool ok = true;
+    // Smallest record: a position and a size.
+    const int record_size = 4 * sizeof(int);
+
+    if (!read_value(p, end, &id, sizeof(id)) || id != layer->id ||
+        !read_value(p, end, &key, sizeof(key)) ||
+        !read_value(p, end, &nb, sizeof(nb)) ||
+        nb < 0 || nb > (end - *p) / record_size)
+        return false;
+
+    bpos = calloc(nb, sizeof(*bpos));
+    ctx.datas = calloc(nb, sizeof(*ctx.datas));
+    ctx.sizes = calloc(nb, sizeof(*ctx.sizes));
+    ctx.blocks = calloc(nb, sizeof(*ctx.blocks));
+    for (i = 0; ok && i < nb; i++) {
+        ok = read_value(p, end, bpos[i], sizeof(bpos[i])) &&
+             read_value(p, end, &ctx.sizes[i], sizeof(ctx.sizes[i])) &&
+             ctx.sizes[i] >= -1 && ctx.sizes[i] <= end - *p &&
+             (ctx.sizes[i] != 0 || end - *p >= 4);
+        if (!ok) break;
+        ctx.datas[i] = *p;
+        if (ctx.sizes[i] == 0) *p += 4;
+        if (ctx.sizes[i] > 0) *p += ctx.sizes[i];
+    }
+    if (ok) worker_parallel_for(nb, restore_block, &ctx);
+    for (i = 0; ok && i < nb; i++)
+        if (ctx.sizes[i] > 0 && !ctx.blocks[i]) ok = false;
+
+    if (ok) {
+        empty = mesh_new();
+        base = history_get_layer(snap->history_next, layer->id);
+        layer->mesh = mesh_copy(base ? base->mesh : empty);
+        for (i = 0; i < nb; i++) {
+            if (ctx.sizes[i] == -1)
+                mesh_copy_block(empty, bpos[i], layer->mesh, bpos[i]);
+            if (ctx.sizes[i] == 0)
+                mesh_fill_block(layer->mesh, bpos[i], ctx.datas[i]);
+            if (ctx.sizes[i] > 0)
+                mesh_set_block_data(layer->mesh, bpos[i], ctx.blocks[i]);
+        }
+        mesh_set_key(layer->mesh, key);
+        mesh_delete(empty);
+    }
+    for (i = 0; i < nb; i++)
+        if (ctx.blocks[i]) mesh_block_data_release(ctx.blocks[i]);
+    free(bpos);
+    free(ctx.datas);
+    free(ctx.sizes);
+    free(ctx.blocks);
+    return ok;
+}
+
+// Rebuild the layers meshes of a compacted snapshot from the next one.
+// Return false if the data cannot be read back, in which case the snapshot
+// is left compacted.
+static bool history_restore(image_t *snap)
+{
+    history_t *diff = snap->history_diff;
+    layer_t *layer;
+    const uint8_t *p, *data;
+    uint8_t *tmp = NULL;
+    bool ok = true;
+
+    assert(snap->history_next && !snap->history_next->history_diff);
+    data = diff->data;
+    if (!data) {
+        tmp = malloc(diff->size);
+        if (fseek(g_spill_file, diff->offset, SEEK_SET) != 0 ||
+                fread(tmp, diff->size, 1, g_spill_file) != 1) {
+            LOG_E("Cannot read the undo history spill file");
+            free(tmp);
+            return false;
+        }
+        data = tmp;
+    }
+
+    p = data;
+    DL_FOREACH(snap->layers, layer) {
+        ok = history_restore_layer(snap, layer, &p, data + diff->size);
+        if (!ok) break;
+    }
+    if (ok && p != data + diff->size) ok = false;
+    free(tmp);
+    if (!ok) {
+        LOG_E("Corrupted undo history snapshot");
+        DL_FOREACH(snap->layers, layer) {
+            mesh_delete(layer->mesh);
+            layer->mesh = NULL;
+        }
+        return false;
+    }
+    history_free_diff(snap);
+    return true;
+}
+
+// Memory used by a snapshot, not counting what it shares with the next
+// one.
+static int64_t history_get_size(image_t *snap)
+{
+    layer_t *layer, *base;
+    uint64_t key;
+    int64_t size;
+
+    if (snap->history_diff)
+        return snap->history_diff->data ? snap->history_diff->size : 0;
+    key = image_get_key(snap->history_next);
+    if (snap->history_size_key == key) return snap->history_size;
+    size = sizeof(*snap);
+    DL_FOREACH(snap->layers, layer) {
+        size += sizeof(*layer);
+        base = history_get_layer(snap->history_next, layer->id);
+        size += base ? mesh_get_diff_memory_size(layer->mesh, base->mesh) :
+                       mesh_get_memory_size(layer->mesh);
+    }
+    snap->history_size = size;
+    snap->history_size_key = key;
+    return size;
+}
+
+// Compact and spill the oldest snapshots until we are within the budget.
+static void history_apply_budget(image_t *img)
+{
+    image_t *snap;
+    int64_t total = 0;
+
+    if (!g_history_budget) return;
+    for (snap = img->history; snap != img; snap = snap->history_next)
+        total += history_get_size(snap);
+
+    for (snap = img->history; snap != img && total > g_history_budget;
+         snap = snap->history_next)
+    {
+        if (snap->history_diff || snap->history_next == img) continue;
+        total -= history_get_size(snap);
+        // Stop there, so that the compacted snapshots stay at the start.
+        if (!history_compact(snap)) return;
+        total += history_get_size(snap);
+    }
+
+    if (!g_history_spill) return;
+    for (snap = img->history; snap != img && total > g_history_budget;
+         snap = snap->history_next)
+    {
+        if (!snap->history_diff || !snap->history_diff->data) continue;
+        total -= history_get_size(snap);
+        if (!history_spill(snap)) break;
+    }
+}
+
+static void history_delete_snap(image_t *snap)
 {
-    image_t *snap = image_snap(img);
-    image_t *hist;
     layer_t *layer, *layer_tmp;
+    history_free_diff(snap);
+    DL_FOREACH_SAFE(snap->layers, layer, layer_tmp) {
+        DL_DELETE(snap->layers, layer);
+        layer_delete(layer);
+    }
+    free(snap);
+}
+
+static bool g_intern_enabled = false;
+
+// Intern the blocks of the layers that changed since a snapshot, or all
+// of them if the snapshot is NULL.
+static void image_intern_blocks_since(image_t *img, const image_t *since)
+{
+    layer_t *layer, *base;
+    if (!g_intern_enabled) return;
+    DL_FOREACH(img->layers, layer) {
+        base = since ? history_get_layer(since, layer->id) : NULL;
+        mesh_intern_blocks(layer->mesh, base ? base->mesh : NULL);
+    }
+    mesh_intern_prune();
+}
+
+void image_intern_blocks(image_t *img)
+{
+    image_intern_blocks_since(img, NULL);
+}
+
+void image_intern_set_enabled(bool enabled)
+{
+    g_intern_enabled = enabled;
+    if (!enabled) mesh_intern_clear();
+}
+
+bool image_intern_get_enabled(void)
+{
+    return g_intern_enabled;
+}
+
+int64_t image_intern_get_saved(void)
+{
+    return g_intern_enabled ? mesh_intern_get_saved() : 0;
+}
+
+// Delete the oldest snapshots, up to a given one.  Used when a compacted
+// snapshot cannot be restored: the ones before it depend on it.
+static void history_drop_until(image_t *img, image_t *last)
+{
+    image_t *snap;
+    bool done = false;
+    LOG_W("Drop the undo history that cannot be restored");
+    while (!done) {
+        snap = img->history;
+        done = snap == last;
+        DL_DELETE2(img->history, snap, history_prev, history_next);
+        history_delete_snap(snap);
+    }
+}
+
+void image_history_push(image_t *img)
+{
+    image_t *snap, *hist;
+
+    // The previous snapshot is never compacted, since it's the last one.
+    image_intern_blocks_since(img, img->history_prev);
+    snap = image_snap(img);
 
     // Discard previous undo.
     while ((hist = img->history_next)) {
-        DL_FOREACH_SAFE(hist->layers, layer, layer_tmp) {
-            DL_DELETE(hist->layers, layer);
-            layer_delete(layer);
-        }
         DL_DELETE2(img->history, hist, history_prev, history_next);
-        free(hist);
+        history_delete_snap(hist);
     }
 
     DL_DELETE2(img->history, img,  history_prev, history_next);
     DL_APPEND2(img->history, snap, history_prev, history_next);
     DL_APPEND2(img->history, img,  history_prev, history_next);
+    history_apply_budget(img);
     debug_print_history(img);
 }
 
+void image_history_set_budget(int64_t size, bool spill)
+{
+    g_history_budget = size;
+    g_history_spill = spill;
+    if (goxel.image) history_apply_budget(goxel.image);
+}
+
+int64_t image_history_get_budget(bool *spill)
+{
+    if (spill) *spill = g_history_spill;
+    return g_history_budget;
+}
+
+void image_history_get_stats(image_t *img, image_history_stats_t *stats)
+{
+    image_t *snap;
+    memset(stats, 0, sizeof(*stats));
+    // Like for the budget, we only count the undo snapshots, not the redo
+    // ones after img.
+    for (snap = img->history; snap != img; snap = snap->history_next) {
+        stats->nb_entries++;
+        if (snap->history_diff) {
+            stats->nb_compacted++;
+            if (!snap->history_diff->data) {
+                stats->nb_spilled++;
+                stats->disk_bytes += snap->history_diff->size;
+            }
+        }
+        stats->bytes += history_get_size(snap);
+    }
+}
+
 // XXX: not clear what this is doing.  We should try to remove it.
 // It swap the content of two images without touching their pointer or
 // history.
@@ -441,6 +925,11 @@ void image_undo(image_t *img)
         LOG_D("No more undo");
         return;
     }
+    // The snapshot before prev is compared to it, so rebuild it before
+    // prev becomes the current image.
+    if (prev->history_prev && prev->history_prev->history_diff &&
+            !history_restore(prev->history_prev))
+        history_drop_until(img, prev->history_prev);
     DL_DELETE2(img->history, img, history_prev, history_next);
     DL_PREPEND_ELEM2(img->history, prev, img, history_prev, history_next);
     swap(img, prev);
@@ -42,6 +42,7 @@ typedef struct
     char *input;
     char *export;
     float scale;
+    bool bench;
 } args_t;
 
 #ifndef NO_ARGP
@@ -54,6 +55,7 @@ static char args_doc[] = "[INPUT]";
 static struct argp_option options[] = {
     {"export",   'e', "FILENAME", 0, "Export the model to a file" },
     {"scale",    's', "FLOAT", 0, "Set UI scale (for retina display)"},
+    {"bench",    'b', NULL, 0, "Run the benchmarks and exit"},
     {},
 };
 
@@ -70,6 +72,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 's':
         args->scale = atof(arg);
         break;
+    case 'b':
+        args->bench = true;
+        break;
     case ARGP_KEY_ARG:
         if (state->arg_num >= 1)
             argp_usage(state);
@@ -202,6 +207,11 @@ int main(int argc, char **argv)
 #endif
     g_scale = args.scale;
 
+    if (args.bench) {
+        bench_run();
+        return 0;
+    }
+
     glfwInit();
     glfwWindowHint(GLFW_SAMPLES, 4);
     monitor = glfwGetPrimaryMonitor();
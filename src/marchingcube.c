@@ -255,6 +255,8 @@ int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
     int i, vi, x, y, z, v, vx, vy, vz, nb_tri, nb_tri_tot = 0;
     uint8_t color[4] = {255, 255, 255, 255}, tmp[4];
     uint8_t *data;
+    uint64_t mask[BLOCK_MASK_SIZE];
+    uint32_t row;
 
     int densities[8];
     int p[3], s[3];
@@ -276,7 +278,7 @@ int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
     s[0] = N + 2;
     s[1] = N + 2;
     s[2] = N + 2;
-    mesh_read(mesh, p, s, data);
+    mesh_read_region(mesh, p, s, data);
 
 #define get_at(d, x, y, z, out) do { \
     memcpy(out, &data[( \
@@ -285,11 +287,28 @@ int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
                 (z + 1) * (N + 2) * (N + 2)) * 4], 4); \
 } while (0)
 
-    // Get the smallest rect we need to consider.
+    // Get the smallest rect we need to consider.  We use the block mask
+    // for the inside voxels, one row at a time, and only check the data for
+    // the border voxels.
     // XXX: can we measure how much we gain with that?
+    mesh_get_block_mask(mesh, NULL, block_pos, mask, NULL);
+    for (i = 0; i < N * N; i++) {
+        row = (mask[i / 4] >> (i % 4 * 16)) & 0xffff;
+        if (!row) continue;
+        y = i % N;
+        z = i / N;
+        rect[0][0] = min(rect[0][0], __builtin_ctz(row) - 2);
+        rect[0][1] = min(rect[0][1], y - 2);
+        rect[0][2] = min(rect[0][2], z - 2);
+        rect[1][0] = max(rect[1][0], 31 - __builtin_clz(row) + 2);
+        rect[1][1] = max(rect[1][1], y + 2);
+        rect[1][2] = max(rect[1][2], z + 2);
+    }
     for (z = -1; z < N + 1; z++)
     for (y = -1; y < N + 1; y++)
     for (x = -1; x < N + 1; x++) {
+        if (x == 0 && y >= 0 && y < N && z >= 0 && z < N)
+            x = N; // Skip the inside voxels.
         get_at(data, x, y, z, tmp);
         if (tmp[3]) {
             rect[0][0] = min(rect[0][0], x - 2);
@@ -17,10 +17,11 @@
  */
 
 #include "mesh.h"
-#include "uthash.h"
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define min(a, b) ({ \
       __typeof__ (a) _a = (a); \
@@ -41,32 +42,122 @@ enum {
     MESH_ITER_MESH2                     = 1 << 11,
 };
 
-typedef struct block_data block_data_t;
+/*
+ * The block data voxels can be encoded in three ways, depending on the
+ * number of different values in the block:
+ *
+ * - Uniform blocks (bits = 0) only store a single color.
+ *
+ * - Palette blocks (bits = 1, 2, 4 or 8) store a palette of up to 256
+ *   colors, and a packed palette index per voxel.  We also keep the number
+ *   of voxels using each palette entry, so that we can reuse the unused
+ *   entries, and detect when the block becomes uniform.  When we run out of
+ *   entries, the block is promoted to the next bit depth.
+ *
+ * - RGBA blocks (bits = 32) store all the voxels values.  In that case we
+ *   keep track of the number of voxels that have the value 'color', so that
+ *   we can also detect when the block becomes uniform again.
+ *
+ * We also need occupancy masks with one bit per voxel: the voxels with a
+ * non zero alpha, and the opaque voxels (alpha >= 127), so that we can
+ * quickly skip the empty parts of a block.  The blocks with 4 bits or more
+ * per voxel keep their masks up to date, for smaller blocks it's cheap to
+ * compute them from the palette indices when needed, and it saves memory.
+ *
+ * The masks, palette, counts and indices arrays are all allocated in a
+ * single buffer.
+ *
+ * The number of non empty voxels and their bounding box inside the block
+ * are cached in the 'extents' field, computed from the occupancy mask the
+ * first time they are needed, and reset each time we modify the data.
+ */
 struct block_data
 {
     int         ref;
     uint64_t    id;
-    uint8_t     voxels[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE][4]; // RGBA voxels.
+    int         bits;           // Bits per voxel: 0, 1, 2, 4, 8 or 32.
+    uint8_t     color[4];       // Uniform color, or tracked RGBA color.
+    int         nb_color;       // Number of voxels with the tracked color.
+    uint8_t     (*palette)[4];  // Palette of (1 << bits) entries.
+    uint16_t    *counts;        // Number of voxels using each entry.
+    uint8_t     *indices;       // Packed palette index of all the voxels.
+    uint8_t     (*voxels)[4];   // RGBA voxels, only if bits == 32.
+    uint64_t    *mask;          // Occupancy mask, only if bits >= 4.
+    uint64_t    *opaque;        // Mask of the voxels with alpha >= 127.
+    void        *storage;       // Allocated buffer for the arrays.
+    uint64_t    extents;        // Packed voxels count and box, or zero.
 };
 
+// Alpha value from which we consider a voxel opaque.
+#define OPAQUE_ALPHA 127
+
 struct block
 {
-    UT_hash_handle  hh;     // The hash table of pos -> blocks in a mesh.
     block_data_t    *data;
     int             pos[3];
     uint64_t        id;
+    int             ref;
+    uint64_t        owner;  // Owner id of the mesh that can modify it.
+};
+
+/*
+ * The blocks of a mesh are stored in a persistent hash array mapped trie
+ * (HAMT), so that copies of a mesh share all the nodes and blocks they
+ * don't modify, and writing after a copy only duplicates the path to the
+ * modified block.
+ *
+ * The key of a block is its position packed into 64 bits, mixed with a
+ * bijective hash function, so that two blocks never have the same hash.
+ * Each node consumes 6 bits of the hash, starting from the most
+ * significant ones, and has a bitmap of its 64 possible entries followed
+ * by the array of the used ones.  An entry is either a block or a sub
+ * node, tagged with the lowest bit of the pointer.  Walking the trie in
+ * order yields the blocks sorted by hash, so the iterators can find the
+ * next block from the current position alone, even if the mesh was
+ * modified in between.
+ *
+ * Nodes and blocks are reference counted, and a mesh can modify in place
+ * any node or block that is only referenced by its own tree.  To avoid
+ * walking the tree for every voxel write, the blocks also remember the
+ * owner id of the mesh that last got them for writing: copying a mesh
+ * gives new owner ids to both meshes, which invalidates the cached
+ * ownership of all their blocks.
+ */
+typedef struct node node_t;
+struct node
+{
+    int         ref;
+    uint64_t    bitmap;     // Bitmap of the used entries.
+    void        *entries[]; // Tagged pointers to the blocks or sub nodes.
 };
 
 struct mesh
 {
-    block_t *blocks;
-    int *ref;   // Used to implement copy on write of the blocks.
-    uint64_t key; // Two meshes with the same key have the same value.
+    node_t *root;   // NULL if the mesh has no blocks.
+    uint64_t key;   // Two meshes with the same key have the same value.
+    uint64_t owner; // Id of the mesh for the blocks ownership.
 };
 
 static uint64_t g_uid = 2; // Global id counter.
 
+/*
+ * All the reference counters and the global id counter are modified with
+ * atomic operations, so that meshes sharing some blocks can be used from
+ * different threads.  A reference counter equal to one means that nobody
+ * else can access the object, so we can modify it in place.
+ */
+#define ATOMIC_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define ATOMIC_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_GET(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_SET(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELEASE)
+
+static uint64_t new_uid(void)
+{
+    return __atomic_fetch_add(&g_uid, 1, __ATOMIC_RELAXED);
+}
+
 #define N BLOCK_SIZE
+#define MASK_BYTES (N * N * N / 8)
 
 #define vec3_copy(a, b) do {b[0] = a[0]; b[1] = a[1]; b[2] = a[2];} while (0)
 #define vec3_equal(a, b) (b[0] == a[0] && b[1] == a[1] && b[2] == a[2])
@@ -76,7 +167,7 @@ static uint64_t g_uid = 2; // Global id counter.
         for (y = 0; y < N; y++) \
             for (x = 0; x < N; x++)
 
-#define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
+#define DATA_AT(d, x, y, z) (block_data_at(d, x + y * N + z * N * N))
 #define BLOCK_AT(c, x, y, z) (DATA_AT(c->data, x, y, z))
 
 static void mat4_mul_vec4(float mat[4][4], const float v[4], float out[4])
@@ -127,83 +218,936 @@ static void bbox_intersection(int a[2][3], int b[2][3], int out[2][3])
     }
 }
 
+// Limit of the packed block position: 21 bits per axis.
+#define BLOCK_KEY_MAX (1 << 20)
+
+static uint64_t block_hash(const int pos[3])
+{
+    uint64_t key;
+    assert(pos[0] / N >= -BLOCK_KEY_MAX && pos[0] / N < BLOCK_KEY_MAX);
+    assert(pos[1] / N >= -BLOCK_KEY_MAX && pos[1] / N < BLOCK_KEY_MAX);
+    assert(pos[2] / N >= -BLOCK_KEY_MAX && pos[2] / N < BLOCK_KEY_MAX);
+    key = ((uint64_t)((pos[0] / N) & 0x1fffff) << 42) |
+          ((uint64_t)((pos[1] / N) & 0x1fffff) << 21) |
+          ((uint64_t)((pos[2] / N) & 0x1fffff) << 0);
+    // Mixing function from splitmix64, all the steps are invertible.
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+/*
+ * Pool allocator for the blocks and the blocks data.
+ *
+ * Each object size (block, block data header, and the storage buffer of
+ * each bit depth) has its own pool with a free list of released objects,
+ * so that copying and modifying blocks doesn't have to go through malloc
+ * and free all the time.  The objects are taken from slabs of
+ * POOL_SLAB_SIZE bytes, except for the RGBA buffers that are big enough to
+ * be allocated individually.  Slabs are never released, but we cap the
+ * number of individually allocated objects we keep in the free lists.
+ *
+ * Each pool is protected by a spin lock so that the allocator can be used
+ * from several threads.
+ */
+typedef struct pool_item pool_item_t;
+struct pool_item {
+    pool_item_t *next;
+};
+
+typedef struct {
+    int         size;       // Size of the objects.
+    bool        slab;       // Set if we allocate the objects from slabs.
+    int         lock;
+    pool_item_t *free_list;
+    int         nb_free;
+    int64_t     nb_live;    // Number of objects currently in use.
+    int64_t     nb_peak;    // Max value of nb_live.
+    int64_t     nb_slabs;
+} pool_t;
+
+#define POOL_SLAB_SIZE (256 * 1024)
+#define POOL_MAX_FREE_BYTES (16 * 1024 * 1024)
+
+// Total size of the objects in use, and its max value.
+static int64_t g_pool_bytes = 0;
+static int64_t g_pool_peak_bytes = 0;
+
+// Round the objects size so that they stay aligned inside the slabs.
+#define POOL_SIZE(size) (((size) + 15) & ~15)
+
+// Size of the storage buffer for a given bit depth.
+#define STORAGE_SIZE(bits) (((bits) >= 4 ? 2 * MASK_BYTES : 0) + \
+        ((bits) == 32 ? N * N * N * 4 : \
+         (1 << (bits)) * (4 + sizeof(uint16_t)) + N * N * N * (bits) / 8))
+
+enum {
+    POOL_BLOCK,
+    POOL_DATA,
+    POOL_STORAGE_1,
+    POOL_STORAGE_2,
+    POOL_STORAGE_4,
+    POOL_STORAGE_8,
+    POOL_STORAGE_32,
+    POOL_COUNT
+};
+
+static pool_t g_pools[POOL_COUNT] = {
+    [POOL_BLOCK]        = {POOL_SIZE(sizeof(block_t)), true},
+    [POOL_DATA]         = {POOL_SIZE(sizeof(block_data_t)), true},
+    [POOL_STORAGE_1]    = {POOL_SIZE(STORAGE_SIZE(1)), true},
+    [POOL_STORAGE_2]    = {POOL_SIZE(STORAGE_SIZE(2)), true},
+    [POOL_STORAGE_4]    = {POOL_SIZE(STORAGE_SIZE(4)), true},
+    [POOL_STORAGE_8]    = {POOL_SIZE(STORAGE_SIZE(8)), true},
+    [POOL_STORAGE_32]   = {POOL_SIZE(STORAGE_SIZE(32)), false},
+};
+
+static void pool_lock(pool_t *pool)
+{
+    while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE)) {}
+}
+
+static void pool_unlock(pool_t *pool)
+{
+    __atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+
+// Cut a new slab into objects and add them to the free list.
+static void pool_add_slab(pool_t *pool)
+{
+    int i, nb = POOL_SLAB_SIZE / pool->size;
+    uint8_t *slab = malloc(nb * pool->size);
+    pool_item_t *item;
+    for (i = nb - 1; i >= 0; i--) {
+        item = (void*)(slab + i * pool->size);
+        item->next = pool->free_list;
+        pool->free_list = item;
+    }
+    pool->nb_free += nb;
+    pool->nb_slabs++;
+}
+
+static void *pool_alloc(pool_t *pool)
+{
+    pool_item_t *item;
+    int64_t bytes, peak;
+    pool_lock(pool);
+    if (!pool->free_list && pool->slab) pool_add_slab(pool);
+    item = pool->free_list;
+    if (item) {
+        pool->free_list = item->next;
+        pool->nb_free--;
+    }
+    pool->nb_live++;
+    pool->nb_peak = max(pool->nb_peak, pool->nb_live);
+    pool_unlock(pool);
+
+    bytes = __atomic_add_fetch(&g_pool_bytes, pool->size, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&g_pool_peak_bytes, __ATOMIC_RELAXED);
+    while (bytes > peak && !__atomic_compare_exchange_n(
+                &g_pool_peak_bytes, &peak, bytes, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    return item ?: malloc(pool->size);
+}
+
+static void pool_free(pool_t *pool, void *ptr)
+{
+    pool_item_t *item = ptr;
+    if (!ptr) return;
+    pool_lock(pool);
+    pool->nb_live--;
+    if (pool->slab || pool->nb_free * pool->size < POOL_MAX_FREE_BYTES) {
+        item->next = pool->free_list;
+        pool->free_list = item;
+        pool->nb_free++;
+        item = NULL;
+    }
+    pool_unlock(pool);
+    __atomic_sub_fetch(&g_pool_bytes, pool->size, __ATOMIC_RELAXED);
+    free(item);
+}
+
+static pool_t *storage_pool(int bits)
+{
+    switch (bits) {
+    case 1: return &g_pools[POOL_STORAGE_1];
+    case 2: return &g_pools[POOL_STORAGE_2];
+    case 4: return &g_pools[POOL_STORAGE_4];
+    case 8: return &g_pools[POOL_STORAGE_8];
+    case 32: return &g_pools[POOL_STORAGE_32];
+    default: assert(false); return NULL;
+    }
+}
+
 static block_data_t *get_empty_data(void)
 {
-    static block_data_t *data = NULL;
-    if (!data) {
-        data = calloc(1, sizeof(*data));
-        data->ref = 1;
-        data->id = 0;
+    // Never released, since we keep a reference to it.
+    static block_data_t data = {.ref = 1, .id = 0};
+    return &data;
+}
+
+static int block_data_storage_size(int bits)
+{
+    return bits ? STORAGE_SIZE(bits) : 0;
+}
+
+// Release the storage buffer of a block data.
+static void block_data_free_storage(block_data_t *data)
+{
+    if (data->bits) pool_free(storage_pool(data->bits), data->storage);
+}
+
+// Allocate the storage buffer for a given bit depth.
+static void block_data_alloc(block_data_t *data, int bits)
+{
+    int nb;
+    uint8_t *p;
+    data->bits = bits;
+    data->storage = NULL;
+    data->palette = NULL;
+    data->counts = NULL;
+    data->indices = NULL;
+    data->voxels = NULL;
+    data->mask = NULL;
+    data->opaque = NULL;
+    if (bits == 0) return;
+    p = data->storage = pool_alloc(storage_pool(bits));
+    if (bits >= 4) {
+        data->mask = (void*)p;
+        data->opaque = (void*)(p + MASK_BYTES);
+        p += 2 * MASK_BYTES;
+    }
+    if (bits == 32) {
+        data->voxels = (void*)p;
+        return;
+    }
+    nb = 1 << bits;
+    data->palette = (void*)p;
+    data->counts = (void*)(p + nb * 4);
+    data->indices = p + nb * (4 + sizeof(uint16_t));
+}
+
+static void block_data_delete(block_data_t *data)
+{
+    block_data_free_storage(data);
+    pool_free(&g_pools[POOL_DATA], data);
+}
+
+static block_data_t *block_data_copy(const block_data_t *other)
+{
+    block_data_t *data = pool_alloc(&g_pools[POOL_DATA]);
+    memset(data, 0, sizeof(*data));
+    memcpy(data->color, other->color, 4);
+    data->nb_color = other->nb_color;
+    block_data_alloc(data, other->bits);
+    if (data->storage) {
+        memcpy(data->storage, other->storage,
+               block_data_storage_size(other->bits));
+    }
+    data->extents = ATOMIC_GET(other->extents);
+    data->ref = 1;
+    return data;
+}
+
+static inline int block_data_get_index(const block_data_t *data, int i)
+{
+    const int bits = data->bits;
+    return (data->indices[(i * bits) >> 3] >> ((i * bits) & 7)) &
+           ((1 << bits) - 1);
+}
+
+static inline void block_data_set_index(block_data_t *data, int i, int e)
+{
+    const int bits = data->bits;
+    const int shift = (i * bits) & 7;
+    uint8_t *p = &data->indices[(i * bits) >> 3];
+    *p = (*p & ~(((1 << bits) - 1) << shift)) | (e << shift);
+}
+
+// Return a pointer to the RGBA value of a voxel.
+static inline const uint8_t *block_data_at(const block_data_t *data, int i)
+{
+    if (data->bits == 0) return data->color;
+    if (data->bits == 32) return data->voxels[i];
+    return data->palette[block_data_get_index(data, i)];
+}
+
+static inline void mask_set(uint64_t *mask, int i, bool v)
+{
+    if (v)
+        mask[i / 64] |= 1ULL << (i % 64);
+    else
+        mask[i / 64] &= ~(1ULL << (i % 64));
+}
+
+static inline bool alpha_test(uint8_t alpha, bool opaque)
+{
+    return opaque ? alpha >= OPAQUE_ALPHA : alpha != 0;
+}
+
+// Get the occupancy or opaque mask of a block data.  Return either a
+// pointer to the block mask, or to the 'tmp' buffer where we computed it.
+static const uint64_t *block_data_get_mask(const block_data_t *data,
+                                           bool opaque,
+                                           uint64_t tmp[BLOCK_MASK_SIZE])
+{
+    static const uint64_t zero[BLOCK_MASK_SIZE] = {};
+    static const uint64_t full[BLOCK_MASK_SIZE] = {
+        [0 ... BLOCK_MASK_SIZE - 1] = UINT64_MAX};
+    const int bits = data->bits;
+    int i, j, e, per_byte, flags = 0;
+    uint8_t table[256];
+
+    if (bits == 0) return alpha_test(data->color[3], opaque) ? full : zero;
+    if (data->mask) return opaque ? data->opaque : data->mask;
+    per_byte = 8 / bits;
+
+    // Compute the mask bits of each possible indices byte value.
+    for (e = 0; e < 1 << bits; e++) {
+        if (data->counts[e] && alpha_test(data->palette[e][3], opaque))
+            flags |= 1 << e;
+    }
+    for (i = 0; i < 256; i++) {
+        table[i] = 0;
+        for (j = 0; j < per_byte; j++) {
+            e = (i >> (j * bits)) & ((1 << bits) - 1);
+            if (flags & (1 << e)) table[i] |= 1 << j;
+        }
+    }
+    memset(tmp, 0, MASK_BYTES);
+    for (i = 0; i < N * N * N * bits / 8; i++) {
+        tmp[i * per_byte / 64] |=
+            (uint64_t)table[data->indices[i]] << (i * per_byte % 64);
+    }
+    return tmp;
+}
+
+// Copy all the voxels of a block data into a buffer.
+static void block_data_read(const block_data_t *data, uint8_t *out)
+{
+    int i;
+    if (data->bits == 32) {
+        memcpy(out, data->voxels, N * N * N * 4);
+        return;
+    }
+    if (data->bits == 0) {
+        for (i = 0; i < N * N * N; i++)
+            memcpy(out + i * 4, data->color, 4);
+        return;
+    }
+    for (i = 0; i < N * N * N; i++)
+        memcpy(out + i * 4, data->palette[block_data_get_index(data, i)], 4);
+}
+
+static bool block_data_is_uniform(const block_data_t *data,
+                                  const uint8_t v[4])
+{
+    return data->bits == 0 && memcmp(data->color, v, 4) == 0;
+}
+
+static void block_data_set_uniform(block_data_t *data, const uint8_t v[4])
+{
+    block_data_free_storage(data);
+    block_data_alloc(data, 0);
+    memcpy(data->color, v, 4);
+}
+
+// Change the bit depth of a uniform or palette block to a bigger value,
+// keeping the content.
+static void block_data_promote(block_data_t *data, int bits)
+{
+    block_data_t old = *data;
+    int i;
+    uint64_t tmp[BLOCK_MASK_SIZE];
+    assert(bits > old.bits);
+    block_data_alloc(data, bits);
+    if (data->mask) {
+        memcpy(data->mask, block_data_get_mask(&old, false, tmp), MASK_BYTES);
+        memcpy(data->opaque, block_data_get_mask(&old, true, tmp),
+               MASK_BYTES);
+    }
+
+    if (bits == 32) {
+        block_data_read(&old, (uint8_t*)data->voxels);
+        memcpy(data->color, data->voxels[0], 4);
+        data->nb_color = 0;
+        for (i = 0; i < N * N * N; i++) {
+            if (memcmp(data->voxels[i], data->color, 4) == 0)
+                data->nb_color++;
+        }
+        block_data_free_storage(&old);
+        return;
+    }
+
+    memset(data->counts, 0, (1 << bits) * sizeof(uint16_t));
+    memset(data->indices, 0, N * N * N * bits / 8);
+    if (old.bits == 0) {
+        memcpy(data->palette[0], old.color, 4);
+        data->counts[0] = N * N * N;
+        return;
+    }
+    // The palette entries stay the same, only the indices have to be
+    // repacked.
+    memcpy(data->palette, old.palette, (1 << old.bits) * 4);
+    memcpy(data->counts, old.counts, (1 << old.bits) * sizeof(uint16_t));
+    for (i = 0; i < N * N * N; i++)
+        block_data_set_index(data, i, block_data_get_index(&old, i));
+    block_data_free_storage(&old);
+}
+
+static void block_data_set_at_rgba(block_data_t *data, int i,
+                                   const uint8_t v[4])
+{
+    int j;
+    if (memcmp(data->voxels[i], v, 4) == 0) return;
+    if (memcmp(data->voxels[i], data->color, 4) == 0)
+        data->nb_color--;
+    else if (memcmp(v, data->color, 4) == 0)
+        data->nb_color++;
+    memcpy(data->voxels[i], v, 4);
+
+    // If no voxels have the tracked color anymore, we start to track the
+    // new value instead.  This happens for example when we fill a block,
+    // so that we can detect that it became uniform.
+    if (data->nb_color == 0) {
+        memcpy(data->color, v, 4);
+        for (j = 0; j < N * N * N; j++) {
+            if (memcmp(data->voxels[j], v, 4) == 0) data->nb_color++;
+        }
+    }
+    if (data->nb_color == N * N * N) block_data_set_uniform(data, v);
+}
+
+static void block_data_set_at_(block_data_t *data, int i,
+                               const uint8_t v[4])
+{
+    int e, old, nb, free_entry = -1;
+
+    if (data->bits == 0) {
+        if (memcmp(data->color, v, 4) == 0) return;
+        block_data_promote(data, 1);
+    }
+    if (data->bits == 32) {
+        block_data_set_at_rgba(data, i, v);
+        return;
+    }
+
+    old = block_data_get_index(data, i);
+    if (memcmp(data->palette[old], v, 4) == 0) return;
+
+    // Search for the color in the palette.
+    nb = 1 << data->bits;
+    for (e = 0; e < nb; e++) {
+        if (!data->counts[e]) {
+            if (free_entry == -1) free_entry = e;
+            continue;
+        }
+        if (memcmp(data->palette[e], v, 4) == 0) break;
+    }
+    if (e == nb) {
+        if (free_entry == -1) {
+            if (data->bits == 8) {
+                block_data_promote(data, 32);
+                block_data_set_at_rgba(data, i, v);
+                return;
+            }
+            block_data_promote(data, data->bits * 2);
+            free_entry = nb;
+        }
+        e = free_entry;
+        memcpy(data->palette[e], v, 4);
+    }
+
+    data->counts[old]--;
+    data->counts[e]++;
+    block_data_set_index(data, i, e);
+    if (data->counts[e] == N * N * N) block_data_set_uniform(data, v);
+}
+
+// Set a voxel value, changing the block encoding if needed.
+static void block_data_set_at(block_data_t *data, int i, const uint8_t v[4])
+{
+    block_data_set_at_(data, i, v);
+    ATOMIC_SET(data->extents, 0);
+    if (!data->mask) return;
+    mask_set(data->mask, i, v[3]);
+    mask_set(data->opaque, i, v[3] >= OPAQUE_ALPHA);
+}
+
+// Read 'n' consecutive RGBA voxels of a block data, starting at index i.
+static void block_data_read_row(const block_data_t *data, int i, int n,
+                                uint8_t *out)
+{
+    int j;
+    if (data->bits == 32) {
+        memcpy(out, data->voxels[i], n * 4);
+        return;
+    }
+    if (data->bits == 0) {
+        for (j = 0; j < n; j++) memcpy(out + j * 4, data->color, 4);
+        return;
+    }
+    for (j = 0; j < n; j++)
+        memcpy(out + j * 4, data->palette[block_data_get_index(data, i + j)],
+               4);
+}
+
+// Create a new block data from N^3 RGBA voxels, using the smallest
+// encoding that can represent them.  Return the shared empty data if all
+// the voxels are zero.
+static block_data_t *block_data_new(const uint8_t (*voxels)[4])
+{
+    block_data_t *data;
+    // Small open addressing hash table from the colors to their index.
+    uint32_t keys[512], palette[256], c, prev = 0;
+    int16_t values[512];
+    uint8_t indices[N * N * N];
+    int i, h, nb = 0, bits;
+
+    memset(values, -1, sizeof(values));
+    for (i = 0; i < N * N * N; i++) {
+        memcpy(&c, voxels[i], 4);
+        if (i && c == prev) {
+            indices[i] = indices[i - 1];
+            continue;
+        }
+        prev = c;
+        h = (c * 2654435761u) >> 23;
+        while (values[h] != -1 && keys[h] != c) h = (h + 1) & 511;
+        if (values[h] == -1) {
+            if (nb == 256) break;
+            keys[h] = c;
+            values[h] = nb;
+            palette[nb++] = c;
+        }
+        indices[i] = values[h];
+    }
+
+    if (nb == 1 && palette[0] == 0) {
+        data = get_empty_data();
+        ATOMIC_INC(data->ref);
+        return data;
+    }
+    data = pool_alloc(&g_pools[POOL_DATA]);
+    memset(data, 0, sizeof(*data));
+    data->ref = 1;
+    data->id = new_uid();
+
+    if (nb == 1) {
+        block_data_alloc(data, 0);
+        memcpy(data->color, palette, 4);
+        return data;
+    }
+    if (i < N * N * N) { // More than 256 colors.
+        block_data_alloc(data, 32);
+        memcpy(data->voxels, voxels, N * N * N * 4);
+        memcpy(data->color, voxels[0], 4);
+        for (i = 0; i < N * N * N; i++) {
+            if (memcmp(voxels[i], data->color, 4) == 0) data->nb_color++;
+        }
+    } else {
+        for (bits = 1; (1 << bits) < nb; bits *= 2) {}
+        block_data_alloc(data, bits);
+        memset(data->palette, 0, (1 << bits) * 4);
+        memcpy(data->palette, palette, nb * 4);
+        memset(data->counts, 0, (1 << bits) * sizeof(uint16_t));
+        memset(data->indices, 0, N * N * N * bits / 8);
+        for (i = 0; i < N * N * N; i++) {
+            data->counts[indices[i]]++;
+            block_data_set_index(data, i, indices[i]);
+        }
+    }
+    if (data->mask) {
+        for (i = 0; i < N * N * N; i++) {
+            mask_set(data->mask, i, voxels[i][3]);
+            mask_set(data->opaque, i, voxels[i][3] >= OPAQUE_ALPHA);
+        }
     }
     return data;
 }
 
+// Test if any bit of a mask is set.
+static bool mask_any(const uint64_t *mask)
+{
+    int i;
+    uint64_t ret = 0;
+    for (i = 0; i < BLOCK_MASK_SIZE; i++) ret |= mask[i];
+    return ret;
+}
+
+#define EXTENTS_VALID (1ULL << 63)
+
+// Get the number of non empty voxels of a block data, and their bounding
+// box relative to the block.  The value is cached in the data, since the
+// data can be shared between threads we pack it into a single integer.
+static int block_data_get_extents(block_data_t *data, int box[2][3])
+{
+    uint64_t v = ATOMIC_GET(data->extents), tmp[BLOCK_MASK_SIZE];
+    const uint64_t *mask;
+    uint32_t row, xs = 0, ys = 0, zs = 0;
+    int i, j, count = 0;
+
+    if (!(v & EXTENTS_VALID)) {
+        mask = block_data_get_mask(data, false, tmp);
+        for (i = 0; i < BLOCK_MASK_SIZE; i++) {
+            if (!mask[i]) continue;
+            count += __builtin_popcountll(mask[i]);
+            // Each mask word contains four rows of N voxels along x.
+            for (j = 0; j < 4; j++) {
+                row = (mask[i] >> (j * 16)) & 0xffff;
+                if (!row) continue;
+                xs |= row;
+                ys |= 1 << ((i * 4 + j) % N);
+                zs |= 1 << ((i * 4 + j) / N);
+            }
+        }
+        v = EXTENTS_VALID | count;
+        if (count) {
+            v |= (uint64_t)__builtin_ctz(xs) << 16 |
+                 (uint64_t)__builtin_ctz(ys) << 21 |
+                 (uint64_t)__builtin_ctz(zs) << 26 |
+                 (uint64_t)(32 - __builtin_clz(xs)) << 31 |
+                 (uint64_t)(32 - __builtin_clz(ys)) << 36 |
+                 (uint64_t)(32 - __builtin_clz(zs)) << 41;
+        }
+        ATOMIC_SET(data->extents, v);
+    }
+    for (i = 0; i < 6; i++)
+        box[i / 3][i % 3] = (v >> (16 + i * 5)) & 31;
+    return v & 0xffff;
+}
+
 static bool block_is_empty(const block_t *block, bool fast)
 {
-    int x, y, z;
+    uint64_t tmp[BLOCK_MASK_SIZE];
     if (!block) return true;
     if (block->data->id == 0) return true;
     if (fast) return false;
+    return !mask_any(block_data_get_mask(block->data, false, tmp));
+}
 
-    BLOCK_ITER(x, y, z) {
-        if (BLOCK_AT(block, x, y, z)[3]) return false;
+// Copy the occupancy or opaque mask of a block, return false if the block
+// is empty.
+static bool block_get_mask(const block_t *block, uint64_t out[], bool opaque)
+{
+    const uint64_t *mask;
+    if (!block) {
+        memset(out, 0, MASK_BYTES);
+        return false;
     }
-    return true;
+    mask = block_data_get_mask(block->data, opaque, out);
+    if (mask != out) memcpy(out, mask, MASK_BYTES);
+    return mask_any(out);
 }
 
-static block_t *block_new(const int pos[3])
+static block_t *block_new(const int pos[3], uint64_t owner)
 {
-    block_t *block = calloc(1, sizeof(*block));
+    block_t *block = pool_alloc(&g_pools[POOL_BLOCK]);
+    memset(block, 0, sizeof(*block));
     memcpy(block->pos, pos, sizeof(block->pos));
     block->data = get_empty_data();
-    block->data->ref++;
-    block->id = g_uid++;
+    ATOMIC_INC(block->data->ref);
+    block->id = new_uid();
+    block->ref = 1;
+    block->owner = owner;
     return block;
 }
 
-static void block_delete(block_t *block)
+static void block_data_release(block_data_t *data)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-    }
-    free(block);
+    if (ATOMIC_DEC(data->ref) == 0) block_data_delete(data);
+}
+
+static void block_release(block_t *block)
+{
+    if (ATOMIC_DEC(block->ref)) return;
+    block_data_release(block->data);
+    pool_free(&g_pools[POOL_BLOCK], block);
 }
 
-static block_t *block_copy(const block_t *other)
+static block_t *block_copy(const block_t *other, uint64_t owner)
 {
-    block_t *block = malloc(sizeof(*block));
-    *block = *other;
-    memset(&block->hh, 0, sizeof(block->hh));
-    block->data->ref++;
-    block->id = g_uid++;
+    block_t *block = pool_alloc(&g_pools[POOL_BLOCK]);
+    // Don't copy the other fields, that can be modified by other threads.
+    block->data = other->data;
+    memcpy(block->pos, other->pos, sizeof(block->pos));
+    ATOMIC_INC(block->data->ref);
+    block->id = new_uid();
+    block->ref = 1;
+    block->owner = owner;
     return block;
 }
 
-static void block_set_data(block_t *block, block_data_t *data)
+#define NODE_TAG(n) ((void*)((uintptr_t)(n) | 1))
+#define IS_NODE(e) ((uintptr_t)(e) & 1)
+#define AS_NODE(e) ((node_t*)((uintptr_t)(e) & ~(uintptr_t)1))
+
+// Hash shift of the root node entries.
+#define ROOT_SHIFT 58
+
+// Shift of the hash for the sub nodes: 58, 52, ..., 10, 4, then 0 for the
+// last level, where only the 4 lowest bits are left.
+static inline int next_shift(int shift)
+{
+    assert(shift > 0);
+    return shift > 6 ? shift - 6 : 0;
+}
+
+static inline int node_size(const node_t *node)
+{
+    return __builtin_popcountll(node->bitmap);
+}
+
+// Index in the entries array of a given entry bit.
+static inline int node_index(const node_t *node, int c)
+{
+    return __builtin_popcountll(node->bitmap & ((1ULL << c) - 1));
+}
+
+static node_t *node_new(int nb)
+{
+    node_t *node = malloc(sizeof(*node) + nb * sizeof(*node->entries));
+    node->ref = 1;
+    node->bitmap = 0;
+    return node;
+}
+
+static void node_release(node_t *node)
+{
+    int i;
+    if (!node || ATOMIC_DEC(node->ref)) return;
+    for (i = 0; i < node_size(node); i++) {
+        if (IS_NODE(node->entries[i]))
+            node_release(AS_NODE(node->entries[i]));
+        else
+            block_release(node->entries[i]);
+    }
+    free(node);
+}
+
+// Return a node that we can modify: the node itself if we are its only
+// owner, or else a copy of it that shares all the entries.  The node has
+// to be reachable from a mesh root by a path of modifiable nodes.
+static node_t *node_own(node_t *node)
+{
+    node_t *ret;
+    int i, nb;
+    if (ATOMIC_GET(node->ref) == 1) return node;
+    nb = node_size(node);
+    ret = node_new(nb);
+    ret->bitmap = node->bitmap;
+    memcpy(ret->entries, node->entries, nb * sizeof(*node->entries));
+    for (i = 0; i < nb; i++) {
+        if (IS_NODE(ret->entries[i]))
+            ATOMIC_INC(AS_NODE(ret->entries[i])->ref);
+        else
+            ATOMIC_INC(((block_t*)ret->entries[i])->ref);
+    }
+    // Another mesh might have released the node in the meantime.
+    node_release(node);
+    return ret;
+}
+
+static block_t *tree_find(const node_t *node, const int pos[3])
+{
+    uint64_t hash;
+    int c, shift = ROOT_SHIFT;
+    void *e;
+    if (!node) return NULL;
+    hash = block_hash(pos);
+    while (true) {
+        c = (hash >> shift) & 63;
+        if (!(node->bitmap & (1ULL << c))) return NULL;
+        e = node->entries[node_index(node, c)];
+        if (!IS_NODE(e)) return vec3_equal(((block_t*)e)->pos, pos) ? e : NULL;
+        node = AS_NODE(e);
+        shift = next_shift(shift);
+    }
+}
+
+// Add a block that is not already in a tree.
+static void tree_insert(node_t **pnode, block_t *block, uint64_t hash,
+                        int shift)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
+    int c = (hash >> shift) & 63, i, nb;
+    node_t *node, *sub = NULL;
+    void *e;
+
+    node = *pnode = node_own(*pnode ?: node_new(0));
+    i = node_index(node, c);
+    if (!(node->bitmap & (1ULL << c))) {
+        nb = node_size(node);
+        node = *pnode = realloc(node, sizeof(*node) +
+                                      (nb + 1) * sizeof(*node->entries));
+        memmove(&node->entries[i + 1], &node->entries[i],
+                (nb - i) * sizeof(*node->entries));
+        node->entries[i] = block;
+        node->bitmap |= 1ULL << c;
+        return;
+    }
+    e = node->entries[i];
+    if (IS_NODE(e)) {
+        sub = AS_NODE(e);
+    } else {
+        // Move the existing block into a new sub node.
+        tree_insert(&sub, e, block_hash(((block_t*)e)->pos),
+                    next_shift(shift));
     }
+    tree_insert(&sub, block, hash, next_shift(shift));
+    node->entries[i] = NODE_TAG(sub);
+}
+
+// Remove a block that is in a tree.  A sub node left with a single block
+// gets replaced by the block, and an empty root by NULL.
+static void tree_remove(node_t **pnode, const int pos[3], uint64_t hash,
+                        int shift)
+{
+    int c = (hash >> shift) & 63, i, nb;
+    node_t *node, *sub;
+    void *e;
+
+    node = *pnode = node_own(*pnode);
+    assert(node->bitmap & (1ULL << c));
+    i = node_index(node, c);
+    e = node->entries[i];
+    if (IS_NODE(e)) {
+        sub = AS_NODE(e);
+        tree_remove(&sub, pos, hash, next_shift(shift));
+        node->entries[i] = NODE_TAG(sub);
+        if (node_size(sub) == 1 && !IS_NODE(sub->entries[0])) {
+            node->entries[i] = sub->entries[0];
+            free(sub);
+        }
+        return;
+    }
+    assert(vec3_equal(((block_t*)e)->pos, pos));
+    block_release(e);
+    nb = node_size(node);
+    memmove(&node->entries[i], &node->entries[i + 1],
+            (nb - i - 1) * sizeof(*node->entries));
+    node->bitmap &= ~(1ULL << c);
+    if (nb == 1) {
+        free(node);
+        *pnode = NULL;
+    }
+}
+
+static block_t *tree_first(const node_t *node)
+{
+    void *e;
+    if (!node) return NULL;
+    for (e = node->entries[0]; IS_NODE(e); e = AS_NODE(e)->entries[0]) {}
+    return e;
+}
+
+// Return the block with the smallest hash bigger than a given value.
+static block_t *tree_next(const node_t *node, uint64_t hash, int shift)
+{
+    int c = (hash >> shift) & 63;
+    uint64_t bits;
+    block_t *ret;
+    void *e;
+
+    if (!node) return NULL;
+    if (node->bitmap & (1ULL << c)) {
+        e = node->entries[node_index(node, c)];
+        if (IS_NODE(e)) {
+            ret = tree_next(AS_NODE(e), hash, next_shift(shift));
+            if (ret) return ret;
+        } else if (block_hash(((block_t*)e)->pos) > hash) {
+            return e;
+        }
+    }
+    bits = (c == 63) ? 0 : node->bitmap & (~0ULL << (c + 1));
+    if (!bits) return NULL;
+    e = node->entries[node_index(node, __builtin_ctzll(bits))];
+    return IS_NODE(e) ? tree_first(AS_NODE(e)) : e;
+}
+
+#define TREE_ITER(root, block) \
+    for (block = tree_first(root); block; \
+         block = tree_next(root, block_hash(block->pos), ROOT_SHIFT))
+
+// Call a function with the position of the blocks of a tree entry that
+// differ from a given block, or of all of them if the block is NULL.  Set
+// 'found' if the entry contains a block at the same position.
+static void entry_diff_block(const block_t *block, const void *e,
+                             void (*f)(const int bpos[3], void *user),
+                             void *user, bool *found)
+{
+    const node_t *node;
+    const block_t *b;
+    int i;
+
+    if (!e) return;
+    if (IS_NODE(e)) {
+        node = AS_NODE(e);
+        for (i = 0; i < node_size(node); i++)
+            entry_diff_block(block, node->entries[i], f, user, found);
+        return;
+    }
+    b = e;
+    if (block && vec3_equal(block->pos, b->pos)) {
+        *found = true;
+        if (block->data->id == b->data->id) return;
+    }
+    f(b->pos, user);
+}
+
+// Call a function with the position of the blocks that differ between two
+// tree entries.  The entries that are shared are skipped.
+static void entry_diff(const void *a, const void *b,
+                       void (*f)(const int bpos[3], void *user), void *user)
+{
+    const node_t *na, *nb;
+    const void *tmp;
+    uint64_t bits;
+    bool found = false;
+    int c;
+
+    if (a == b) return;
+    if (a && b && IS_NODE(a) && IS_NODE(b)) {
+        na = AS_NODE(a);
+        nb = AS_NODE(b);
+        for (bits = na->bitmap | nb->bitmap; bits; bits &= bits - 1) {
+            c = __builtin_ctzll(bits);
+            entry_diff(
+                (na->bitmap & (1ULL << c)) ?
+                    na->entries[node_index(na, c)] : NULL,
+                (nb->bitmap & (1ULL << c)) ?
+                    nb->entries[node_index(nb, c)] : NULL,
+                f, user);
+        }
+        return;
+    }
+    // Now at least one of the entries is a single block or nothing.
+    if (a && IS_NODE(a)) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+    entry_diff_block(a, b, f, user, &found);
+    if (a && !found) f(((const block_t*)a)->pos, user);
+}
+
+static void block_set_data(block_t *block, block_data_t *data)
+{
+    ATOMIC_INC(data->ref);
+    block_data_release(block->data);
     block->data = data;
-    data->ref++;
 }
 
 // Copy the data if there are any other blocks having reference to it.
 static void block_prepare_write(block_t *block)
 {
-    if (block->data->ref == 1) {
-        block->data->id = ++g_uid;
+    block_data_t *data = block->data;
+    if (ATOMIC_GET(data->ref) == 1) {
+        data->id = new_uid();
         return;
     }
-    block->data->ref--;
-    block_data_t *data;
-    data = calloc(1, sizeof(*block->data));
-    memcpy(data->voxels, block->data->voxels, N * N * N * 4);
-    data->ref = 1;
-    block->data = data;
-    block->data->id = ++g_uid;
+    block->data = block_data_copy(data);
+    block->data->id = new_uid();
+    block_data_release(data);
 }
 
 static void block_get_at(const block_t *block, const int pos[3],
@@ -246,30 +1190,26 @@ bool mesh_get_bbox(const mesh_t *mesh, int bbox[2][3], bool exact)
     block_t *block;
     int ret[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
                      {INT_MIN, INT_MIN, INT_MIN}};
-    int pos[3];
-    mesh_iterator_t iter;
+    int i, box[2][3];
     bool empty = false;
 
     if (!exact) {
-        for (block = mesh->blocks; block; block = block->hh.next) {
+        TREE_ITER(mesh->root, block) {
             if (block_is_empty(block, true)) continue;
             ret[0][0] = min(ret[0][0], block->pos[0]);
             ret[0][1] = min(ret[0][1], block->pos[1]);
             ret[0][2] = min(ret[0][2], block->pos[2]);
             ret[1][0] = max(ret[1][0], block->pos[0] + N);
             ret[1][1] = max(ret[1][1], block->pos[1] + N);
-            ret[1][2] = max(ret[1][2], block->pos[1] + N);
+            ret[1][2] = max(ret[1][2], block->pos[2] + N);
         }
     } else {
-        iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
-        while (mesh_iter(&iter, pos)) {
-            if (!mesh_get_alpha_at(mesh, &iter, pos)) continue;
-            ret[0][0] = min(ret[0][0], pos[0]);
-            ret[0][1] = min(ret[0][1], pos[1]);
-            ret[0][2] = min(ret[0][2], pos[2]);
-            ret[1][0] = max(ret[1][0], pos[0] + 1);
-            ret[1][1] = max(ret[1][1], pos[1] + 1);
-            ret[1][2] = max(ret[1][2], pos[2] + 1);
+        TREE_ITER(mesh->root, block) {
+            if (!block_data_get_extents(block->data, box)) continue;
+            for (i = 0; i < 3; i++) {
+                ret[0][i] = min(ret[0][i], block->pos[i] + box[0][i]);
+                ret[1][i] = max(ret[1][i], block->pos[i] + box[1][i]);
+            }
         }
     }
     empty = ret[0][0] >= ret[1][0];
@@ -278,23 +1218,20 @@ bool mesh_get_bbox(const mesh_t *mesh, int bbox[2][3], bool exact)
     return !empty;
 }
 
+int mesh_count_voxels(const mesh_t *mesh)
+{
+    block_t *block;
+    int box[2][3], ret = 0;
+    TREE_ITER(mesh->root, block)
+        ret += block_data_get_extents(block->data, box);
+    return ret;
+}
+
+// Called before any change to a mesh.  The blocks are copied on demand,
+// so we only need to update the key.
 static void mesh_prepare_write(mesh_t *mesh)
 {
-    block_t *blocks, *block, *new_block;
-    assert(*mesh->ref > 0);
-    mesh->key = g_uid++;
-    if (*mesh->ref == 1)
-        return;
-    (*mesh->ref)--;
-    mesh->ref = calloc(1, sizeof(*mesh->ref));
-    *mesh->ref = 1;
-    blocks = mesh->blocks;
-    mesh->blocks = NULL;
-    for (block = blocks; block; block = block->hh.next) {
-        block->id = g_uid++; // Invalidate all accessors.
-        new_block = block_copy(block);
-        HASH_ADD(hh, mesh->blocks, pos, sizeof(new_block->pos), new_block);
-    }
+    mesh->key = new_uid();
 }
 
 static block_t *mesh_add_block(mesh_t *mesh, const int pos[3]);
@@ -306,35 +1243,46 @@ static void mesh_add_neighbors_blocks(mesh_t *mesh)
         {0, -1, 0}, {0, +1, 0},
         {-1, 0, 0}, {+1, 0, 0},
     };
-    int i, p[3];
+    int i, j, nb = 0, p[3];
     uint64_t key = mesh->key;
-    block_t *block, *tmp, *other;
+    block_t *block;
+    int (*positions)[3];
 
     mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
+    // Adding blocks modifies the tree, so we first get the list of all the
+    // non empty blocks positions.
+    TREE_ITER(mesh->root, block) nb++;
+    positions = malloc(nb * sizeof(*positions));
+    nb = 0;
+    TREE_ITER(mesh->root, block) {
         if (block_is_empty(block, true)) continue;
+        vec3_copy(block->pos, positions[nb]);
+        nb++;
+    }
+    for (j = 0; j < nb; j++) {
         for (i = 0; i < 6; i++) {
-            p[0] = block->pos[0] + POS[i][0] * N;
-            p[1] = block->pos[1] + POS[i][1] * N;
-            p[2] = block->pos[2] + POS[i][2] * N;
-            HASH_FIND(hh, mesh->blocks, p, 3 * sizeof(int), other);
-            if (!other) mesh_add_block(mesh, p);
+            p[0] = positions[j][0] + POS[i][0] * N;
+            p[1] = positions[j][1] + POS[i][1] * N;
+            p[2] = positions[j][2] + POS[i][2] * N;
+            if (!tree_find(mesh->root, p)) mesh_add_block(mesh, p);
         }
     }
+    free(positions);
     // Adding empty blocks shouldn't change the key of the mesh.
     mesh->key = key;
 }
 
 void mesh_remove_empty_blocks(mesh_t *mesh, bool fast)
 {
-    block_t *block, *tmp;
+    block_t *block, *next;
+    int pos[3];
     uint64_t key = mesh->key;
     mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        if (block_is_empty(block, false)) {
-            HASH_DEL(mesh->blocks, block);
-            block_delete(block);
-        }
+    for (block = tree_first(mesh->root); block; block = next) {
+        next = tree_next(mesh->root, block_hash(block->pos), ROOT_SHIFT);
+        if (!block_is_empty(block, false)) continue;
+        vec3_copy(block->pos, pos);
+        tree_remove(&mesh->root, pos, block_hash(pos), ROOT_SHIFT);
     }
     // Empty blocks shouldn't change the key of the mesh.
     mesh->key = key;
@@ -342,16 +1290,15 @@ void mesh_remove_empty_blocks(mesh_t *mesh, bool fast)
 
 bool mesh_is_empty(const mesh_t *mesh)
 {
-    return mesh->blocks == NULL;
+    return mesh->root == NULL;
 }
 
 mesh_t *mesh_new(void)
 {
     mesh_t *mesh;
     mesh = calloc(1, sizeof(*mesh));
-    mesh->ref = calloc(1, sizeof(*mesh->ref));
     mesh->key = 1; // Empty mesh key.
-    *mesh->ref = 1;
+    mesh->owner = new_uid();
     return mesh;
 }
 
@@ -401,63 +1348,50 @@ mesh_accessor_t mesh_get_accessor(const mesh_t *mesh)
 void mesh_clear(mesh_t *mesh)
 {
     assert(mesh);
-    block_t *block, *tmp;
     mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        HASH_DEL(mesh->blocks, block);
-        block_delete(block);
-    }
+    node_release(mesh->root);
+    mesh->root = NULL;
     mesh->key = 1; // Empty mesh key.
-    mesh->blocks = NULL;
 }
 
 void mesh_delete(mesh_t *mesh)
 {
-    block_t *block, *tmp;
     if (!mesh) return;
-    (*mesh->ref)--;
-    if (*mesh->ref == 0) {
-        HASH_ITER(hh, mesh->blocks, block, tmp) {
-            HASH_DEL(mesh->blocks, block);
-            block_delete(block);
-        }
-        free(mesh->ref);
-    }
+    node_release(mesh->root);
     free(mesh);
 }
 
+// Make a mesh share the tree of an other mesh.  Since all the blocks are
+// now shared, neither mesh keeps the ownership of its blocks.
+static void mesh_share(mesh_t *mesh, const mesh_t *other)
+{
+    mesh->root = other->root;
+    if (mesh->root) ATOMIC_INC(mesh->root->ref);
+    mesh->key = other->key;
+    mesh->owner = new_uid();
+    // Several threads can copy the same mesh at the same time.
+    ATOMIC_SET(((mesh_t*)other)->owner, new_uid());
+}
+
 mesh_t *mesh_copy(const mesh_t *other)
 {
     mesh_t *mesh = calloc(1, sizeof(*mesh));
-    mesh->blocks = other->blocks;
-    mesh->ref = other->ref;
-    mesh->key = other->key;
-    (*mesh->ref)++;
+    mesh_share(mesh, other);
     return mesh;
 }
 
 void mesh_set(mesh_t *mesh, const mesh_t *other)
 {
-    block_t *block, *tmp;
     assert(mesh && other);
-    if (mesh->blocks == other->blocks) return; // Already the same.
-    (*mesh->ref)--;
-    if (*mesh->ref == 0) {
-        HASH_ITER(hh, mesh->blocks, block, tmp) {
-            HASH_DEL(mesh->blocks, block);
-            block_delete(block);
-        }
-        free(mesh->ref);
-    }
-    mesh->blocks = other->blocks;
-    mesh->ref = other->ref;
-    mesh->key = other->key;
-    (*mesh->ref)++;
+    if (mesh->root && mesh->root == other->root) return; // Already the same.
+    node_release(mesh->root);
+    mesh_share(mesh, other);
 }
 
 static uint64_t get_block_id(const block_t *block)
 {
-    return block ? block->id : 1;
+    // The id of a shared block can be changed by an other thread.
+    return block ? __atomic_load_n(&block->id, __ATOMIC_RELAXED) : 1;
 }
 
 static block_t *mesh_get_block_at(const mesh_t *mesh, const int pos[3],
@@ -467,16 +1401,13 @@ static block_t *mesh_get_block_at(const mesh_t *mesh, const int pos[3],
     int p[3] = {pos[0] & ~(int)(N - 1),
                 pos[1] & ~(int)(N - 1),
                 pos[2] & ~(int)(N - 1)};
-    if (!it) {
-        HASH_FIND(hh, mesh->blocks, p, 3 * sizeof(int), block);
-        return block;
-    }
+    if (!it) return tree_find(mesh->root, p);
 
     if (    it->block_id && it->block_id == get_block_id(it->block) &&
             vec3_equal(it->block_pos, p)) {
         return it->block;
     }
-    HASH_FIND(hh, mesh->blocks, p, 3 * sizeof(int), block);
+    block = tree_find(mesh->root, p);
     it->block = block;
     it->block_id = get_block_id(block);
     vec3_copy(p, it->block_pos);
@@ -491,8 +1422,63 @@ static block_t *mesh_add_block(mesh_t *mesh, const int pos[3])
     assert(pos[2] % BLOCK_SIZE == 0);
     assert(!mesh_get_block_at(mesh, pos, NULL));
     mesh_prepare_write(mesh);
-    block = block_new(pos);
-    HASH_ADD(hh, mesh->blocks, pos, sizeof(block->pos), block);
+    block = block_new(pos, mesh->owner);
+    tree_insert(&mesh->root, block, block_hash(pos), ROOT_SHIFT);
+    return block;
+}
+
+// Get the block at a given position for writing, creating it if needed.
+// We copy all the nodes and the block that are shared with other meshes.
+static block_t *mesh_get_block_for_write(mesh_t *mesh, const int pos[3],
+                                         mesh_accessor_t *it)
+{
+    uint64_t hash;
+    int c, i, shift = ROOT_SHIFT;
+    node_t *node, *sub;
+    block_t *block = NULL;
+    void *e;
+
+    if (    it && it->block && it->block_id == get_block_id(it->block) &&
+            vec3_equal(it->block_pos, pos) &&
+            it->block->owner == mesh->owner) {
+        return it->block;
+    }
+
+    hash = block_hash(pos);
+    node = mesh->root = mesh->root ? node_own(mesh->root) : NULL;
+    while (node) {
+        c = (hash >> shift) & 63;
+        if (!(node->bitmap & (1ULL << c))) break;
+        i = node_index(node, c);
+        e = node->entries[i];
+        if (!IS_NODE(e)) {
+            if (vec3_equal(((block_t*)e)->pos, pos)) block = e;
+            break;
+        }
+        sub = node_own(AS_NODE(e));
+        node->entries[i] = NODE_TAG(sub);
+        node = sub;
+        shift = next_shift(shift);
+    }
+
+    if (!block) {
+        block = block_new(pos, mesh->owner);
+        tree_insert(&mesh->root, block, hash, ROOT_SHIFT);
+    } else if (ATOMIC_GET(block->ref) > 1) {
+        node->entries[i] = block_copy(block, mesh->owner);
+        // Invalidate all accessors.
+        __atomic_store_n(&block->id, new_uid(), __ATOMIC_RELAXED);
+        block_release(block);
+        block = node->entries[i];
+    } else {
+        block->owner = mesh->owner;
+    }
+
+    if (it) {
+        it->block = block;
+        it->block_id = get_block_id(block);
+        vec3_copy(pos, it->block_pos);
+    }
     return block;
 }
 
@@ -529,25 +1515,23 @@ void mesh_set_at(mesh_t *mesh, mesh_iterator_t *iter,
                 pos[2] & ~(int)(N - 1)};
     mesh_prepare_write(mesh);
 
-    block_t *block = mesh_get_block_at(mesh, p, iter);
+    block_t *block = mesh_get_block_for_write(mesh, p, iter);
 
-    if (!block) {
-        block = mesh_add_block(mesh, p);
-        if (iter) {
-            iter->block = block;
-            iter->block_id = get_block_id(block);
-            vec3_copy(p, iter->block_pos);
-        }
-    }
-
-    block_prepare_write(block);
     p[0] = pos[0] - block->pos[0];
     p[1] = pos[1] - block->pos[1];
     p[2] = pos[2] - block->pos[2];
     assert(p[0] >= 0 && p[0] < N);
     assert(p[1] >= 0 && p[1] < N);
     assert(p[2] >= 0 && p[2] < N);
-    memcpy(BLOCK_AT(block, p[0], p[1], p[2]), v, 4);
+    // Don't touch the data if the value doesn't change, so that we don't
+    // copy uniform blocks for nothing.
+    if (memcmp(BLOCK_AT(block, p[0], p[1], p[2]), v, 4) == 0) return;
+
+    block_prepare_write(block);
+    block_data_set_at(block->data, p[0] + p[1] * N + p[2] * N * N, v);
+    // Blocks that become empty share the global empty data.
+    if (block_data_is_uniform(block->data, (uint8_t[]){0, 0, 0, 0}))
+        block_set_data(block, get_empty_data());
 }
 
 
@@ -570,65 +1554,93 @@ static bool mesh_iter_next_block_box(mesh_iterator_t *it)
     if (i == 3) return false;
 
 end:
-    HASH_FIND(hh, mesh->blocks, it->block_pos, 3 * sizeof(int), it->block);
+    it->block = tree_find(mesh->root, it->block_pos);
     it->block_id = get_block_id(it->block);
     vec3_copy(it->block_pos, it->pos);
     return true;
 }
 
-static bool mesh_iter_next_block_union(mesh_iterator_t *it)
+// Move to the next block in the table of a mesh.
+static bool mesh_iter_next_block_table(mesh_iterator_t *it,
+                                       const mesh_t *mesh, bool first)
 {
-    it->block = it->block ? it->block->hh.next : it->mesh->blocks;
-    if (!it->block && !(it->flags & MESH_ITER_MESH2)) {
-        it->block = it->mesh2->blocks;
-        it->flags |= MESH_ITER_MESH2;
-    }
+    it->block = first ? tree_first(mesh->root) :
+                        tree_next(mesh->root, block_hash(it->block_pos),
+                                  ROOT_SHIFT);
     if (!it->block) return false;
     it->block_id = it->block->id;
     vec3_copy(it->block->pos, it->block_pos);
     vec3_copy(it->block->pos, it->pos);
-
-    // Discard blocks that we already did from the first mesh.
-    if (it->flags & MESH_ITER_MESH2) {
-        if (mesh_get_block_at(it->mesh, it->block_pos, NULL))
-            return mesh_iter_next_block_union(it);
-    }
     return true;
 }
 
-static bool mesh_iter_next_block(mesh_iterator_t *it)
+static bool mesh_iter_next_block_union(mesh_iterator_t *it)
 {
-    if (it->block_id && it->block_id != get_block_id(it->block)) {
-        it->block = mesh_get_block_at(
-            (it->flags & MESH_ITER_MESH2) ? it->mesh2 : it->mesh,
-            it->block_pos,
-            it);
+    bool first = !it->block_id;
+    while (true) {
+        if (!(it->flags & MESH_ITER_MESH2)) {
+            if (mesh_iter_next_block_table(it, it->mesh, first))
+                return true;
+            it->flags |= MESH_ITER_MESH2;
+            first = true;
+        }
+        if (!mesh_iter_next_block_table(it, it->mesh2, first))
+            return false;
+        first = false;
+        // Discard blocks that we already did from the first mesh.
+        if (!mesh_get_block_at(it->mesh, it->block_pos, NULL))
+            return true;
     }
+}
 
+static bool mesh_iter_next_block(mesh_iterator_t *it)
+{
     if (it->flags & MESH_ITER_BOX) return mesh_iter_next_block_box(it);
     if (it->mesh2) return mesh_iter_next_block_union(it);
+    return mesh_iter_next_block_table(it, it->mesh, !it->block_id);
+}
 
-    it->block = it->block ? it->block->hh.next : it->mesh->blocks;
-    if (!it->block) return false;
-    it->block_id = it->block->id;
-    vec3_copy(it->block->pos, it->block_pos);
-    vec3_copy(it->block->pos, it->pos);
+// Move to the first non empty voxel of the current block starting from a
+// given voxel index, using the iterator mask.  Return false if there is
+// none.
+static bool mesh_iter_skip_empty(mesh_iterator_t *it, int i)
+{
+    int w = i / 64;
+    uint64_t bits;
+    if (i >= N * N * N) return false;
+    bits = it->mask[w] & (UINT64_MAX << (i % 64));
+    while (!bits) {
+        if (++w == BLOCK_MASK_SIZE) return false;
+        bits = it->mask[w];
+    }
+    i = w * 64 + __builtin_ctzll(bits);
+    it->pos[0] = it->block_pos[0] + i % N;
+    it->pos[1] = it->block_pos[1] + i / N % N;
+    it->pos[2] = it->block_pos[2] + i / (N * N);
     return true;
 }
 
 int mesh_iter(mesh_iterator_t *it, int pos[3])
 {
     int i;
+    const bool skip_empty = it->flags & MESH_ITER_SKIP_EMPTY;
     if (!it->block_id) { // First call.
         // XXX: this is not good: mesh_iter shouldn't make change to the
         // mesh.
         if (it->flags & MESH_ITER_INCLUDES_NEIGHBORS)
             mesh_add_neighbors_blocks((mesh_t*)it->mesh);
-        if (!mesh_iter_next_block(it)) return 0;
-        goto end;
+        goto next_block;
     }
     if (it->flags & MESH_ITER_BLOCKS) goto next_block;
 
+    if (skip_empty) {
+        i = (it->pos[0] - it->block_pos[0]) +
+            (it->pos[1] - it->block_pos[1]) * N +
+            (it->pos[2] - it->block_pos[2]) * N * N;
+        if (mesh_iter_skip_empty(it, i + 1)) goto end;
+        goto next_block;
+    }
+
     for (i = 0; i < 3; i++) {
         if (++it->pos[i] < it->block_pos[i] + N) break;
         it->pos[i] = it->block_pos[i];
@@ -636,12 +1648,20 @@ int mesh_iter(mesh_iterator_t *it, int pos[3])
     if (i < 3) goto end;
 
 next_block:
-    if (!mesh_iter_next_block(it)) {
-        // XXX: this is not good: mesh_iter shouldn't make changes to the
-        // mesh.
-        if (it->flags & MESH_ITER_INCLUDES_NEIGHBORS)
-            mesh_remove_empty_blocks((mesh_t*)it->mesh, true);
-        return 0;
+    while (true) {
+        if (!mesh_iter_next_block(it)) {
+            // XXX: this is not good: mesh_iter shouldn't make changes to
+            // the mesh.
+            if (it->flags & MESH_ITER_INCLUDES_NEIGHBORS)
+                mesh_remove_empty_blocks((mesh_t*)it->mesh, true);
+            return 0;
+        }
+        if (!skip_empty) break;
+        // We keep a copy of the block mask, since the block could be
+        // modified during the iteration.
+        if (!block_get_mask(it->block, it->mask, false)) continue;
+        if (it->flags & MESH_ITER_BLOCKS) break;
+        if (mesh_iter_skip_empty(it, 0)) break;
     }
 
 end:
@@ -649,25 +1669,104 @@ end:
     return 1;
 }
 
+int mesh_iter_rows(mesh_iterator_t *it, int pos[3],
+                   const uint8_t (**row)[4])
+{
+    const bool skip_empty = it->flags & MESH_ITER_SKIP_EMPTY;
+    const block_data_t *data;
+    int r = 0;
+
+    assert(!(it->flags & (MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS)));
+    // Index of the next row in the current block.
+    if (it->block_id) {
+        r = (it->pos[1] - it->block_pos[1]) +
+            (it->pos[2] - it->block_pos[2]) * N + 1;
+    }
+    while (true) {
+        if (!it->block_id || r == N * N) {
+            if (!mesh_iter_next_block(it)) return 0;
+            r = 0;
+            if (skip_empty && !block_get_mask(it->block, it->mask, false))
+                continue;
+        }
+        if (!skip_empty) break;
+        while (r < N * N && !((it->mask[r / 4] >> (r % 4 * 16)) & 0xffff))
+            r++;
+        if (r < N * N) break;
+    }
+
+    it->pos[0] = it->block_pos[0];
+    it->pos[1] = it->block_pos[1] + r % N;
+    it->pos[2] = it->block_pos[2] + r / N;
+    // Copy the row, so that the mesh can be modified while we use it.
+    data = it->block ? it->block->data : get_empty_data();
+    block_data_read_row(data, r * N, N, (uint8_t*)it->row);
+    if (pos) vec3_copy(it->pos, pos);
+    *row = (const uint8_t (*)[4])it->row;
+    return N;
+}
+
 uint64_t mesh_get_key(const mesh_t *mesh)
 {
     return mesh ? mesh->key : 0;
 }
 
-void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *iter,
-                          const int bpos[3], uint64_t *id)
+void mesh_set_key(mesh_t *mesh, uint64_t key)
 {
-    block_t *block = NULL;
-    if (    iter &&
-            iter->block_id &&
-            iter->block_id == get_block_id(iter->block) &&
-            memcmp(&iter->pos, bpos, sizeof(iter->pos)) == 0) {
-        block = iter->block;
-    } else {
-        HASH_FIND(hh, mesh->blocks, bpos, sizeof(iter->pos), block);
-    }
+    mesh->key = key;
+}
+
+bool mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *iter,
+                         const int bpos[3], uint64_t *id, uint8_t *out)
+{
+    block_t *block = mesh_get_block_at(mesh, bpos, iter);
     if (id) *id = block ? block->data->id : 0;
-    return block ? block->data->voxels : NULL;
+    if (out) block_data_read(block ? block->data : get_empty_data(), out);
+    return block != NULL;
+}
+
+bool mesh_get_block_color(const mesh_t *mesh, mesh_accessor_t *accessor,
+                          const int bpos[3], uint8_t out[4])
+{
+    block_t *block = mesh_get_block_at(mesh, bpos, accessor);
+    const block_data_t *data = block ? block->data : get_empty_data();
+    if (data->bits) return false;
+    memcpy(out, data->color, 4);
+    return true;
+}
+
+void mesh_fill_block(mesh_t *mesh, const int bpos[3], const uint8_t v[4])
+{
+    block_t *block;
+    block_data_t *data;
+
+    mesh_prepare_write(mesh);
+    block = mesh_get_block_for_write(mesh, bpos, NULL);
+    if (block_data_is_uniform(block->data, v)) return;
+    if (v[0] == 0 && v[1] == 0 && v[2] == 0 && v[3] == 0) {
+        block_set_data(block, get_empty_data());
+        return;
+    }
+    data = pool_alloc(&g_pools[POOL_DATA]);
+    memset(data, 0, sizeof(*data));
+    data->ref = 1;
+    data->id = new_uid();
+    block_data_alloc(data, 0);
+    memcpy(data->color, v, 4);
+    block_data_release(block->data);
+    block->data = data;
+}
+
+bool mesh_get_block_mask(const mesh_t *mesh, mesh_accessor_t *accessor,
+                         const int bpos[3], uint64_t mask[BLOCK_MASK_SIZE],
+                         uint64_t opaque[BLOCK_MASK_SIZE])
+{
+    block_t *block = mesh_get_block_at(mesh, bpos, accessor);
+    uint64_t tmp[BLOCK_MASK_SIZE];
+    bool ret = block_get_mask(block, tmp, false);
+    if (mask) memcpy(mask, tmp, MASK_BYTES);
+    if (opaque) block_get_mask(block, opaque, true);
+    return ret;
 }
 
 uint8_t mesh_get_alpha_at(const mesh_t *mesh, mesh_iterator_t *iter,
@@ -684,93 +1783,393 @@ void mesh_copy_block(const mesh_t *src, const int src_pos[3],
     block_t *b1, *b2;
     mesh_prepare_write(dst);
     b1 = mesh_get_block_at(src, src_pos, NULL);
-    b2 = mesh_get_block_at(dst, dst_pos, NULL);
-    if (!b2) b2 = mesh_add_block(dst, dst_pos);
+    if (!b1) {
+        if (tree_find(dst->root, dst_pos))
+            tree_remove(&dst->root, dst_pos, block_hash(dst_pos), ROOT_SHIFT);
+        return;
+    }
+    b2 = mesh_get_block_for_write(dst, dst_pos, NULL);
     block_set_data(b2, b1->data);
 }
 
-void mesh_read(const mesh_t *mesh,
-               const int pos[3], const int size[3],
-               uint8_t *data)
+void mesh_diff_blocks(const mesh_t *a, const mesh_t *b,
+                      void (*f)(const int bpos[3], void *user), void *user)
+{
+    entry_diff(a->root ? NODE_TAG(a->root) : NULL,
+               b->root ? NODE_TAG(b->root) : NULL, f, user);
+}
+
+block_data_t *mesh_block_data_new(const uint8_t *voxels)
+{
+    return block_data_new((const uint8_t (*)[4])voxels);
+}
+
+void mesh_block_data_release(block_data_t *data)
 {
-    // For the moment we only support the case where we get the rectangle
-    // of a block plus a one voxel border around it!
-    assert(pos[0] - (pos[0] & ~(int)(N - 1)) == N - 1);
-    assert(pos[1] - (pos[1] & ~(int)(N - 1)) == N - 1);
-    assert(pos[2] - (pos[2] & ~(int)(N - 1)) == N - 1);
-    assert(size[0] == N + 2);
-    assert(size[1] == N + 2);
-    assert(size[2] == N + 2);
+    block_data_release(data);
+}
+
+int mesh_block_data_get_memory_size(const block_data_t *data)
+{
+    return g_pools[POOL_DATA].size +
+           (data->bits ? storage_pool(data->bits)->size : 0);
+}
 
+void mesh_set_block_data(mesh_t *mesh, const int bpos[3], block_data_t *data)
+{
     block_t *block;
-    int block_pos[3] = {pos[0] + 1, pos[1] + 1, pos[2] + 1};
-    int i, z, y, x, dx, dy, dz, p[3];
-    uint8_t v[4];
-    mesh_accessor_t accessor;
-
-    memset(data, 0, size[0] * size[1] * size[2] * 4);
-    block = mesh_get_block_at(mesh, block_pos, NULL);
-    if (!block) goto rest;
-
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        dx = x + 1;
-        dy = y + 1;
-        dz = z + 1;
-        memcpy(&data[(dz * size[1] * size[0] + dy * size[0] + dx) * 4],
-               &block->data->voxels[z * N * N + y * N + x],
-               4);
+    int box[2][3];
+
+    mesh_prepare_write(mesh);
+    if (!block_data_get_extents(data, box)) {
+        if (tree_find(mesh->root, bpos))
+            tree_remove(&mesh->root, bpos, block_hash(bpos), ROOT_SHIFT);
+        return;
+    }
+    block = mesh_get_block_for_write(mesh, bpos, NULL);
+    block_set_data(block, data);
+}
+
+void mesh_get_memory_stats(mesh_memory_stats_t *stats)
+{
+    int i;
+    pool_t *pool;
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < POOL_COUNT; i++) {
+        pool = &g_pools[i];
+        pool_lock(pool);
+        if (i == POOL_BLOCK) stats->nb_blocks = pool->nb_live;
+        if (i == POOL_DATA) stats->nb_datas = pool->nb_live;
+        stats->free_bytes += (int64_t)pool->nb_free * pool->size;
+        pool_unlock(pool);
     }
+    stats->bytes = __atomic_load_n(&g_pool_bytes, __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&g_pool_peak_bytes, __ATOMIC_RELAXED);
+}
 
-rest:
-    // Fill the rest.
-    // In order to optimize access, we iter in such a way to avoid changing
-    // the current block: start with the planes, then the edges, and finally
-    // the 8 corners.
-    accessor = mesh_get_accessor(mesh);
-    const int ranges[26][3][2] = {
-        // 6 planes.
-        {{0,         1}, {1,     N + 1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 1}},
-        {{1,     N + 1}, {0,         1}, {1,     N + 1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{1,     N + 1}, {1,     N + 1}, {0,         1}},
-        {{1,     N + 1}, {1,     N + 1}, {N + 1, N + 2}},
-        // 4 edges moving along X.
-        {{1,     N + 1}, {0,         1}, {0,         1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {0,         1}},
-        {{1,     N + 1}, {0,         1}, {N + 1, N + 2}},
-        {{1,     N + 1}, {N + 1, N + 2}, {N + 1, N + 2}},
-        // 4 edges moving along Y.
-        {{0,         1}, {1,     N + 1}, {0,         1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {0,         1}},
-        {{0,         1}, {1,     N + 1}, {1,     N + 2}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 2}},
-        // 4 edges moving along Z.
-        {{0,         1}, {0,         1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {0,         1}, {1,     N + 1}},
-        {{0,         1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {1,     N + 1}},
-        // 8 Corners.
-        {{0,     1    }, {0,     1    }, {0,     1    }},
-        {{N + 1, N + 2}, {0,     1    }, {0,     1    }},
-        {{0,     1    }, {N + 1, N + 2}, {0,     1    }},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {0,     1    }},
-        {{0,     1    }, {0,     1    }, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {0,     1    }, {N + 1, N + 2}},
-        {{0,     1    }, {N + 1, N + 2}, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {N + 1, N + 2}},
-    };
+static int64_t node_get_memory_size(const node_t *node)
+{
+    int i;
+    const block_t *block;
+    int64_t ret = sizeof(*node) + node_size(node) * sizeof(*node->entries);
+    for (i = 0; i < node_size(node); i++) {
+        if (IS_NODE(node->entries[i])) {
+            ret += node_get_memory_size(AS_NODE(node->entries[i]));
+            continue;
+        }
+        block = node->entries[i];
+        ret += g_pools[POOL_BLOCK].size +
+               mesh_block_data_get_memory_size(block->data);
+    }
+    return ret;
+}
+
+int64_t mesh_get_memory_size(const mesh_t *mesh)
+{
+    return sizeof(*mesh) +
+           (mesh->root ? node_get_memory_size(mesh->root) : 0);
+}
+
+typedef struct {
+    const mesh_t *mesh;
+    const mesh_t *other;
+    int64_t size;
+} diff_size_ctx_t;
+
+static void diff_size_callback(const int bpos[3], void *user)
+{
+    diff_size_ctx_t *ctx = user;
+    const block_t *block, *other;
+    block = tree_find(ctx->mesh->root, bpos);
+    if (!block) return;
+    other = tree_find(ctx->other->root, bpos);
+    if (other && other->data == block->data) return;
+    ctx->size += g_pools[POOL_BLOCK].size +
+                 mesh_block_data_get_memory_size(block->data);
+}
+
+int64_t mesh_get_diff_memory_size(const mesh_t *mesh, const mesh_t *other)
+{
+    diff_size_ctx_t ctx = {.mesh = mesh, .other = other};
+    mesh_diff_blocks(mesh, other, diff_size_callback, &ctx);
+    return ctx.size;
+}
+
+/*
+ * The intern table is an open addressing hash table of block data indexed
+ * by a hash of their encoded content.  It keeps a reference to all its
+ * data, so they can't be modified in place anymore, and we release the
+ * ones that are only referenced by the table at each call.  Two data with
+ * the same voxels but a different palette order are not merged, it's not
+ * worth decoding all the blocks for that.
+ */
+typedef struct {
+    uint64_t        hash;
+    block_data_t    *data;  // NULL for the free slots.
+} intern_entry_t;
+
+static struct {
+    intern_entry_t  *entries;
+    int             size;   // Power of two.
+    int             count;
+} g_intern = {0};
+
+static uint64_t block_data_hash(const block_data_t *data)
+{
+    const uint8_t *p = data->storage;
+    int i, size = block_data_storage_size(data->bits);
+    uint64_t v, h = data->bits;
+
+    if (data->bits == 0) {
+        v = 0;
+        memcpy(&v, data->color, 4);
+        h ^= v << 8;
+    }
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&v, p + i, 8);
+        h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static bool block_data_same_content(const block_data_t *a,
+                                    const block_data_t *b)
+{
+    if (a->bits != b->bits) return false;
+    if (a->bits == 0) return memcmp(a->color, b->color, 4) == 0;
+    return memcmp(a->storage, b->storage,
+                  block_data_storage_size(a->bits)) == 0;
+}
+
+// Return the slot of a hash, either free or with the same hash.
+static intern_entry_t *intern_find(uint64_t hash)
+{
+    int i = hash & (g_intern.size - 1);
+    while (g_intern.entries[i].data && g_intern.entries[i].hash != hash)
+        i = (i + 1) & (g_intern.size - 1);
+    return &g_intern.entries[i];
+}
+
+// Rebuild the table with a new size, releasing the data that no mesh
+// uses anymore.
+static void intern_rebuild(int size)
+{
+    intern_entry_t *entries = g_intern.entries, *e;
+    int i, old_size = g_intern.size;
+
+    g_intern.entries = calloc(size, sizeof(*g_intern.entries));
+    g_intern.size = size;
+    g_intern.count = 0;
+    for (i = 0; i < old_size; i++) {
+        if (!entries[i].data) continue;
+        if (ATOMIC_GET(entries[i].data->ref) == 1) {
+            block_data_release(entries[i].data);
+            continue;
+        }
+        e = intern_find(entries[i].hash);
+        *e = entries[i];
+        g_intern.count++;
+    }
+    free(entries);
+}
+
+// Share the data of a block with the table.  Return the memory released.
+static int64_t intern_block(mesh_t *mesh, const block_t *block)
+{
+    block_data_t *data = block->data;
+    block_t *wblock;
+    intern_entry_t *e;
+    uint64_t hash;
+    int64_t ret = 0;
+
+    if (data == get_empty_data()) return 0;
+    if (g_intern.count * 2 >= g_intern.size)
+        intern_rebuild(max(g_intern.size * 2, 1024));
+    hash = block_data_hash(data);
+    e = intern_find(hash);
+    if (!e->data) {
+        e->hash = hash;
+        e->data = data;
+        ATOMIC_INC(data->ref);
+        g_intern.count++;
+        return 0;
+    }
+    if (e->data == data || !block_data_same_content(e->data, data))
+        return 0;
+    // The block can be shared with other meshes, so we copy it first, like
+    // for any other write.  The content and the key of the mesh don't
+    // change.
+    wblock = mesh_get_block_for_write(mesh, block->pos, NULL);
+    if (ATOMIC_GET(data->ref) == 1)
+        ret = mesh_block_data_get_memory_size(data);
+    block_set_data(wblock, e->data);
+    return ret;
+}
+
+typedef struct {
+    mesh_t  *mesh;
+    int64_t size;
+} intern_ctx_t;
+
+static void intern_callback(const int bpos[3], void *user)
+{
+    intern_ctx_t *ctx = user;
+    block_t *block = tree_find(ctx->mesh->root, bpos);
+    if (block) ctx->size += intern_block(ctx->mesh, block);
+}
+
+int64_t mesh_intern_blocks(mesh_t *mesh, const mesh_t *since)
+{
+    intern_ctx_t ctx = {.mesh = mesh};
+    block_t *block;
+
+    // Note: the tree is modified during the iterations, but we only
+    // replace the nodes and blocks that are also owned by other meshes,
+    // so they stay valid until we are done.
+    if (since) {
+        mesh_diff_blocks(mesh, since, intern_callback, &ctx);
+        return ctx.size;
+    }
+    TREE_ITER(mesh->root, block)
+        ctx.size += intern_block(mesh, block);
+    return ctx.size;
+}
+
+void mesh_intern_prune(void)
+{
+    if (g_intern.size) intern_rebuild(g_intern.size);
+}
+
+int64_t mesh_intern_get_saved(void)
+{
+    int i, ref;
+    int64_t ret = 0;
+    for (i = 0; i < g_intern.size; i++) {
+        if (!g_intern.entries[i].data) continue;
+        // One reference is the table, and one is the data we keep.
+        ref = ATOMIC_GET(g_intern.entries[i].data->ref);
+        if (ref <= 2) continue;
+        ret += (int64_t)(ref - 2) *
+               mesh_block_data_get_memory_size(g_intern.entries[i].data);
+    }
+    return ret;
+}
+
+void mesh_intern_clear(void)
+{
+    int i;
+    for (i = 0; i < g_intern.size; i++) {
+        if (g_intern.entries[i].data)
+            block_data_release(g_intern.entries[i].data);
+    }
+    free(g_intern.entries);
+    memset(&g_intern, 0, sizeof(g_intern));
+}
+
+// Intersection of a region with a block, relative to the block position.
+static bool block_region_intersection(const int bpos[3], const int pos[3],
+                                      const int size[3], int out[2][3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        out[0][i] = max(pos[i], bpos[i]) - bpos[i];
+        out[1][i] = min(pos[i] + size[i], bpos[i] + N) - bpos[i];
+        if (out[1][i] <= out[0][i]) return false;
+    }
+    return true;
+}
+
+#define REGION_BLOCKS_ITER(pos, size, bpos) \
+    for (bpos[2] = pos[2] & ~(int)(N - 1); bpos[2] < pos[2] + size[2]; \
+         bpos[2] += N) \
+    for (bpos[1] = pos[1] & ~(int)(N - 1); bpos[1] < pos[1] + size[1]; \
+         bpos[1] += N) \
+    for (bpos[0] = pos[0] & ~(int)(N - 1); bpos[0] < pos[0] + size[0]; \
+         bpos[0] += N)
+
+void mesh_read_region(const mesh_t *mesh,
+                      const int pos[3], const int size[3],
+                      uint8_t *data)
+{
+    block_t *block;
+    int bpos[3], r[2][3], y, z;
+    uint8_t *dst;
+
+    memset(data, 0, (size_t)size[0] * size[1] * size[2] * 4);
+    REGION_BLOCKS_ITER(pos, size, bpos) {
+        block = tree_find(mesh->root, bpos);
+        if (block_is_empty(block, true)) continue;
+        if (!block_region_intersection(bpos, pos, size, r)) continue;
+        for (z = r[0][2]; z < r[1][2]; z++)
+        for (y = r[0][1]; y < r[1][1]; y++) {
+            dst = data + (((size_t)(bpos[2] + z - pos[2]) * size[1] +
+                           (bpos[1] + y - pos[1])) * size[0] +
+                           (bpos[0] + r[0][0] - pos[0])) * 4;
+            block_data_read_row(block->data, r[0][0] + y * N + z * N * N,
+                                r[1][0] - r[0][0], dst);
+        }
+    }
+}
 
-    for (i = 0; i < 26; i++)
-    for (z = ranges[i][2][0]; z < ranges[i][2][1]; z++)
-    for (y = ranges[i][1][0]; y < ranges[i][1][1]; y++)
-    for (x = ranges[i][0][0]; x < ranges[i][0][1]; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        mesh_get_at(mesh, &accessor, p, v);
-        memcpy(&data[(z * size[1] * size[0] + y * size[0] + x) * 4], v, 4);
+void mesh_write_region(mesh_t *mesh,
+                       const int pos[3], const int size[3],
+                       const uint8_t *data)
+{
+    block_t *block;
+    block_data_t *new_data;
+    int bpos[3], r[2][3], box[2][3], i, y, z, n;
+    bool changed, full;
+    uint8_t voxels[N * N * N][4];
+    const uint8_t *src;
+    uint8_t *dst;
+
+    mesh_prepare_write(mesh);
+    REGION_BLOCKS_ITER(pos, size, bpos) {
+        if (!block_region_intersection(bpos, pos, size, r)) continue;
+        block = tree_find(mesh->root, bpos);
+        full = true;
+        for (i = 0; i < 3; i++)
+            full = full && r[0][i] == 0 && r[1][i] == N;
+        // Start from the current block value, and only replace the data
+        // if any voxel changed, so that the mesh keeps sharing it.  If the
+        // region covers the whole block we build the data straight from
+        // the source rows, and only keep the current data if it has the
+        // same encoding.
+        if (!full && block)
+            block_data_read(block->data, (uint8_t*)voxels);
+        else if (!full)
+            memset(voxels, 0, sizeof(voxels));
+        changed = full;
+        n = (r[1][0] - r[0][0]) * 4;
+        for (z = r[0][2]; z < r[1][2]; z++)
+        for (y = r[0][1]; y < r[1][1]; y++) {
+            src = data + (((size_t)(bpos[2] + z - pos[2]) * size[1] +
+                           (bpos[1] + y - pos[1])) * size[0] +
+                           (bpos[0] + r[0][0] - pos[0])) * 4;
+            dst = voxels[r[0][0] + y * N + z * N * N];
+            if (!full && memcmp(dst, src, n) == 0) continue;
+            memcpy(dst, src, n);
+            changed = true;
+        }
+        if (!changed) continue;
+
+        new_data = block_data_new((const uint8_t (*)[4])voxels);
+        if (full && block && block_data_same_content(block->data, new_data)) {
+            block_data_release(new_data);
+            continue;
+        }
+        // Remove the blocks that have no visible voxels left.
+        if (!block_data_get_extents(new_data, box)) {
+            block_data_release(new_data);
+            if (block)
+                tree_remove(&mesh->root, bpos, block_hash(bpos), ROOT_SHIFT);
+            continue;
+        }
+        block = mesh_get_block_for_write(mesh, bpos, NULL);
+        block_data_release(block->data);
+        block->data = new_data;
     }
 }
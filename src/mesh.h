@@ -6,13 +6,38 @@
 
 #define BLOCK_SIZE 16
 
+// Number of uint64_t in a block mask, with one bit per voxel.
+#define BLOCK_MASK_SIZE (BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE / 64)
+
 /* Type: mesh_t
  * Opaque type that represents a mesh.
+ *
+ * Thread safety:
+ *
+ * Copies of a mesh share their blocks, but the sharing is invisible to
+ * the users: the reference counters and ids are updated atomically, and
+ * shared data is never modified in place.  So the rules are the same as
+ * if each mesh was an independent value:
+ *
+ * - Any number of threads can read the same mesh at the same time, this
+ *   includes calling <mesh_copy> on it.
+ * - A mesh that is being modified should not be accessed from any other
+ *   thread, even for reading.
+ * - Different meshes can be modified from different threads at the same
+ *   time, even if they are copies of each other.
+ * - Accessors and iterators should not be shared between threads.
+ *
+ * Note that iterating with the MESH_ITER_INCLUDES_NEIGHBORS flag modifies
+ * the mesh, and that the functions of mesh_utils.c use global caches, so
+ * they should only be called from the main thread.
  */
 typedef struct mesh mesh_t;
 
 typedef struct block block_t;
 
+// The voxels values of a block, that can be shared by several blocks.
+typedef struct block_data block_data_t;
+
 /* Enum: MESH_ITER
  * Some flags that can be used to modify the behavior of the iteration
  * function.
@@ -55,6 +80,10 @@ typedef struct {
     int pos[3];
     float box[4][4];
     int bbox[2][3];
+    // Occupancy mask of the current block, for MESH_ITER_SKIP_EMPTY.
+    uint64_t mask[BLOCK_MASK_SIZE];
+    // Current row, for mesh_iter_rows.
+    uint8_t row[BLOCK_SIZE][4];
 
     int flags;
 } mesh_iterator_t;
@@ -78,8 +107,19 @@ void mesh_delete(mesh_t *mesh);
  */
 void mesh_clear(mesh_t *mesh);
 
+/*
+ * Function: mesh_copy
+ * Create a copy of a mesh.
+ *
+ * This is very cheap since the blocks are shared until one of the meshes
+ * gets modified.
+ */
 mesh_t *mesh_copy(const mesh_t *mesh);
 
+/*
+ * Function: mesh_set
+ * Set the content of a mesh to be a copy of an other mesh.
+ */
 void mesh_set(mesh_t *mesh, const mesh_t *other);
 
 mesh_accessor_t mesh_get_accessor(const mesh_t *mesh);
@@ -125,7 +165,9 @@ bool mesh_is_empty(const mesh_t *mesh);
  *   mesh   - The mesh
  *   exact  - If true, compute the exact bounding box.  If false, returns
  *            an approximation that might be slightly bigger than the
- *            actual box, but faster to compute.
+ *            actual box, but faster to compute.  The exact box only
+ *            needs to look at the voxels of the blocks modified since the
+ *            last call.
  *
  * Outputs:
  *   bbox  - The bounding box as the bottom left and top right corner of
@@ -136,6 +178,16 @@ bool mesh_is_empty(const mesh_t *mesh);
  */
 bool mesh_get_bbox(const mesh_t *mesh, int bbox[2][3], bool exact);
 
+/*
+ * Function: mesh_count_voxels
+ *
+ * Return the number of voxels with a non zero alpha in a mesh.
+ *
+ * Like the exact bounding box, this uses the cached voxels count of each
+ * block, so it only has to visit the modified blocks.
+ */
+int mesh_count_voxels(const mesh_t *mesh);
+
 /*
  * Function: mesh_get_iterator
  * Return an iterator that yield all the voxels of the mesh.
@@ -156,6 +208,32 @@ mesh_iterator_t mesh_get_union_iterator(
 
 int mesh_iter(mesh_iterator_t *it, int pos[3]);
 
+/*
+ * Function: mesh_iter_rows
+ * Iterate the voxels of a mesh one row of BLOCK_SIZE voxels at a time.
+ *
+ * This works with the same iterators as <mesh_iter>, except for the
+ * MESH_ITER_BLOCKS and MESH_ITER_INCLUDES_NEIGHBORS flags, and yields the
+ * voxels in the same order.  With MESH_ITER_SKIP_EMPTY, only the rows that
+ * have at least one non empty voxel are returned.  To get a whole block at
+ * once, use MESH_ITER_BLOCKS and <mesh_get_block_data> instead.
+ *
+ * The row values are a copy kept in the iterator, so the mesh can be
+ * modified during the iteration.
+ *
+ * Parameters:
+ *   it  - A mesh iterator.
+ *   pos - Get the position of the first voxel of the row, the row goes
+ *         along the x axis.
+ *   row - Get a pointer to the BLOCK_SIZE RGBA values of the row, valid
+ *         until the next call.
+ *
+ * Returns:
+ *   The number of voxels in the row, or zero at the end of the iteration.
+ */
+int mesh_iter_rows(mesh_iterator_t *it, int pos[3],
+                   const uint8_t (**row)[4]);
+
 /*
  * Function: mesh_get_key
  *
@@ -176,15 +254,260 @@ int mesh_iter(mesh_iterator_t *it, int pos[3]);
  */
 uint64_t mesh_get_key(const mesh_t *mesh);
 
-void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *accessor,
-                          const int bpos[3], uint64_t *id);
+/*
+ * Function: mesh_set_key
+ * Give back its previous key to a mesh that has been rebuilt.
+ *
+ * Only valid if the mesh has exactly the same content as when it had this
+ * key, for example when restoring a saved state of the mesh.
+ */
+void mesh_set_key(mesh_t *mesh, uint64_t key);
+
+/*
+ * Function: mesh_get_block_data
+ *
+ * Get the data of a block.
+ *
+ * Inputs:
+ *   mesh     - The mesh.
+ *   accessor - Optional mesh accessor.
+ *   bpos     - Position of the block.
+ *
+ * Outputs:
+ *   id   - If not NULL, get the id of the block data, or zero if there is
+ *          no block at this position.  Blocks with the same data id have
+ *          the same content.
+ *   out  - If not NULL, get the block RGBA voxels, as an array of
+ *          BLOCK_SIZE^3 * 4 bytes.
+ *
+ * Returns:
+ *   true if there is a block at this position.
+ */
+bool mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *accessor,
+                         const int bpos[3], uint64_t *id, uint8_t *out);
+
+/*
+ * Function: mesh_get_block_mask
+ *
+ * Get the occupancy masks of a block.
+ *
+ * The masks contain one bit per voxel, the voxel (x, y, z) of the block
+ * being the bit (i % 64) of the word (i / 64), with
+ * i = x + y * BLOCK_SIZE + z * BLOCK_SIZE^2.
+ *
+ * Inputs:
+ *   mesh     - The mesh.
+ *   accessor - Optional mesh accessor.
+ *   bpos     - Position of the block.
+ *
+ * Outputs:
+ *   mask   - If not NULL, get the mask of the voxels with a non zero alpha.
+ *   opaque - If not NULL, get the mask of the voxels with an alpha >= 127.
+ *
+ * Returns:
+ *   true if the block has any non empty voxel.
+ */
+bool mesh_get_block_mask(const mesh_t *mesh, mesh_accessor_t *accessor,
+                         const int bpos[3], uint64_t mask[BLOCK_MASK_SIZE],
+                         uint64_t opaque[BLOCK_MASK_SIZE]);
+
+/*
+ * Function: mesh_get_block_color
+ * Check if all the voxels of a block have the same value.
+ *
+ * Inputs:
+ *   mesh     - The mesh.
+ *   accessor - Optional mesh accessor.
+ *   bpos     - Position of the block.
+ *
+ * Outputs:
+ *   out - The value of the voxels if the block is uniform.  A missing
+ *         block is uniformly empty.
+ *
+ * Returns:
+ *   true if the block is uniform.
+ */
+bool mesh_get_block_color(const mesh_t *mesh, mesh_accessor_t *accessor,
+                          const int bpos[3], uint8_t out[4]);
+
+/*
+ * Function: mesh_fill_block
+ * Set all the voxels of a block to the same value.
+ */
+void mesh_fill_block(mesh_t *mesh, const int bpos[3], const uint8_t v[4]);
 
 // Maybe replace this with a generic mesh_copy_part function?
+// If the source block doesn't exist, the destination block is removed.
 void mesh_copy_block(const mesh_t *src, const int src_pos[3],
                      mesh_t *dst, const int dst_pos[3]);
 
-void mesh_read(const mesh_t *mesh,
-               const int pos[3], const int size[3],
-               uint8_t *data);
+/*
+ * Function: mesh_diff_blocks
+ * Find the blocks that differ between two meshes.
+ *
+ * Call a function with the position of each block that is not the same in
+ * both meshes.  The parts of the meshes that are still shared since one
+ * was copied from the other are skipped without visiting them, so the cost
+ * only depends on the number of modified blocks.  A position can be
+ * reported several times.
+ */
+void mesh_diff_blocks(const mesh_t *a, const mesh_t *b,
+                      void (*f)(const int bpos[3], void *user), void *user);
+
+/*
+ * Function: mesh_block_data_new
+ * Create a new block data from the RGBA values of N^3 voxels.
+ *
+ * The returned data has a reference count of one, to be released with
+ * <mesh_block_data_release>.  It can be created from any thread.
+ */
+block_data_t *mesh_block_data_new(const uint8_t *voxels);
+
+/*
+ * Function: mesh_block_data_release
+ * Release a reference to a block data.
+ */
+void mesh_block_data_release(block_data_t *data);
+
+/*
+ * Function: mesh_block_data_get_memory_size
+ * Get the memory used by a block data, in bytes.
+ */
+int mesh_block_data_get_memory_size(const block_data_t *data);
+
+/*
+ * Function: mesh_set_block_data
+ * Replace the voxels of a block with a block data.
+ *
+ * The mesh gets its own reference to the data, and the block is removed if
+ * the data has no visible voxels.
+ */
+void mesh_set_block_data(mesh_t *mesh, const int bpos[3], block_data_t *data);
+
+/*
+ * Function: mesh_read_region
+ * Read the RGBA values of a box of voxels.
+ *
+ * Inputs:
+ *   mesh - The mesh.
+ *   pos  - Position of the first voxel of the region.
+ *   size - Size of the region.
+ *
+ * Outputs:
+ *   data - Buffer of size[0] * size[1] * size[2] RGBA values, in xyz
+ *          order.
+ */
+void mesh_read_region(const mesh_t *mesh,
+                      const int pos[3], const int size[3],
+                      uint8_t *data);
+
+/*
+ * Function: mesh_write_region
+ * Set the RGBA values of a box of voxels.
+ *
+ * The blocks are written one at a time, and the ones that are left without
+ * any visible voxels are removed from the mesh.
+ *
+ * Inputs:
+ *   mesh - The mesh.
+ *   pos  - Position of the first voxel of the region.
+ *   size - Size of the region.
+ *   data - RGBA values of the voxels, in xyz order.
+ */
+void mesh_write_region(mesh_t *mesh,
+                       const int pos[3], const int size[3],
+                       const uint8_t *data);
+
+/*
+ * Type: mesh_memory_stats_t
+ * Memory usage of the blocks allocator, as returned by
+ * <mesh_get_memory_stats>.
+ */
+typedef struct {
+    int64_t nb_blocks;      // Number of blocks in use.
+    int64_t nb_datas;       // Number of blocks data in use.
+    int64_t bytes;          // Size of all the blocks and data in use.
+    int64_t peak_bytes;     // Max value of 'bytes' since the start.
+    int64_t free_bytes;     // Size kept in the allocator free lists.
+} mesh_memory_stats_t;
+
+/*
+ * Function: mesh_get_memory_stats
+ * Get the memory usage of the blocks of all the meshes.
+ *
+ * The blocks and their data are allocated from pools with per-size free
+ * lists, this returns the current statistics of those pools.  The
+ * function is thread safe.
+ */
+void mesh_get_memory_stats(mesh_memory_stats_t *stats);
+
+/*
+ * Function: mesh_get_memory_size
+ * Get the memory used by the nodes, blocks and data of a mesh, in bytes.
+ *
+ * Everything the mesh keeps alive is counted, even what it shares with
+ * other meshes, so this is an upper bound of what deleting the mesh would
+ * release.
+ */
+int64_t mesh_get_memory_size(const mesh_t *mesh);
+
+/*
+ * Function: mesh_get_diff_memory_size
+ * Get the memory used by the blocks of a mesh that are not shared with
+ * an other mesh, in bytes.
+ *
+ * This is about what deleting the mesh would release if the other mesh is
+ * kept.  Like <mesh_diff_blocks>, the cost only depends on the number of
+ * blocks that differ.
+ */
+int64_t mesh_get_diff_memory_size(const mesh_t *mesh, const mesh_t *other);
+
+/*
+ * Function: mesh_intern_blocks
+ * Share the data of the blocks that have the same content.
+ *
+ * Normally only the copies of a mesh share their blocks data.  This looks
+ * up the content of the blocks in a global intern table, so that all the
+ * blocks with the same content, in any mesh, use a single data.  The
+ * content of the mesh, and its key, don't change.  The table keeps a
+ * reference to the data, that is released by <mesh_intern_prune> once no
+ * mesh uses it anymore.
+ *
+ * This function is not thread safe.
+ *
+ * Inputs:
+ *   mesh  - The mesh.
+ *   since - Optional previous state of the mesh.  If set, only the blocks
+ *           that differ from it are looked up.
+ *
+ * Returns:
+ *   The memory released, in bytes.
+ */
+int64_t mesh_intern_blocks(mesh_t *mesh, const mesh_t *since);
+
+/*
+ * Function: mesh_intern_prune
+ * Release the data that are only kept alive by the <mesh_intern_blocks>
+ * table.
+ *
+ * This goes through the whole table, so it should be called once after
+ * interning a set of meshes, not after each of them.
+ */
+void mesh_intern_prune(void);
+
+/*
+ * Function: mesh_intern_get_saved
+ * Return the memory currently saved by the <mesh_intern_blocks> table.
+ *
+ * This is the size of the interned data times the number of extra blocks
+ * using them.  It goes through the whole table.
+ */
+int64_t mesh_intern_get_saved(void);
+
+/*
+ * Function: mesh_intern_clear
+ * Release all the references kept by the <mesh_intern_blocks> table.
+ */
+void mesh_intern_clear(void);
 
 #endif // MESH_H
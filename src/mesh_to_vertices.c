@@ -208,7 +208,8 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
                            int *size, int *subdivide)
 {
     int x, y, z, f;
-    int i, nb = 0;
+    int i, j, w, nb = 0;
+    uint64_t opaque[BLOCK_MASK_SIZE], bits;
     uint32_t neighboors_mask;
     uint8_t shadow_mask, borders_mask;
     const int ts = VOXEL_TEXTURE_SIZE;
@@ -224,22 +225,27 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
     *size = 4;      // Quad.
     *subdivide = 1; // Unit is one voxel.
 
+    // Only the opaque voxels are visible.
+    if (!mesh_get_block_mask(mesh, NULL, block_pos, NULL, opaque)) return 0;
+
     // To speed things up we first get the voxel cube around the block.
     // XXX: can we do this while still using mesh iterators somehow?
 #define IVEC(...) ((int[]){__VA_ARGS__})
     data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
-    mesh_read(mesh,
-              IVEC(block_pos[0] - 1, block_pos[1] - 1, block_pos[2] - 1),
-              IVEC(N + 2, N + 2, N + 2), data);
+    mesh_read_region(mesh,
+            IVEC(block_pos[0] - 1, block_pos[1] - 1, block_pos[2] - 1),
+            IVEC(N + 2, N + 2, N + 2), data);
 
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
+    for (w = 0; w < BLOCK_MASK_SIZE; w++)
+    for (bits = opaque[w]; bits; bits &= bits - 1) {
+        j = w * 64 + __builtin_ctzll(bits);
+        x = j % N;
+        y = j / N % N;
+        z = j / (N * N);
         pos[0] = x;
         pos[1] = y;
         pos[2] = z;
         data_get_at(data, x, y, z, v);
-        if (v[3] < 127) continue;    // Non visible
         neighboors_mask = get_neighboors(data, pos, neighboors);
         for (f = 0; f < 6; f++) {
             if (!block_is_face_visible(neighboors_mask, f)) continue;
@@ -29,6 +29,57 @@ static int mesh_del(void *data_)
     return 0;
 }
 
+/*
+ * Blocks touched by mesh_select.  We keep a decoded copy of the mesh
+ * voxels, and the selection values, that also serve as the visited flags.
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    uint8_t         voxels[N * N * N][4];
+    uint8_t         selection[N * N * N];
+    bool            selected; // Set if any voxel of the block is selected.
+} select_block_t;
+
+typedef struct {
+    const mesh_t    *mesh;
+    mesh_accessor_t accessor;
+    select_block_t  *blocks; // Hash table of all the blocks.
+    select_block_t  *last;   // Last block used, to speed up the lookups.
+} select_ctx_t;
+
+static select_block_t *select_get_block(select_ctx_t *ctx, const int pos[3])
+{
+    int bpos[3] = {pos[0] & ~(N - 1), pos[1] & ~(N - 1), pos[2] & ~(N - 1)};
+    select_block_t *block = ctx->last;
+
+    if (block && memcmp(block->pos, bpos, sizeof(bpos)) == 0) return block;
+    HASH_FIND(hh, ctx->blocks, bpos, sizeof(bpos), block);
+    if (!block) {
+        block = calloc(1, sizeof(*block));
+        memcpy(block->pos, bpos, sizeof(bpos));
+        mesh_get_block_data(ctx->mesh, &ctx->accessor, bpos, NULL,
+                            (uint8_t*)block->voxels);
+        HASH_ADD(hh, ctx->blocks, pos, sizeof(block->pos), block);
+    }
+    ctx->last = block;
+    return block;
+}
+
+static inline int select_index(const int pos[3])
+{
+    return (pos[0] & (N - 1)) +
+           (pos[1] & (N - 1)) * N +
+           (pos[2] & (N - 1)) * N * N;
+}
+
+/*
+ * Flood fill from the start position.  Each time a voxel gets selected we
+ * put it in a queue, and when we pop it we test all its not yet selected
+ * neighbors.  Since the inputs of the condition of a voxel only change
+ * when one of its neighbors gets selected, this gives the same result as
+ * testing all the neighbors of the selection until nothing changes.
+ */
 int mesh_select(const mesh_t *mesh,
                 const int start_pos[3],
                 int (*cond)(const uint8_t value[4],
@@ -37,107 +88,78 @@ int mesh_select(const mesh_t *mesh,
                             void *user),
                 void *user, mesh_t *selection)
 {
-    int i, j, a;
-    uint8_t v2[4];
-    int pos[3], p[3], p2[3];
-    bool keep = true;
+    int i, j, a, idx;
+    int p[3], p2[3];
+    int (*queue)[3] = NULL;
+    int queue_size = 0, queue_alloc = 0, queue_next = 0;
+    uint8_t value[4];
     uint8_t neighboors[6][4];
     uint8_t mask[6];
-    mesh_iterator_t iter;
-    mesh_accessor_t mesh_accessor, selection_accessor;
-    mesh_clear(selection);
+    uint8_t (*data)[4];
+    select_block_t *block, *neighboor, *tmp;
+    select_ctx_t ctx = {.mesh = mesh, .accessor = mesh_get_accessor(mesh)};
 
-    mesh_accessor = mesh_get_accessor(mesh);
-    selection_accessor = mesh_get_accessor(selection);
-
-    mesh_set_at(selection, &selection_accessor, start_pos,
-                (uint8_t[]){255, 255, 255, 255});
-
-    // XXX: Very inefficient algorithm!
-    // Iter and test all the neighbors of the selection until there is
-    // no more possible changes.
-    while (keep) {
-        keep = false;
-        iter = mesh_get_iterator(selection, MESH_ITER_VOXELS);
-        while (mesh_iter(&iter, pos)) {
-            for (i = 0; i < 6; i++) {
-                p[0] = pos[0] + FACES_NORMALS[i][0];
-                p[1] = pos[1] + FACES_NORMALS[i][1];
-                p[2] = pos[2] + FACES_NORMALS[i][2];
-                mesh_get_at(selection, &selection_accessor, p, v2);
-                if (v2[3]) continue; // Already done.
-                mesh_get_at(mesh, &mesh_accessor, p, v2);
-                // Compute neighboors and mask.
-                for (j = 0; j < 6; j++) {
-                    p2[0] = p[0] + FACES_NORMALS[j][0];
-                    p2[1] = p[1] + FACES_NORMALS[j][1];
-                    p2[2] = p[2] + FACES_NORMALS[j][2];
-                    mesh_get_at(mesh, &mesh_accessor, p2, neighboors[j]);
-                    mask[j] = mesh_get_alpha_at(selection,
-                                                &selection_accessor, p2);
-                }
-                // XXX: the (void*) are only here for gcc <= 4.8.4
-                a = cond((void*)v2, (void*)neighboors, (void*)mask, user);
-                if (a) {
-                    mesh_set_at(selection, &selection_accessor, p,
-                                (uint8_t[]){255, 255, 255, a});
-                    keep = true;
-                }
-            }
-        }
-    }
-    return 0;
-}
-
-
-// XXX: need to redo this function from scratch.  Even the API is a bit
-// stupid.
-void mesh_extrude(mesh_t *mesh,
-                  const float plane[4][4],
-                  const float box[4][4])
-{
-    float proj[4][4];
-    float n[3], pos[3], p[3];
-    mesh_iterator_t iter;
-    int vpos[3];
-    uint8_t value[4];
+    mesh_clear(selection);
 
-    vec3_normalize(plane[2], n);
-    vec3_copy(plane[3], pos);
+#define SELECT(pos_, a_) do { \
+        block = select_get_block(&ctx, pos_); \
+        block->selection[select_index(pos_)] = a_; \
+        block->selected = true; \
+        if (queue_size >= queue_alloc) { \
+            queue_alloc = max(queue_alloc * 2, 256); \
+            queue = realloc(queue, queue_alloc * sizeof(*queue)); \
+        } \
+        memcpy(queue[queue_size++], pos_, sizeof(int[3])); \
+    } while (0)
 
-    // Generate the projection into the plane.
-    // XXX: *very* ugly code, fix this!
-    mat4_set_identity(proj);
+    SELECT(start_pos, 255);
 
-    if (fabs(plane[2][0]) > 0.1) {
-        proj[0][0] = 0;
-        proj[3][0] = pos[0];
-    }
-    if (fabs(plane[2][1]) > 0.1) {
-        proj[1][1] = 0;
-        proj[3][1] = pos[1];
-    }
-    if (fabs(plane[2][2]) > 0.1) {
-        proj[2][2] = 0;
-        proj[3][2] = pos[2];
+    while (queue_next < queue_size) {
+        for (i = 0; i < 6; i++) {
+            p[0] = queue[queue_next][0] + FACES_NORMALS[i][0];
+            p[1] = queue[queue_next][1] + FACES_NORMALS[i][1];
+            p[2] = queue[queue_next][2] + FACES_NORMALS[i][2];
+            block = select_get_block(&ctx, p);
+            idx = select_index(p);
+            if (block->selection[idx]) continue; // Already done.
+            memcpy(value, block->voxels[idx], 4);
+            // Compute neighboors and mask.
+            for (j = 0; j < 6; j++) {
+                p2[0] = p[0] + FACES_NORMALS[j][0];
+                p2[1] = p[1] + FACES_NORMALS[j][1];
+                p2[2] = p[2] + FACES_NORMALS[j][2];
+                neighboor = select_get_block(&ctx, p2);
+                memcpy(neighboors[j], neighboor->voxels[select_index(p2)], 4);
+                mask[j] = neighboor->selection[select_index(p2)];
+            }
+            // XXX: the (void*) are only here for gcc <= 4.8.4
+            a = cond((void*)value, (void*)neighboors, (void*)mask, user);
+            if (a) SELECT(p, a);
+        }
+        queue_next++;
     }
+#undef SELECT
+    free(queue);
 
-    // XXX: use an accessor to speed up access.
-    iter = mesh_get_box_iterator(mesh, box, 0);
-    while (mesh_iter(&iter, vpos)) {
-        vec3_set(p, vpos[0], vpos[1], vpos[2]);
-        if (!bbox_contains_vec(box, p)) {
-            memset(value, 0, 4);
-        } else {
-            mat4_mul_vec3(proj, p, p);
-            int pi[3] = {floor(p[0]), floor(p[1]), floor(p[2])};
-            mesh_get_at(mesh, NULL, pi, value);
+    // Write the selected blocks into the selection mesh.
+    data = malloc(N * N * N * 4);
+    HASH_ITER(hh, ctx.blocks, block, tmp) {
+        if (block->selected) {
+            for (i = 0; i < N * N * N; i++) {
+                data[i][0] = data[i][1] = data[i][2] = 255;
+                data[i][3] = block->selection[i];
+            }
+            mesh_write_region(selection, block->pos, (int[]){N, N, N},
+                              (uint8_t*)data);
         }
-        mesh_set_at(mesh, NULL, vpos, value);
+        HASH_DEL(ctx.blocks, block);
+        free(block);
     }
-
+    free(data);
+    return 0;
 }
 
+
 static void mesh_fill(
         mesh_t *mesh,
         const float box[4][4],
@@ -158,6 +180,147 @@ static void mesh_fill(
     }
 }
 
+// Extrude along one axis: every voxel of the box gets the value of the
+// voxel of the slice at the same position in the plane.  The blocks of a
+// column along the axis that are fully inside the box all have the same
+// voxels, so we only compute their data once and share it.
+static void mesh_extrude_axis(mesh_t *mesh, const mesh_t *src, int axis,
+                              int slice_pos, const int aabb[2][3])
+{
+    int i, x, y, z, bpos[3], r[2][3], size[3], spos[3], sidx;
+    uint8_t (*slice)[4], (*voxels)[4];
+    block_data_t *data, *full_data;
+    bool full, empty;
+
+    for (i = 0; i < 3; i++) {
+        spos[i] = aabb[0][i];
+        size[i] = aabb[1][i] - aabb[0][i];
+        if (size[i] <= 0) return;
+    }
+    spos[axis] = slice_pos;
+    size[axis] = 1;
+    slice = malloc(size[0] * size[1] * size[2] * 4);
+    voxels = malloc(N * N * N * 4);
+    mesh_read_region(src, spos, size, (uint8_t*)slice);
+
+#define SLICE_INDEX(x, y, z) \
+    ((((axis == 2) ? 0 : (z) - aabb[0][2]) * size[1] + \
+      ((axis == 1) ? 0 : (y) - aabb[0][1])) * size[0] + \
+      ((axis == 0) ? 0 : (x) - aabb[0][0]))
+
+    // Iterate the columns of blocks, with the axis coordinate last.
+    for (bpos[(axis + 1) % 3] = aabb[0][(axis + 1) % 3] & ~(int)(N - 1);
+         bpos[(axis + 1) % 3] < aabb[1][(axis + 1) % 3];
+         bpos[(axis + 1) % 3] += N)
+    for (bpos[(axis + 2) % 3] = aabb[0][(axis + 2) % 3] & ~(int)(N - 1);
+         bpos[(axis + 2) % 3] < aabb[1][(axis + 2) % 3];
+         bpos[(axis + 2) % 3] += N)
+    {
+        for (i = 0; i < 3; i++) {
+            if (i == axis) continue;
+            r[0][i] = max(aabb[0][i], bpos[i]);
+            r[1][i] = min(aabb[1][i], bpos[i] + N);
+        }
+        // Skip the columns where the slice is empty.
+        r[0][axis] = aabb[0][axis];
+        r[1][axis] = aabb[0][axis] + 1;
+        empty = true;
+        for (z = r[0][2]; z < r[1][2]; z++)
+        for (y = r[0][1]; y < r[1][1]; y++)
+        for (x = r[0][0]; x < r[1][0]; x++) {
+            if (slice[SLICE_INDEX(x, y, z)][3]) empty = false;
+        }
+        if (empty) continue;
+
+        full_data = NULL;
+        for (bpos[axis] = aabb[0][axis] & ~(int)(N - 1);
+             bpos[axis] < aabb[1][axis]; bpos[axis] += N)
+        {
+            r[0][axis] = max(aabb[0][axis], bpos[axis]);
+            r[1][axis] = min(aabb[1][axis], bpos[axis] + N);
+            full = r[1][axis] - r[0][axis] == N;
+            if (full && full_data) {
+                mesh_set_block_data(mesh, bpos, full_data);
+                continue;
+            }
+            memset(voxels, 0, N * N * N * 4);
+            for (z = r[0][2]; z < r[1][2]; z++)
+            for (y = r[0][1]; y < r[1][1]; y++) {
+                i = (r[0][0] - bpos[0]) + (y - bpos[1]) * N +
+                    (z - bpos[2]) * N * N;
+                sidx = SLICE_INDEX(r[0][0], y, z);
+                if (axis == 0) {
+                    for (x = r[0][0]; x < r[1][0]; x++, i++)
+                        memcpy(voxels[i], slice[sidx], 4);
+                } else {
+                    memcpy(voxels[i], slice[sidx], (r[1][0] - r[0][0]) * 4);
+                }
+            }
+            data = mesh_block_data_new((uint8_t*)voxels);
+            mesh_set_block_data(mesh, bpos, data);
+            if (full)
+                full_data = data;
+            else
+                mesh_block_data_release(data);
+        }
+        if (full_data) mesh_block_data_release(full_data);
+    }
+#undef SLICE_INDEX
+    free(voxels);
+    free(slice);
+}
+
+static void mesh_extrude_get_color(const int pos[3], uint8_t c[4],
+                                   void *user)
+{
+    const mesh_t *src = USER_GET(user, 0);
+    const float (*proj)[4][4] = USER_GET(user, 1);
+    const float (*box)[4][4] = USER_GET(user, 2);
+    float p[3] = {pos[0], pos[1], pos[2]};
+
+    if (!bbox_contains_vec(*box, p)) {
+        memset(c, 0, 4);
+        return;
+    }
+    mat4_mul_vec3(*proj, p, p);
+    int pi[3] = {floor(p[0]), floor(p[1]), floor(p[2])};
+    mesh_get_at(src, NULL, pi, c);
+}
+
+void mesh_extrude(mesh_t *mesh,
+                  const float plane[4][4],
+                  const float box[4][4])
+{
+    float proj[4][4];
+    int i, axis = -1, nb = 0, aabb[2][3];
+    mesh_t *src = mesh_copy(mesh);
+
+    // Projection into the plane: we replace the coordinates along the
+    // axis of the plane normal by the plane position.
+    mat4_set_identity(proj);
+    for (i = 0; i < 3; i++) {
+        if (fabs(plane[2][i]) <= 0.1) continue;
+        proj[i][i] = 0;
+        proj[3][i] = plane[3][i];
+        axis = i;
+        nb++;
+    }
+
+    if (nb == 1) {
+        // Voxels p with b0 <= p < b1, as in bbox_contains_vec.
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = ceil(box[3][i] - box[i][i]);
+            aabb[1][i] = ceil(box[3][i] + box[i][i]);
+        }
+        mesh_clear(mesh);
+        mesh_extrude_axis(mesh, src, axis, floor(plane[3][axis]), aabb);
+    } else {
+        mesh_fill(mesh, box, mesh_extrude_get_color,
+                  USER_PASS(src, &proj, box));
+    }
+    mesh_delete(src);
+}
+
 static void mesh_move_get_color(const int pos[3], uint8_t c[4], void *user)
 {
     float p[3] = {pos[0], pos[1], pos[2]};
@@ -168,15 +331,204 @@ static void mesh_move_get_color(const int pos[3], uint8_t c[4], void *user)
     mesh_get_at(mesh, NULL, pi, c);
 }
 
+/*
+ * Transformation that maps voxels exactly to voxels: a permutation of the
+ * axes, with flips, and an integer translation.  The voxel at p goes to:
+ *
+ *   out[axis[i]] = sign[i] * p[i] + t[axis[i]]
+ */
+typedef struct {
+    int axis[3];
+    int sign[3];
+    int t[3];
+} int_transform_t;
+
+// Check if a matrix is an integer transformation, allowing for the float
+// errors we get from rotations of exactly 90°.
+static bool get_int_transform(const float mat[4][4], int_transform_t *tr)
+{
+    const float eps = 1e-4;
+    int i, j, n;
+    float v;
+
+    for (i = 0; i < 3; i++) { // Source axis.
+        n = 0;
+        for (j = 0; j < 3; j++) {
+            v = mat[i][j];
+            if (fabs(v) < eps) continue;
+            if (fabs(fabs(v) - 1) > eps) return false;
+            tr->axis[i] = j;
+            tr->sign[i] = v > 0 ? 1 : -1;
+            n++;
+        }
+        if (n != 1) return false;
+    }
+    if (tr->axis[0] == tr->axis[1] || tr->axis[0] == tr->axis[2] ||
+        tr->axis[1] == tr->axis[2]) return false;
+    for (i = 0; i < 3; i++) {
+        tr->t[i] = round(mat[3][i]);
+        if (fabs(mat[3][i] - tr->t[i]) > eps) return false;
+    }
+    return true;
+}
+
+// Compute the lowest corner of the transformation of a N^3 box.
+static void int_transform_box(const int_transform_t *tr, const int pos[3],
+                              int out[3])
+{
+    int i, j;
+    for (i = 0; i < 3; i++) {
+        j = tr->axis[i];
+        out[j] = (tr->sign[i] > 0 ? pos[i] : -(pos[i] + N - 1)) + tr->t[j];
+    }
+}
+
+// Context of a mesh_move call with an integer transformation.
+typedef struct {
+    const mesh_t    *src;
+    int_transform_t tr;
+    int_transform_t inv;
+    int             (*bpos)[3];   // Destination blocks.
+    block_data_t    **datas;      // The computed blocks data.
+} mesh_move_ctx_t;
+
+static void mesh_move_block(int i, int worker, void *user)
+{
+    mesh_move_ctx_t *ctx = user;
+    const int_transform_t *tr = &ctx->tr;
+    int p[3], q[3], o[3], size[3] = {N, N, N};
+    uint8_t (*src)[4], (*dst)[4];
+
+    src = malloc(2 * N * N * N * 4);
+    dst = src + N * N * N;
+    // The source voxels of the block are also a N^3 box.
+    int_transform_box(&ctx->inv, ctx->bpos[i], o);
+    mesh_read_region(ctx->src, o, size, (uint8_t*)src);
+    if (tr->axis[0] == 0 && tr->axis[1] == 1 && tr->axis[2] == 2 &&
+        tr->sign[0] > 0 && tr->sign[1] > 0 && tr->sign[2] > 0) {
+        // Translation: the region is already the block.
+        ctx->datas[i] = mesh_block_data_new((uint8_t*)src);
+        free(src);
+        return;
+    }
+    for (p[2] = 0; p[2] < N; p[2]++)
+    for (p[1] = 0; p[1] < N; p[1]++)
+    for (p[0] = 0; p[0] < N; p[0]++) {
+        q[tr->axis[0]] = tr->sign[0] > 0 ? p[0] : N - 1 - p[0];
+        q[tr->axis[1]] = tr->sign[1] > 0 ? p[1] : N - 1 - p[1];
+        q[tr->axis[2]] = tr->sign[2] > 0 ? p[2] : N - 1 - p[2];
+        memcpy(dst[q[0] + q[1] * N + q[2] * N * N],
+               src[p[0] + p[1] * N + p[2] * N * N], 4);
+    }
+    ctx->datas[i] = mesh_block_data_new((uint8_t*)dst);
+    free(src);
+}
+
+static int bpos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    if (a[2] != b[2]) return a[2] < b[2] ? -1 : 1;
+    if (a[1] != b[1]) return a[1] < b[1] ? -1 : 1;
+    if (a[0] != b[0]) return a[0] < b[0] ? -1 : 1;
+    return 0;
+}
+
+// Sort a list of block positions and remove the duplicates.  Return the
+// new size of the list.
+static int bpos_sort_unique(int (*list)[3], int nb)
+{
+    int i, n;
+    if (nb) qsort(list, nb, sizeof(*list), bpos_cmp);
+    for (i = 0, n = 0; i < nb; i++) {
+        if (n && bpos_cmp(list[i], list[n - 1]) == 0) continue;
+        memcpy(list[n++], list[i], sizeof(*list));
+    }
+    return n;
+}
+
+// Move a mesh with an integer transformation.  Each block of the result
+// is a permutation of a N^3 box of the source mesh, that we read with
+// mesh_read_region, so there is no per voxel lookup.
+static void mesh_move_int(mesh_t *mesh, const int_transform_t *tr)
+{
+    int i, j, n, nb = 0, bpos[3], o[3], p[3];
+    mesh_iterator_t iter;
+    mesh_t *src = mesh_copy(mesh);
+    mesh_move_ctx_t ctx = {.src = src, .tr = *tr};
+
+    mesh_clear(mesh);
+
+    // Block aligned translation: we only move the blocks, that still share
+    // their data with the source mesh.
+    if (tr->axis[0] == 0 && tr->axis[1] == 1 && tr->axis[2] == 2 &&
+        tr->sign[0] > 0 && tr->sign[1] > 0 && tr->sign[2] > 0 &&
+        tr->t[0] % N == 0 && tr->t[1] % N == 0 && tr->t[2] % N == 0) {
+        iter = mesh_get_iterator(src, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            for (i = 0; i < 3; i++) p[i] = bpos[i] + tr->t[i];
+            mesh_copy_block(src, bpos, mesh, p);
+        }
+        mesh_delete(src);
+        return;
+    }
+
+    for (i = 0; i < 3; i++) {
+        ctx.inv.axis[tr->axis[i]] = i;
+        ctx.inv.sign[tr->axis[i]] = tr->sign[i];
+        ctx.inv.t[i] = -tr->sign[i] * tr->t[tr->axis[i]];
+    }
+
+    // Each source block goes into up to eight destination blocks.
+    iter = mesh_get_iterator(src, MESH_ITER_BLOCKS | MESH_ITER_SKIP_EMPTY);
+    while (mesh_iter(&iter, bpos)) {
+        int_transform_box(tr, bpos, o);
+        for (i = 0; i < 8; i++) {
+            if (nb % 64 == 0)
+                ctx.bpos = realloc(ctx.bpos, (nb + 64) * sizeof(*ctx.bpos));
+            for (j = 0; j < 3; j++)
+                ctx.bpos[nb][j] = (o[j] + ((i >> j) & 1) * (N - 1)) &
+                                  ~(int)(N - 1);
+            nb++;
+        }
+    }
+    n = bpos_sort_unique(ctx.bpos, nb);
+
+    ctx.datas = calloc(n, sizeof(*ctx.datas));
+    worker_parallel_for(n, mesh_move_block, &ctx);
+    for (i = 0; i < n; i++) {
+        mesh_set_block_data(mesh, ctx.bpos[i], ctx.datas[i]);
+        mesh_block_data_release(ctx.datas[i]);
+    }
+    free(ctx.datas);
+    free(ctx.bpos);
+    mesh_delete(src);
+}
+
 void mesh_move(mesh_t *mesh, const float mat[4][4])
 {
     float box[4][4];
-    mesh_t *src_mesh = mesh_copy(mesh);
+    mesh_t *src_mesh;
     float imat[4][4];
+    int_transform_t tr;
+
+    if (get_int_transform(mat, &tr)) {
+        if (    tr.axis[0] == 0 && tr.axis[1] == 1 && tr.axis[2] == 2 &&
+                tr.sign[0] > 0 && tr.sign[1] > 0 && tr.sign[2] > 0 &&
+                !tr.t[0] && !tr.t[1] && !tr.t[2]) return;
+        mesh_move_int(mesh, &tr);
+        mesh_remove_empty_blocks(mesh, false);
+        return;
+    }
 
+    // Generic transformation: we get each voxel of the new box from the
+    // source mesh.
+    src_mesh = mesh_copy(mesh);
     mat4_invert(mat, imat);
     mesh_get_box(mesh, true, box);
-    if (box_is_null(box)) return;
+    if (box_is_null(box)) {
+        mesh_delete(src_mesh);
+        return;
+    }
     mat4_mul(mat, box, box);
     mesh_fill(mesh, box, mesh_move_get_color, USER_PASS(src_mesh, &imat));
     mesh_delete(src_mesh);
@@ -187,110 +539,929 @@ void mesh_blit(mesh_t *mesh, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
                mesh_iterator_t *iter)
 {
-    mesh_iterator_t default_iter = {0};
-    int pos[3];
-    if (!iter) iter = &default_iter;
-    for (pos[2] = z; pos[2] < z + d; pos[2]++)
-    for (pos[1] = y; pos[1] < y + h; pos[1]++)
-    for (pos[0] = x; pos[0] < x + w; pos[0]++) {
-        mesh_set_at(mesh, iter, pos, data);
-        data += 4;
+    mesh_write_region(mesh, (int[]){x, y, z}, (int[]){w, h, d}, data);
+}
+
+/*
+ * Per voxel transformations.
+ *
+ * The blocks are collected first, since we can't modify the mesh while
+ * iterating it, and the blocks that share the same data are only computed
+ * once.  Uniform blocks are computed with a single call to the function.
+ */
+
+typedef struct {
+    int         pos[3];
+    uint64_t    id;     // Id of the block data.
+    int         job;    // Index of the job that computes the new data.
+} mesh_map_block_t;
+
+// Context of a mesh_map_voxels call, shared by all the worker threads.
+typedef struct {
+    const mesh_t    *mesh;
+    void            (*f)(uint8_t v[4], void *user);
+    void            *user;
+    int             (*bpos)[3];   // One block for each data to compute.
+    block_data_t    **datas;      // New data, or NULL if unchanged.
+} mesh_map_ctx_t;
+
+static int mesh_map_block_cmp(const void *a_, const void *b_)
+{
+    const mesh_map_block_t *a = a_, *b = b_;
+    return a->id < b->id ? -1 : a->id > b->id ? 1 : 0;
+}
+
+static void mesh_map_block(int i, int worker, void *user)
+{
+    mesh_map_ctx_t *ctx = user;
+    int j;
+    bool changed = false;
+    uint8_t (*voxels)[4], prev[4], prev_out[4];
+
+    voxels = malloc(N * N * N * 4);
+    mesh_get_block_data(ctx->mesh, NULL, ctx->bpos[i], NULL,
+                        (uint8_t*)voxels);
+    // Most blocks have runs of the same value, so we only call the
+    // function when the value changes.
+    for (j = 0; j < N * N * N; j++) {
+        if (j && memcmp(voxels[j], prev, 4) == 0) {
+            memcpy(voxels[j], prev_out, 4);
+            continue;
+        }
+        memcpy(prev, voxels[j], 4);
+        ctx->f(voxels[j], ctx->user);
+        memcpy(prev_out, voxels[j], 4);
+        changed = changed || memcmp(prev, prev_out, 4);
     }
-    mesh_remove_empty_blocks(mesh, false);
+    ctx->datas[i] = changed ? mesh_block_data_new((uint8_t*)voxels) : NULL;
+    free(voxels);
 }
 
-void mesh_shift_alpha(mesh_t *mesh, int v)
+void mesh_map_voxels(mesh_t *mesh, void (*f)(uint8_t v[4], void *user),
+                     void *user)
 {
+    int i, nb = 0, n = 0, bpos[3];
+    uint8_t v[4], v2[4];
     mesh_iterator_t iter;
-    int pos[3];
-    uint8_t value[4];
+    mesh_map_block_t *blocks = NULL;
+    mesh_map_ctx_t ctx = {.mesh = mesh, .f = f, .user = user};
 
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, value);
-        value[3] = clamp(value[3] + v, 0, 255);
-        mesh_set_at(mesh, NULL, pos, value);
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS | MESH_ITER_SKIP_EMPTY);
+    while (mesh_iter(&iter, bpos)) {
+        if (mesh_get_block_color(mesh, NULL, bpos, v)) {
+            memcpy(v2, v, 4);
+            f(v2, user);
+            if (!v2[3]) memset(v2, 0, 4);
+            if (memcmp(v, v2, 4)) mesh_fill_block(mesh, bpos, v2);
+            continue;
+        }
+        if (nb % 64 == 0)
+            blocks = realloc(blocks, (nb + 64) * sizeof(*blocks));
+        memcpy(blocks[nb].pos, bpos, sizeof(bpos));
+        mesh_get_block_data(mesh, NULL, bpos, &blocks[nb].id, NULL);
+        nb++;
+    }
+
+    if (nb) qsort(blocks, nb, sizeof(*blocks), mesh_map_block_cmp);
+    ctx.bpos = calloc(nb, sizeof(*ctx.bpos));
+    for (i = 0; i < nb; i++) {
+        if (!i || blocks[i].id != blocks[i - 1].id)
+            memcpy(ctx.bpos[n++], blocks[i].pos, sizeof(blocks[i].pos));
+        blocks[i].job = n - 1;
+    }
+    ctx.datas = calloc(n, sizeof(*ctx.datas));
+    worker_parallel_for(n, mesh_map_block, &ctx);
+
+    for (i = 0; i < nb; i++) {
+        if (ctx.datas[blocks[i].job])
+            mesh_set_block_data(mesh, blocks[i].pos, ctx.datas[blocks[i].job]);
+    }
+    for (i = 0; i < n; i++) {
+        if (ctx.datas[i]) mesh_block_data_release(ctx.datas[i]);
+    }
+    free(ctx.datas);
+    free(ctx.bpos);
+    free(blocks);
+}
+
+static void shift_alpha_func(uint8_t v[4], void *user)
+{
+    int shift = *(int*)user;
+    v[3] = clamp(v[3] + shift, 0, 255);
+}
+
+void mesh_shift_alpha(mesh_t *mesh, int v)
+{
+    mesh_map_voxels(mesh, shift_alpha_func, &v);
+}
+
+static void replace_color_func(uint8_t v[4], void *user)
+{
+    const uint8_t (*colors)[4] = user;
+    if (memcmp(v, colors[0], 4) == 0) memcpy(v, colors[1], 4);
+}
+
+void mesh_replace_color(mesh_t *mesh, const uint8_t color[4],
+                        const uint8_t new_color[4])
+{
+    uint8_t colors[2][4];
+    memcpy(colors[0], color, 4);
+    memcpy(colors[1], new_color, 4);
+    mesh_map_voxels(mesh, replace_color_func, colors);
+}
+
+static void shift_brightness_func(uint8_t v[4], void *user)
+{
+    int i, shift = *(int*)user;
+    if (!v[3]) return;
+    for (i = 0; i < 3; i++) v[i] = clamp(v[i] + shift, 0, 255);
+}
+
+void mesh_shift_brightness(mesh_t *mesh, int v)
+{
+    mesh_map_voxels(mesh, shift_brightness_func, &v);
+}
+
+static void threshold_alpha_func(uint8_t v[4], void *user)
+{
+    int threshold = *(int*)user;
+    if (!v[3]) return;
+    if (v[3] < threshold)
+        memset(v, 0, 4);
+    else
+        v[3] = 255;
+}
+
+void mesh_threshold_alpha(mesh_t *mesh, int threshold)
+{
+    mesh_map_voxels(mesh, threshold_alpha_func, &threshold);
+}
+
+/*
+ * Blend kernels.
+ *
+ * For each mode we have a function that combines n source colors (b) into
+ * n destination colors (a), using fixed point math written so that the
+ * compiler can vectorize the loops.  The output must not overlap the
+ * inputs.
+ */
+
+// Exact x / 255 for x in [0, 65534].
+static inline uint8_t div255(uint16_t x)
+{
+    return (uint16_t)(x + 1 + (x >> 8)) >> 8;
+}
+
+// Multiply the colors by a single color.  This one can work in place.
+static void colors_mul(int n, const uint8_t (*a)[4], const uint8_t b[4],
+                       uint8_t (*out)[4])
+{
+    int i, c;
+    for (i = 0; i < n; i++)
+    for (c = 0; c < 4; c++)
+        out[i][c] = div255(a[i][c] * b[c]);
+}
+
+static void blend_over(int n, const uint8_t (*a)[4], const uint8_t (*b)[4],
+                       uint8_t (*restrict out)[4])
+{
+    int i, c, aa, ba, num, den;
+    double inv;
+    for (i = 0; i < n; i++) {
+        aa = a[i][3];
+        ba = b[i][3];
+        // Fast paths for the common cases of transparent or opaque
+        // colors, that give the same result as the general formula.
+        if (ba == 0) {
+            memcpy(out[i], a[i], 4);
+        } else if (aa == 0) {
+            memcpy(out[i], b[i], 4);
+        } else if (aa == 255 || ba == 255) {
+            for (c = 0; c < 3; c++)
+                out[i][c] = div255(b[i][c] * ba + a[i][c] * (255 - ba));
+            out[i][3] = 255;
+        } else {
+            // num / den rounded down.  Since den < 2^16, a non integer
+            // quotient is at least 1 / 2^16 away from an integer, much more
+            // than the rounding error of the double.
+            den = 255 * ba + aa * (255 - ba);
+            inv = 1.0 / den;
+            for (c = 0; c < 3; c++) {
+                num = 255 * b[i][c] * ba + a[i][c] * aa * (255 - ba);
+                out[i][c] = num * inv + 1e-9;
+            }
+            out[i][3] = ba + div255(aa * (255 - ba));
+        }
+    }
+}
+
+static void blend_sub(int n, const uint8_t (*a)[4], const uint8_t (*b)[4],
+                      uint8_t (*restrict out)[4])
+{
+    int i, c;
+    for (i = 0; i < n; i++) {
+        for (c = 0; c < 3; c++) out[i][c] = a[i][c];
+        out[i][3] = max(0, a[i][3] - b[i][3]);
+    }
+}
+
+static void blend_sub_clamp(int n, const uint8_t (*a)[4],
+                            const uint8_t (*b)[4], uint8_t (*restrict out)[4])
+{
+    int i, c;
+    for (i = 0; i < n; i++) {
+        for (c = 0; c < 3; c++) out[i][c] = a[i][c];
+        out[i][3] = min(a[i][3], 255 - b[i][3]);
+    }
+}
+
+static void blend_paint(int n, const uint8_t (*a)[4], const uint8_t (*b)[4],
+                        uint8_t (*restrict out)[4])
+{
+    int i, c;
+    uint16_t w;
+    for (i = 0; i < n; i++) {
+        w = b[i][3];
+        for (c = 0; c < 3; c++)
+            out[i][c] = div255(a[i][c] * (255 - w) + b[i][c] * w);
+        out[i][3] = a[i][3];
+    }
+}
+
+static void blend_max(int n, const uint8_t (*a)[4], const uint8_t (*b)[4],
+                      uint8_t (*restrict out)[4])
+{
+    int i, c;
+    for (i = 0; i < n; i++) {
+        out[i][3] = max(a[i][3], b[i][3]);
+        for (c = 0; c < 3; c++) out[i][c] = b[i][c];
+    }
+}
+
+static void blend_intersect(int n, const uint8_t (*a)[4],
+                            const uint8_t (*b)[4], uint8_t (*restrict out)[4])
+{
+    int i, c;
+    for (i = 0; i < n; i++) {
+        for (c = 0; c < 3; c++) out[i][c] = a[i][c];
+        out[i][3] = min(a[i][3], b[i][3]);
     }
 }
 
-// Multiply two colors together.
-static void color_mul(const uint8_t a[4], const uint8_t b[4],
-                      uint8_t out[4])
+static void blend_mult_alpha(int n, const uint8_t (*a)[4],
+                             const uint8_t (*b)[4], uint8_t (*restrict out)[4])
 {
-    out[0] = (int)a[0] * b[0] / 255;
-    out[1] = (int)a[1] * b[1] / 255;
-    out[2] = (int)a[2] * b[2] / 255;
-    out[3] = (int)a[3] * b[3] / 255;
+    int i, c;
+    uint16_t ba;
+    for (i = 0; i < n; i++) {
+        ba = b[i][3];
+        for (c = 0; c < 4; c++)
+            out[i][c] = div255(a[i][c] * ba);
+    }
 }
 
 // XXX: cleanup this: in fact we might not need that many modes!
-static void combine(const uint8_t a[4], const uint8_t b[4], int mode,
-                    uint8_t out[4])
-{
-    int i, aa = a[3], ba = b[3];
-    uint8_t ret[4];
-    memcpy(ret, a, 4);
-    if (mode == MODE_PAINT) {
-        ret[0] = mix(a[0], b[0], ba / 255.);
-        ret[1] = mix(a[1], b[1], ba / 255.);
-        ret[2] = mix(a[2], b[2], ba / 255.);
-    }
-    else if (mode == MODE_OVER) {
-        if (255 * ba + aa * (255 - ba)) {
-            for (i = 0; i < 3; i++) {
-                ret[i] = (255 * b[i] * ba + a[i] * aa * (255 - ba)) /
-                         (255 * ba + aa * (255 - ba));
+static void blend(int mode, int n, const uint8_t (*a)[4],
+                  const uint8_t (*b)[4], uint8_t (*restrict out)[4])
+{
+    static void (*const FUNCS[])(int n, const uint8_t (*a)[4],
+                                 const uint8_t (*b)[4],
+                                 uint8_t (*restrict out)[4]) = {
+        [MODE_OVER]         = blend_over,
+        [MODE_SUB]          = blend_sub,
+        [MODE_SUB_CLAMP]    = blend_sub_clamp,
+        [MODE_PAINT]        = blend_paint,
+        [MODE_MAX]          = blend_max,
+        [MODE_INTERSECT]    = blend_intersect,
+        [MODE_MULT_ALPHA]   = blend_mult_alpha,
+    };
+    assert(mode >= 0 && mode < ARRAY_SIZE(FUNCS) && FUNCS[mode]);
+    FUNCS[mode](n, a, b, out);
+}
+
+
+// Classify the voxels of a block against the painter box and shape:
+// return +1 if they are all fully inside, -1 if they are all outside, and
+// zero if we have to test each voxel.
+static int mesh_op_classify_block(const painter_t *painter,
+                                  const float mat[4][4],
+                                  const float size[3], const int bpos[3])
+{
+    const float EPS = 1e-3;
+    float p[3], b[2][3];
+    int i, j, nb_in = 0;
+
+    vec3_copy(VEC(+INFINITY, +INFINITY, +INFINITY), b[0]);
+    vec3_copy(VEC(-INFINITY, -INFINITY, -INFINITY), b[1]);
+    // Bounding box of the voxels centers in the shape space.
+    for (i = 0; i < 8; i++) {
+        p[0] = bpos[0] + ((i & 1) ? N - 0.5 : 0.5);
+        p[1] = bpos[1] + ((i & 2) ? N - 0.5 : 0.5);
+        p[2] = bpos[2] + ((i & 4) ? N - 0.5 : 0.5);
+        if (painter->box && !box_is_null(*painter->box))
+            nb_in += bbox_contains_vec(*painter->box, p) ? 1 : 0;
+        mat4_mul_vec3(mat, p, p);
+        for (j = 0; j < 3; j++) {
+            b[0][j] = min(b[0][j], p[j] - EPS);
+            b[1][j] = max(b[1][j], p[j] + EPS);
+        }
+    }
+    if (painter->box && !box_is_null(*painter->box) && nb_in != 8)
+        return 0;
+    if (!painter->shape->bound) return 0;
+    return painter->shape->bound(b, size, painter->smoothness);
+}
+
+// Data used by each worker thread of a mesh_op call.
+typedef struct {
+    mesh_t          *out;       // The new values of the changed blocks.
+    mesh_accessor_t accessor;
+    uint8_t         voxels[N * N * N][4];
+    uint8_t         src[N * N * N][4];
+    uint8_t         new[N * N * N][4];
+    bool            skip[N * N * N];
+} mesh_op_worker_t;
+
+// Shape of a symmetric operation rasterized once: the source alpha of the
+// voxels of a sorted list of blocks.  The blocks not in the list are
+// outside of the shape.
+typedef struct {
+    int             nb;
+    int             (*bpos)[3];
+    uint8_t         (*alpha)[N * N * N];
+} mesh_op_shape_t;
+
+// Shape swept along a polyline.  For round spheres the swept volume is a
+// chain of capsules that we get from the distance to the segments.  For
+// the other shapes we place it at regular steps along the segments and
+// keep the max of all the values.
+typedef struct {
+    int             nb;         // Number of points.
+    float           (*points)[3];
+    bool            capsule;
+    float           radius;     // Radius of the capsules.
+    float           reach;      // Max distance of the shape to a point.
+} mesh_op_stroke_t;
+
+// Context of a mesh_op call, shared by all the worker threads.
+typedef struct {
+    const painter_t *painter;
+    const mesh_t    *mesh;      // Only read during the parallel part.
+    float           mat[4][4];
+    float           size[3];
+    bool            use_box;
+    bool            skip_src_empty;
+    bool            skip_dst_empty;
+    int             (*bpos)[3]; // Position of the blocks to process.
+    int             *changed;   // Per block: worker index + 1, or zero.
+    mesh_op_worker_t *workers;
+
+    // For symmetric operations, the shape already rasterized, and the
+    // mirror axes and positions (twice the symmetry origin) to get the
+    // source voxels from it.
+    mesh_op_shape_t *shape;
+    int             mirror;
+    int             mirror_pos[3];
+
+    // For strokes, the shape box is centered on each point.
+    const mesh_op_stroke_t *stroke;
+} mesh_op_ctx_t;
+
+// Square distance from a point to a segment.
+static float seg_dist2(const float p[3], const float a[3], const float b[3])
+{
+    float ab[3], ap[3], l2, t;
+    vec3_sub(b, a, ab);
+    vec3_sub(p, a, ap);
+    l2 = vec3_norm2(ab);
+    t = l2 ? clamp(vec3_dot(ap, ab) / l2, 0.0f, 1.0f) : 0;
+    vec3_addk(ap, ab, -t, ap);
+    return vec3_norm2(ap);
+}
+
+// Evaluate the shape for a row of N voxels starting at p.
+static void mesh_op_shape_row(const mesh_op_ctx_t *ctx, const float p[3],
+                              float *out)
+{
+    const float (*mat)[4] = ctx->mat;
+    float row[3][N];
+    int x;
+
+    for (x = 0; x < N; x++) {
+        row[0][x] = mat[0][0] * (p[0] + x) + mat[1][0] * p[1] +
+                    mat[2][0] * p[2] + mat[3][0];
+        row[1][x] = mat[0][1] * (p[0] + x) + mat[1][1] * p[1] +
+                    mat[2][1] * p[2] + mat[3][1];
+        row[2][x] = mat[0][2] * (p[0] + x) + mat[1][2] * p[1] +
+                    mat[2][2] * p[2] + mat[3][2];
+    }
+    ctx->painter->shape->func_batch(N, row[0], row[1], row[2], ctx->size,
+                                    ctx->painter->smoothness, out);
+}
+
+// Evaluate a stroke for a row of N voxels starting at p.
+static void mesh_op_stroke_row(const mesh_op_ctx_t *ctx, const float p[3],
+                               float *out)
+{
+    const mesh_op_stroke_t *stroke = ctx->stroke;
+    const float *a, *b;
+    float c[3], q[3], ab[3], row_k[N], d2[N], l2, t, x, reach;
+    int i, j;
+
+    // Skip the points and segments too far from the row center.
+    vec3_set(c, p[0] + N / 2.0f, p[1], p[2]);
+    reach = stroke->reach + N / 2.0f + 1;
+    if (stroke->capsule) {
+        for (j = 0; j < N; j++) d2[j] = INFINITY;
+        for (i = 0; i < max(stroke->nb - 1, 1); i++) {
+            a = stroke->points[i];
+            b = stroke->points[min(i + 1, stroke->nb - 1)];
+            if (seg_dist2(c, a, b) > reach * reach) continue;
+            vec3_sub(b, a, ab);
+            l2 = vec3_norm2(ab);
+            vec3_sub(p, a, q);
+            for (j = 0; j < N; j++) {
+                x = q[0] + j;
+                t = l2 ? (x * ab[0] + q[1] * ab[1] + q[2] * ab[2]) / l2 : 0;
+                t = clamp(t, 0.0f, 1.0f);
+                d2[j] = min(d2[j], (x - t * ab[0]) * (x - t * ab[0]) +
+                                   (q[1] - t * ab[1]) * (q[1] - t * ab[1]) +
+                                   (q[2] - t * ab[2]) * (q[2] - t * ab[2]));
             }
         }
-        ret[3] = ba + aa * (255 - ba) / 255;
-    }
-    else if (mode == MODE_SUB) {
-        ret[3] = max(0, aa - ba);
-    }
-    else if (mode == MODE_MAX) {
-        ret[0] = b[0];
-        ret[1] = b[1];
-        ret[2] = b[2];
-        ret[3] = max(a[3], b[3]);
-    } else if (mode == MODE_SUB_CLAMP) {
-        ret[0] = a[0];
-        ret[1] = a[1];
-        ret[2] = a[2];
-        ret[3] = min(aa, 255 - ba);
-    } else if (mode == MODE_MULT_ALPHA) {
-        ret[0] = ret[0] * ba / 255;
-        ret[1] = ret[1] * ba / 255;
-        ret[2] = ret[2] * ba / 255;
-        ret[3] = ret[3] * ba / 255;
-    } else if (mode == MODE_INTERSECT) {
-        ret[3] = min(aa, ba);
-    } else {
-        assert(false);
+        for (j = 0; j < N; j++) out[j] = stroke->radius - sqrtf(d2[j]);
+        return;
+    }
+
+    for (j = 0; j < N; j++) out[j] = -INFINITY;
+    for (i = 0; i < stroke->nb; i++) {
+        a = stroke->points[i];
+        if (vec3_dist2(c, a) > reach * reach) continue;
+        vec3_sub(p, a, q);
+        mesh_op_shape_row(ctx, q, row_k);
+        for (j = 0; j < N; j++) out[j] = max(out[j], row_k[j]);
     }
-    memcpy(out, ret, 4);
 }
 
+// Same as mesh_op_classify_block for a stroke.
+static int mesh_op_classify_stroke_block(const mesh_op_ctx_t *ctx,
+                                         const int bpos[3])
+{
+    const float EPS = 1e-3;
+    const painter_t *painter = ctx->painter;
+    const mesh_op_stroke_t *stroke = ctx->stroke;
+    const float sm = painter->smoothness;
+    // Distance from the block center to its voxels centers.
+    const float h = (N - 1) / 2.0f * sqrtf(3) + EPS;
+    float c[3], p[3], b[2][3], d2 = INFINITY, k;
+    int i, j, l, r, ret = -1;
 
-void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
+    if (ctx->use_box) {
+        for (i = 0; i < 8; i++) {
+            p[0] = bpos[0] + ((i & 1) ? N - 0.5 : 0.5);
+            p[1] = bpos[1] + ((i & 2) ? N - 0.5 : 0.5);
+            p[2] = bpos[2] + ((i & 4) ? N - 0.5 : 0.5);
+            if (!bbox_contains_vec(*painter->box, p)) return 0;
+        }
+    }
+    vec3_set(c, bpos[0] + N / 2.0f, bpos[1] + N / 2.0f, bpos[2] + N / 2.0f);
+
+    if (stroke->capsule) {
+        for (i = 0; i < max(stroke->nb - 1, 1); i++) {
+            d2 = min(d2, seg_dist2(c, stroke->points[i],
+                                   stroke->points[min(i + 1, stroke->nb - 1)]));
+        }
+        k = stroke->radius - sqrtf(d2);
+        if (k - h >= sm) return +1;
+        if (k + h <= -sm && (sm || k + h < 0)) return -1;
+        return 0;
+    }
+
+    // Inside if any of the shapes contains the block, outside if all of
+    // them are outside.
+    for (i = 0; i < stroke->nb; i++) {
+        if (vec3_dist(c, stroke->points[i]) > stroke->reach + h) continue;
+        if (!painter->shape->bound) return 0;
+        vec3_copy(VEC(+INFINITY, +INFINITY, +INFINITY), b[0]);
+        vec3_copy(VEC(-INFINITY, -INFINITY, -INFINITY), b[1]);
+        for (j = 0; j < 8; j++) {
+            p[0] = bpos[0] + ((j & 1) ? N - 0.5 : 0.5);
+            p[1] = bpos[1] + ((j & 2) ? N - 0.5 : 0.5);
+            p[2] = bpos[2] + ((j & 4) ? N - 0.5 : 0.5);
+            vec3_sub(p, stroke->points[i], p);
+            mat4_mul_vec3(ctx->mat, p, p);
+            for (l = 0; l < 3; l++) {
+                b[0][l] = min(b[0][l], p[l] - EPS);
+                b[1][l] = max(b[1][l], p[l] + EPS);
+            }
+        }
+        r = painter->shape->bound(b, ctx->size, sm);
+        if (r > 0) return +1;
+        if (r == 0) ret = 0;
+    }
+    return ret;
+}
+
+// Compute the source color of all the voxels of a block, and mark the
+// ones the operation doesn't touch.
+static void mesh_op_block_src(const mesh_op_ctx_t *ctx, const int bpos[3],
+                              uint8_t (*src)[4], bool *skip)
 {
-    int i, vp[3];
+    const painter_t *painter = ctx->painter;
+    int i, x, y, z;
+    float p[3], row_k[N], k, v;
+
+    i = 0;
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        // Evaluate the shape for the whole row at once.
+        vec3_set(p, bpos[0] + 0.5, bpos[1] + y + 0.5, bpos[2] + z + 0.5);
+        if (ctx->stroke)
+            mesh_op_stroke_row(ctx, p, row_k);
+        else
+            mesh_op_shape_row(ctx, p, row_k);
+        for (x = 0; x < N; x++, i++) {
+            memcpy(src[i], painter->color, 4);
+            skip[i] = false;
+            if (ctx->use_box) {
+                vec3_set(p, bpos[0] + x + 0.5, bpos[1] + y + 0.5,
+                            bpos[2] + z + 0.5);
+                if (!bbox_contains_vec(*painter->box, p)) {
+                    skip[i] = true;
+                    continue;
+                }
+            }
+            k = row_k[x];
+            if (painter->smoothness) {
+                v = clamp(k / painter->smoothness, -1.0f, 1.0f) /
+                    2.0f + 0.5f;
+            } else {
+                v = (k >= 0.f) ? 1.f : 0.f;
+            }
+            src[i][3] *= v;
+            skip[i] = !src[i][3] && ctx->skip_src_empty;
+        }
+    }
+}
+
+// Same as mesh_op_block_src, but get the source colors from the mirrored
+// rasterized shape.  tmp is used to gather the shape alpha.
+static void mesh_op_block_src_mirror(const mesh_op_ctx_t *ctx,
+                                     const int bpos[3], uint8_t (*src)[4],
+                                     bool *skip, uint8_t *tmp)
+{
+    const painter_t *painter = ctx->painter;
+    const mesh_op_shape_t *shape = ctx->shape;
+    const int (*found)[3];
+    const uint8_t *alpha, *row;
+    int i, j, x, y, z, p[3], q[3], r[2][3];
+    float c[3];
+
+    // The voxel x is mirrored to mirror_pos - 1 - x, so the block is the
+    // mirror of a N^3 box that can overlap up to eight shape blocks.
+    for (i = 0; i < 3; i++) {
+        p[i] = (ctx->mirror & (1 << i)) ? ctx->mirror_pos[i] - bpos[i] - N
+                                        : bpos[i];
+    }
+    memset(tmp, 0, N * N * N);
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++) {
+            q[j] = (p[j] & ~(int)(N - 1)) + ((i >> j) & 1) * N;
+            r[0][j] = max(p[j], q[j]);
+            r[1][j] = min(p[j] + N, q[j] + N);
+        }
+        if (r[0][0] >= r[1][0] || r[0][1] >= r[1][1] || r[0][2] >= r[1][2])
+            continue;
+        found = bsearch(q, shape->bpos, shape->nb, sizeof(*shape->bpos),
+                        bpos_cmp);
+        if (!found) continue;
+        alpha = shape->alpha[found - shape->bpos];
+        for (z = r[0][2]; z < r[1][2]; z++)
+        for (y = r[0][1]; y < r[1][1]; y++) {
+            memcpy(tmp + ((z - p[2]) * N + (y - p[1])) * N + r[0][0] - p[0],
+                   alpha + ((z - q[2]) * N + (y - q[1])) * N + r[0][0] - q[0],
+                   r[1][0] - r[0][0]);
+        }
+    }
+
+    i = 0;
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        row = tmp + (((ctx->mirror & 4) ? N - 1 - z : z) * N +
+                     ((ctx->mirror & 2) ? N - 1 - y : y)) * N;
+        for (x = 0; x < N; x++, i++) {
+            memcpy(src[i], painter->color, 3);
+            src[i][3] = row[(ctx->mirror & 1) ? N - 1 - x : x];
+            skip[i] = !src[i][3] && ctx->skip_src_empty;
+        }
+    }
+    if (!ctx->use_box) return;
+    i = 0;
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++, i++) {
+        vec3_set(c, bpos[0] + x + 0.5, bpos[1] + y + 0.5, bpos[2] + z + 0.5);
+        if (!bbox_contains_vec(*painter->box, c)) skip[i] = true;
+    }
+}
+
+// Apply the operation on a single block, reading it from the source mesh
+// and writing it in the worker output mesh if it changed.
+static void mesh_op_block(int idx, int worker, void *user)
+{
+    mesh_op_ctx_t *ctx = user;
+    mesh_op_worker_t *w = &ctx->workers[worker];
+    const painter_t *painter = ctx->painter;
+    const int *bpos = ctx->bpos[idx];
+    int i, r, mode = painter->mode;
     uint8_t value[4], new_value[4], c[4];
+    bool changed;
+
+    if (ctx->stroke)
+        r = mesh_op_classify_stroke_block(ctx, bpos);
+    else
+        r = mesh_op_classify_block(painter, ctx->mat, ctx->size, bpos);
+    if (r) {
+        memcpy(c, painter->color, 4);
+        if (r < 0) c[3] = 0;
+        if (!c[3] && ctx->skip_src_empty) return;
+        if (mesh_get_block_color(ctx->mesh, &w->accessor, bpos, value)) {
+            if (!value[3] && ctx->skip_dst_empty) return;
+            blend(mode, 1, &value, &c, &new_value);
+            if (vec4_equal(value, new_value)) return;
+            mesh_fill_block(w->out, bpos, new_value);
+            ctx->changed[idx] = worker + 1;
+            return;
+        }
+        for (i = 0; i < N * N * N; i++) memcpy(w->src[i], c, 4);
+        memset(w->skip, 0, sizeof(w->skip));
+    } else if (ctx->shape) {
+        mesh_op_block_src_mirror(ctx, bpos, w->src, w->skip,
+                                 (uint8_t*)w->new);
+    } else {
+        mesh_op_block_src(ctx, bpos, w->src, w->skip);
+    }
+
+    mesh_get_block_data(ctx->mesh, &w->accessor, bpos, NULL,
+                        (uint8_t*)w->voxels);
+    blend(mode, N * N * N, w->voxels, w->src, w->new);
+    changed = false;
+    for (i = 0; i < N * N * N; i++) {
+        if (w->skip[i]) continue;
+        if (!w->voxels[i][3] && ctx->skip_dst_empty) continue;
+        if (vec4_equal(w->voxels[i], w->new[i])) continue;
+        memcpy(w->voxels[i], w->new[i], 4);
+        changed = true;
+    }
+    if (changed) {
+        mesh_write_region(w->out, bpos, (int[]){N, N, N},
+                          (uint8_t*)w->voxels);
+        ctx->changed[idx] = worker + 1;
+    }
+}
+
+// Rasterize the shape of an operation on a single block.
+static void mesh_op_rasterize_block(int idx, int worker, void *user)
+{
+    mesh_op_ctx_t *ctx = user;
+    mesh_op_worker_t *w = &ctx->workers[worker];
+    uint8_t *alpha = ctx->shape->alpha[idx];
+    int i, r;
+
+    r = mesh_op_classify_block(ctx->painter, ctx->mat, ctx->size,
+                               ctx->shape->bpos[idx]);
+    if (r) {
+        memset(alpha, r > 0 ? ctx->painter->color[3] : 0, N * N * N);
+        return;
+    }
+    mesh_op_block_src(ctx, ctx->shape->bpos[idx], w->src, w->skip);
+    for (i = 0; i < N * N * N; i++) alpha[i] = w->src[i][3];
+}
+
+// Run a block function on the worker threads, for a list of blocks that
+// we take ownership of.  Each worker puts the blocks it changes in its own
+// output mesh, and we copy them back at the end.
+static void mesh_op_run(mesh_t *mesh, mesh_op_ctx_t *ctx,
+                        int n, int (*bpos)[3],
+                        void (*func)(int i, int worker, void *user))
+{
+    int i, nb_workers;
+
+    ctx->bpos = bpos;
+    nb_workers = worker_get_count();
+    ctx->changed = calloc(n + 1, sizeof(*ctx->changed));
+    ctx->workers = malloc(nb_workers * sizeof(*ctx->workers));
+    for (i = 0; i < nb_workers; i++) {
+        ctx->workers[i].out = mesh_new();
+        ctx->workers[i].accessor = mesh_get_accessor(ctx->mesh);
+    }
+
+    worker_parallel_for(n, func, ctx);
+
+    for (i = 0; i < n; i++) {
+        if (!ctx->changed[i]) continue;
+        mesh_copy_block(ctx->workers[ctx->changed[i] - 1].out, ctx->bpos[i],
+                        mesh, ctx->bpos[i]);
+    }
+
+    for (i = 0; i < nb_workers; i++) mesh_delete(ctx->workers[i].out);
+    free(ctx->workers);
+    free(ctx->changed);
+    free(ctx->bpos);
+}
+
+// Get the list of the blocks an operation has to process.
+static int mesh_op_get_blocks(const mesh_t *mesh, const painter_t *painter,
+                              const float box[4][4], bool skip_dst_empty,
+                              int (**out)[3])
+{
+    int n = 0, bpos[3];
+    int (*list)[3] = NULL;
     mesh_iterator_t iter;
-    mesh_accessor_t accessor;
-    float size[3], p[3];
-    float mat[4][4];
-    float (*shape_func)(const float[3], const float[3], float smoothness);
-    float k, v;
+
+    if (painter->mode != MODE_INTERSECT) {
+        iter = mesh_get_box_iterator(mesh, box, MESH_ITER_BLOCKS |
+                (skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0));
+    } else {
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS |
+                (skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0));
+    }
+    while (mesh_iter(&iter, bpos)) {
+        if (n % 64 == 0) list = realloc(list, (n + 64) * sizeof(*list));
+        memcpy(list[n++], bpos, sizeof(bpos));
+    }
+    *out = list;
+    return n;
+}
+
+static void mesh_op_ctx_init(mesh_op_ctx_t *ctx, const mesh_t *mesh,
+                             const painter_t *painter, const float box[4][4])
+{
     int mode = painter->mode;
-    bool use_box, skip_src_empty, skip_dst_empty;
-    painter_t painter2;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->painter = painter;
+    ctx->mesh = mesh;
+    box_get_size(box, ctx->size);
+    mat4_copy(box, ctx->mat);
+    mat4_iscale(ctx->mat, 1 / ctx->size[0], 1 / ctx->size[1],
+                1 / ctx->size[2]);
+    mat4_invert(ctx->mat, ctx->mat);
+    ctx->use_box = painter->box && !box_is_null(*painter->box);
+    ctx->skip_src_empty = mode == MODE_SUB ||
+                          mode == MODE_SUB_CLAMP ||
+                          mode == MODE_MULT_ALPHA;
+    ctx->skip_dst_empty = mode == MODE_SUB ||
+                          mode == MODE_SUB_CLAMP ||
+                          mode == MODE_MULT_ALPHA ||
+                          mode == MODE_INTERSECT;
+}
+
+// Apply an operation without symmetry.  If shape is set, the source
+// colors come from the mirrored rasterized shape instead of the painter
+// shape.
+static void mesh_op_apply(mesh_t *mesh, const painter_t *painter,
+                          const float box[4][4], mesh_op_shape_t *shape,
+                          int mirror, const int mirror_pos[3])
+{
+    int n, (*bpos)[3];
+    mesh_op_ctx_t ctx;
+
+    mesh_op_ctx_init(&ctx, mesh, painter, box);
+    ctx.shape = shape;
+    ctx.mirror = mirror;
+    if (mirror_pos) memcpy(ctx.mirror_pos, mirror_pos, sizeof(ctx.mirror_pos));
+
+    // We process the mesh one block at a time.  The blocks that are
+    // entirely inside or outside the shape get the same source color for
+    // all their voxels, so we only test the shape for the voxels of the
+    // blocks on its surface, and uniform blocks are filled in one go.
+    n = mesh_op_get_blocks(mesh, painter, box, ctx.skip_dst_empty, &bpos);
+    mesh_op_run(mesh, &ctx, n, bpos, mesh_op_block);
+}
+
+// Get the order in which the old recursive version of mesh_op applied
+// the mirrored operations, as bitfields of the mirrored axes.
+static int mesh_op_mirrors(int symmetry, int mirror, int *out, int n)
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (!(symmetry & (1 << i))) continue;
+        symmetry &= ~(1 << i);
+        n = mesh_op_mirrors(symmetry, mirror | (1 << i), out, n);
+    }
+    out[n++] = mirror;
+    return n;
+}
+
+// Mirror a box around the symmetry origin along the given axes, one axis
+// after the other.
+static void mesh_op_mirror_box(const float origin[3], int mirror,
+                               const float box[4][4], float out[4][4])
+{
+    int i;
+    float mat[4][4];
+    mat4_copy(box, out);
+    for (i = 0; i < 3; i++) {
+        if (!(mirror & (1 << i))) continue;
+        mat4_set_identity(mat);
+        mat4_itranslate(mat, +origin[0], +origin[1], +origin[2]);
+        if (i == 0) mat4_iscale(mat, -1,  1,  1);
+        if (i == 1) mat4_iscale(mat,  1, -1,  1);
+        if (i == 2) mat4_iscale(mat,  1,  1, -1);
+        mat4_itranslate(mat, -origin[0], -origin[1], -origin[2]);
+        mat4_imul(mat, out);
+        mat4_copy(mat, out);
+    }
+}
+
+// Apply a symmetric operation.  When the symmetry origin is on the voxels
+// grid, the mirrored voxels are exactly voxels too, so we rasterize the
+// shape once and then apply each mirrored operation with its source
+// voxels mirrored from it.  Otherwise we fall back to applying the
+// operation once per mirrored box.
+static void mesh_op_symmetric(mesh_t *mesh, const painter_t *painter,
+                              const float box[4][4])
+{
+    int i, j, k, l, n, nb, nb_blocks = 0, mirrors[8], mirror_pos[3] = {0};
+    int (*bpos)[3], (*blocks)[3] = NULL, p[3];
+    const float *sym_o = painter->symmetry_origin;
+    bool on_grid = true;
     float box2[4][4];
-    mesh_t *cached;
+    painter_t painter2;
+    mesh_op_shape_t shape;
+    mesh_op_ctx_t ctx;
+
+    nb = mesh_op_mirrors(painter->symmetry, 0, mirrors, 0);
+    for (i = 0; i < 3; i++) {
+        if (!(painter->symmetry & (1 << i))) continue;
+        mirror_pos[i] = round(sym_o[i] * 2);
+        if (mirror_pos[i] != sym_o[i] * 2) on_grid = false;
+    }
+
+    painter2 = *painter;
+    painter2.symmetry = 0;
+    if (!on_grid) {
+        for (i = 0; i < nb; i++) {
+            mesh_op_mirror_box(sym_o, mirrors[i], box, box2);
+            mesh_op_apply(mesh, &painter2, box2, NULL, 0, NULL);
+        }
+        return;
+    }
+
+    // Get all the blocks of the shape that the mirrored operations will
+    // read.  The lists only depend on the mesh when we skip the empty
+    // blocks, and then the operations can only remove blocks, so we can
+    // compute them all first.  Since the origin is not always on the
+    // blocks grid, a mirrored block can cover up to eight blocks.
+    mesh_op_ctx_init(&ctx, mesh, painter, box);
+    for (i = 0; i < nb; i++) {
+        mesh_op_mirror_box(sym_o, mirrors[i], box, box2);
+        n = mesh_op_get_blocks(mesh, painter, box2, ctx.skip_dst_empty,
+                               &bpos);
+        blocks = realloc(blocks, (nb_blocks + n * 8) * sizeof(*blocks));
+        for (j = 0; j < n; j++) {
+            for (k = 0; k < 3; k++) {
+                p[k] = (mirrors[i] & (1 << k)) ?
+                            mirror_pos[k] - bpos[j][k] - N : bpos[j][k];
+            }
+            for (k = 0; k < 8; k++, nb_blocks++)
+            for (l = 0; l < 3; l++) {
+                blocks[nb_blocks][l] = (p[l] + ((k >> l) & 1) * (N - 1)) &
+                                       ~(int)(N - 1);
+            }
+        }
+        free(bpos);
+    }
+    n = bpos_sort_unique(blocks, nb_blocks);
+
+    // Rasterize the shape, without the painter box that doesn't get
+    // mirrored.
+    painter2.box = NULL;
+    shape.nb = n;
+    shape.bpos = blocks;
+    shape.alpha = malloc(n * sizeof(*shape.alpha));
+    mesh_op_ctx_init(&ctx, NULL, &painter2, box);
+    ctx.shape = &shape;
+    ctx.workers = malloc(worker_get_count() * sizeof(*ctx.workers));
+    worker_parallel_for(n, mesh_op_rasterize_block, &ctx);
+    free(ctx.workers);
+
+    painter2.box = painter->box;
+    for (i = 0; i < nb; i++) {
+        mesh_op_mirror_box(sym_o, mirrors[i], box, box2);
+        mesh_op_apply(mesh, &painter2, box2, &shape, mirrors[i], mirror_pos);
+    }
+    free(shape.alpha);
+    free(shape.bpos);
+}
+
+void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
+{
+    mesh_t *cached, *copy;
     static cache_t *cache = NULL;
-    const float *sym_o = painter->symmetry_origin;
 
     // Check if the operation has been cached.
-    if (!cache) cache = cache_create(32);
+    if (!cache) cache = cache_create("mesh_op", 256 * MB);
     struct {
         uint64_t  id;
         float     box[4][4];
@@ -306,68 +1477,100 @@ void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
         return;
     }
 
+    if (painter->symmetry)
+        mesh_op_symmetric(mesh, painter, box);
+    else
+        mesh_op_apply(mesh, painter, box, NULL, 0, NULL);
+
+    copy = mesh_copy(mesh);
+    cache_add(cache, &key, sizeof(key), copy, mesh_get_memory_size(copy),
+              mesh_del);
+}
+
+void mesh_op_stroke(mesh_t *mesh, const painter_t *painter,
+                    const float box[4][4], int nb, const float (*points)[3])
+{
+    int i, j, k, n, nb_mirrors, mirrors[8], nb_blocks = 0;
+    int (*bpos)[3], (*blocks)[3] = NULL;
+    float (*pts)[3], box2[4][4], size[3], step;
+    painter_t painter2;
+    mesh_op_stroke_t stroke = {0};
+    mesh_op_ctx_t ctx;
+
+    assert(nb >= 1);
     if (painter->symmetry) {
         painter2 = *painter;
-        for (i = 0; i < 3; i++) {
-            if (!(painter->symmetry & (1 << i))) continue;
-            painter2.symmetry &= ~(1 << i);
-            mat4_set_identity(box2);
-            mat4_itranslate(box2, +sym_o[0], +sym_o[1], +sym_o[2]);
-            if (i == 0) mat4_iscale(box2, -1,  1,  1);
-            if (i == 1) mat4_iscale(box2,  1, -1,  1);
-            if (i == 2) mat4_iscale(box2,  1,  1, -1);
-            mat4_itranslate(box2, -sym_o[0], -sym_o[1], -sym_o[2]);
-            mat4_imul(box2, box);
-            mesh_op(mesh, &painter2, box2);
+        painter2.symmetry = 0;
+        nb_mirrors = mesh_op_mirrors(painter->symmetry, 0, mirrors, 0);
+        pts = malloc(nb * sizeof(*pts));
+        for (i = 0; i < nb_mirrors; i++) {
+            mesh_op_mirror_box(VEC(0, 0, 0), mirrors[i], box, box2);
+            for (j = 0; j < nb; j++)
+            for (k = 0; k < 3; k++) {
+                pts[j][k] = (mirrors[i] & (1 << k)) ?
+                    2 * painter->symmetry_origin[k] - points[j][k] :
+                    points[j][k];
+            }
+            mesh_op_stroke(mesh, &painter2, box2, nb, pts);
         }
+        free(pts);
+        return;
     }
 
-    shape_func = painter->shape->func;
+    // Put the points at the center of the shape, so that the shape box
+    // is now centered on the origin.
+    pts = malloc(nb * sizeof(*pts));
+    for (i = 0; i < nb; i++) vec3_add(points[i], box[3], pts[i]);
+    mat4_copy(box, box2);
+    vec3_set(box2[3], 0, 0, 0);
+    mesh_op_ctx_init(&ctx, mesh, painter, box2);
     box_get_size(box, size);
-    mat4_copy(box, mat);
-    mat4_iscale(mat, 1 / size[0], 1 / size[1], 1 / size[2]);
-    mat4_invert(mat, mat);
-    use_box = painter->box && !box_is_null(*painter->box);
-    skip_src_empty = mode == MODE_SUB ||
-                     mode == MODE_SUB_CLAMP ||
-                     mode == MODE_MULT_ALPHA;
-    skip_dst_empty = mode == MODE_SUB ||
-                     mode == MODE_SUB_CLAMP ||
-                     mode == MODE_MULT_ALPHA ||
-                     mode == MODE_INTERSECT;
-    if (mode != MODE_INTERSECT) {
-        iter = mesh_get_box_iterator(mesh, box,
-                skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0);
+    stroke.capsule = painter->shape == &shape_sphere &&
+                     fabs(size[0] - size[1]) < 1e-4 &&
+                     fabs(size[0] - size[2]) < 1e-4;
+
+    // For the capsules we only need the points.  For the other shapes we
+    // put one at each step along the segments, with the steps at most the
+    // size of the shape.
+    if (stroke.capsule) {
+        stroke.radius = size[0];
+        stroke.reach = size[0] + painter->smoothness;
+        stroke.points = malloc(nb * sizeof(*stroke.points));
+        memcpy(stroke.points, pts, nb * sizeof(*pts));
+        stroke.nb = nb;
     } else {
-        iter = mesh_get_iterator(mesh,
-                skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0);
+        stroke.reach = size[0] + size[1] + size[2] + painter->smoothness;
+        step = max(2 * min3(size[0], size[1], size[2]), 1);
+        stroke.points = malloc(sizeof(*stroke.points));
+        vec3_copy(pts[0], stroke.points[stroke.nb++]);
+        for (i = 0; i < nb - 1; i++) {
+            n = max(ceil(vec3_dist(pts[i], pts[i + 1]) / step), 1);
+            stroke.points = realloc(stroke.points,
+                                    (stroke.nb + n) * sizeof(*stroke.points));
+            for (j = 0; j < n; j++) {
+                vec3_mix(pts[i], pts[i + 1], (j + 1.0) / n,
+                         stroke.points[stroke.nb++]);
+            }
+        }
     }
 
-    // XXX: for the moment we cannot use the same accessor for both
-    // setting and getting!  Need to fix that!!
-    accessor = mesh_get_accessor(mesh);
-    while (mesh_iter(&iter, vp)) {
-        vec3_set(p, vp[0] + 0.5, vp[1] + 0.5, vp[2] + 0.5);
-        if (use_box && !bbox_contains_vec(*painter->box, p)) continue;
-        mat4_mul_vec3(mat, p, p);
-        k = shape_func(p, size, painter->smoothness);
-        if (painter->smoothness) {
-            v = clamp(k / painter->smoothness, -1.0f, 1.0f) / 2.0f + 0.5f;
-        } else {
-            v = (k >= 0.f) ? 1.f : 0.f;
-        }
-        if (!v && skip_src_empty) continue;
-        memcpy(c, painter->color, 4);
-        c[3] *= v;
-        if (!c[3] && skip_src_empty) continue;
-        mesh_get_at(mesh, &accessor, vp, value);
-        if (!value[3] && skip_dst_empty) continue;
-        combine(value, c, mode, new_value);
-        if (!vec4_equal(value, new_value))
-            mesh_set_at(mesh, &accessor, vp, new_value);
+    // Get the blocks around each segment.
+    for (i = 0; i < max(nb - 1, 1); i++) {
+        bbox_from_points(box2, pts[i], pts[min(i + 1, nb - 1)]);
+        bbox_grow(box2, stroke.reach, stroke.reach, stroke.reach, box2);
+        n = mesh_op_get_blocks(mesh, painter, box2, ctx.skip_dst_empty,
+                               &bpos);
+        blocks = realloc(blocks, (nb_blocks + n) * sizeof(*blocks));
+        memcpy(blocks + nb_blocks, bpos, n * sizeof(*blocks));
+        nb_blocks += n;
+        free(bpos);
     }
+    free(pts);
+    n = bpos_sort_unique(blocks, nb_blocks);
 
-    cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
+    ctx.stroke = &stroke;
+    mesh_op_run(mesh, &ctx, n, blocks, mesh_op_block);
+    free(stroke.points);
 }
 
 // XXX: remove this function!
@@ -378,19 +1581,35 @@ void mesh_get_box(const mesh_t *mesh, bool exact, float box[4][4])
     bbox_from_aabb(box, bbox);
 }
 
-static void block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
-                        int mode, const uint8_t color[4])
+// Key of the blocks merge cache.
+typedef struct {
+    uint64_t id1;
+    uint64_t id2;
+    int      mode;
+    uint8_t  color[4];
+} block_merge_key_t;
+_Static_assert(sizeof(block_merge_key_t) == 24, "");
+
+static cache_t *g_block_merge_cache = NULL;
+
+// Used for the blocks merge cache.
+static int block_data_del(void *data)
+{
+    mesh_block_data_release(data);
+    return 0;
+}
+
+// Merge a block for the simple cases, or using the cache.  Return false if
+// the merge has to be computed with block_merge_compute.
+static bool block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
+                        int mode, const uint8_t color[4],
+                        block_merge_key_t *key)
 {
-    int p[3];
-    int x, y, z;
     uint64_t id1, id2;
-    mesh_t *block;
-    uint8_t v1[4], v2[4];
-    static cache_t *cache = NULL;
-    mesh_accessor_t a1, a2, a3;
+    block_data_t *data;
 
-    mesh_get_block_data(mesh,  NULL, pos, &id1);
-    mesh_get_block_data(other, NULL, pos, &id2);
+    mesh_get_block_data(mesh,  NULL, pos, &id1, NULL);
+    mesh_get_block_data(other, NULL, pos, &id2, NULL);
 
     // XXX: cleanup this code!
 
@@ -399,68 +1618,129 @@ static void block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
              mode == MODE_SUB ||
              mode == MODE_SUB_CLAMP) && id2 == 0)
     {
-        return;
+        return true;
     }
 
     if ((mode == MODE_OVER || mode == MODE_MAX) && id1 == 0 && !color) {
         mesh_copy_block(other, pos, mesh, pos);
-        return;
+        return true;
     }
 
-    if ((mode == MODE_MULT_ALPHA) && id1 == 0) return;
+    if ((mode == MODE_MULT_ALPHA) && id1 == 0) return true;
     if ((mode == MODE_MULT_ALPHA) && id2 == 0) {
         // XXX: could just delete the block.
     }
 
     // Check if the merge op has been cached.
-    if (!cache) cache = cache_create(512);
-    struct {
-        uint64_t id1;
-        uint64_t id2;
-        int      mode;
-        uint8_t  color[4];
-    } key = { id1, id2, mode };
-    if (color) memcpy(key.color, color, 4);
-    _Static_assert(sizeof(key) == 24, "");
-    block = cache_get(cache, &key, sizeof(key));
-    if (block) goto end;
+    if (!g_block_merge_cache)
+        g_block_merge_cache = cache_create("block_merge", 64 * MB);
+    *key = (block_merge_key_t){ id1, id2, mode };
+    if (color) memcpy(key->color, color, 4);
+    data = cache_get(g_block_merge_cache, key, sizeof(*key));
+    if (!data) return false;
+    mesh_set_block_data(mesh, pos, data);
+    return true;
+}
 
-    block = mesh_new();
-    a1 = mesh_get_accessor(mesh);
-    a2 = mesh_get_accessor(other);
-    a3 = mesh_get_accessor(block);
+// Compute the merge of a block directly from the two blocks voxels into a
+// new block data.  This only reads the meshes, so it can run on any
+// thread.
+static block_data_t *block_merge_compute(const mesh_t *mesh,
+                                         const mesh_t *other,
+                                         const int pos[3], int mode,
+                                         const uint8_t color[4])
+{
+    block_data_t *data;
+    uint8_t (*v1)[4], (*v2)[4], (*v3)[4];
 
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        mesh_get_at(mesh, &a1, p, v1);
-        mesh_get_at(other, &a2, p, v2);
-        if (color) color_mul(v2, color, v2);
-        combine(v1, v2, mode, v1);
-        mesh_set_at(block, &a3, (int[]){x, y, z}, v1);
+    v1 = malloc(3 * N * N * N * 4);
+    v2 = v1 + N * N * N;
+    v3 = v2 + N * N * N;
+    mesh_get_block_data(mesh, NULL, pos, NULL, (uint8_t*)v1);
+    mesh_get_block_data(other, NULL, pos, NULL, (uint8_t*)v2);
+    if (color) colors_mul(N * N * N, v2, color, v2);
+    blend(mode, N * N * N, v1, v2, v3);
+    data = mesh_block_data_new((uint8_t*)v3);
+    free(v1);
+    return data;
+}
+
+// Context of a mesh_merge call, shared by all the worker threads.
+typedef struct {
+    const mesh_t        *mesh;
+    const mesh_t        *other;
+    int                 mode;
+    const uint8_t       *color;
+    int                 (*bpos)[3];   // Blocks to compute.
+    block_merge_key_t   *keys;
+    block_data_t        **datas;      // The computed blocks data.
+} mesh_merge_ctx_t;
+
+static void mesh_merge_block(int i, int worker, void *user)
+{
+    mesh_merge_ctx_t *ctx = user;
+    ctx->datas[i] = block_merge_compute(ctx->mesh, ctx->other, ctx->bpos[i],
+                                        ctx->mode, ctx->color);
+}
+
+void mesh_merge_blocks(mesh_t *mesh, const mesh_t *other, int mode,
+                       const uint8_t color[4], int nb, const int (*bpos)[3])
+{
+    int i, n;
+    block_merge_key_t block_key;
+    mesh_merge_ctx_t ctx = {0};
+
+    // Merge all the blocks that don't need any computation, and make the
+    // list of the other ones, that we then compute on the worker threads.
+    n = 0;
+    for (i = 0; i < nb; i++) {
+        if (block_merge(mesh, other, bpos[i], mode, color, &block_key))
+            continue;
+        if (n % 64 == 0) {
+            ctx.bpos = realloc(ctx.bpos, (n + 64) * sizeof(*ctx.bpos));
+            ctx.keys = realloc(ctx.keys, (n + 64) * sizeof(*ctx.keys));
+        }
+        memcpy(ctx.bpos[n], bpos[i], sizeof(*bpos));
+        ctx.keys[n++] = block_key;
     }
-    cache_add(cache, &key, sizeof(key), block, 1, mesh_del);
 
-end:
-    mesh_copy_block(block, (int[]){0, 0, 0}, mesh, pos);
-    return;
+    ctx.mesh = mesh;
+    ctx.other = other;
+    ctx.mode = mode;
+    ctx.color = color;
+    ctx.datas = calloc(n + 1, sizeof(*ctx.datas));
+    worker_parallel_for(n, mesh_merge_block, &ctx);
+
+    for (i = 0; i < n; i++) {
+        mesh_set_block_data(mesh, ctx.bpos[i], ctx.datas[i]);
+        // Several blocks of the list can have the same key.
+        if (cache_get(g_block_merge_cache, &ctx.keys[i], sizeof(ctx.keys[i])))
+        {
+            mesh_block_data_release(ctx.datas[i]);
+            continue;
+        }
+        cache_add(g_block_merge_cache, &ctx.keys[i], sizeof(ctx.keys[i]),
+                  ctx.datas[i],
+                  mesh_block_data_get_memory_size(ctx.datas[i]),
+                  block_data_del);
+    }
+    free(ctx.datas);
+    free(ctx.keys);
+    free(ctx.bpos);
 }
 
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
                 const uint8_t color[4])
 {
-    mesh_t *cached;
+    mesh_t *cached, *copy;
     assert(mesh && other);
     static cache_t *cache = NULL;
     mesh_iterator_t iter;
-    int bpos[3];
+    int n, bpos[3], (*list)[3] = NULL;
     uint64_t id1, id2;
 
     // Check if the merge op has been cached.
-    if (!cache) cache = cache_create(512);
+    if (!cache) cache = cache_create("mesh_merge", 256 * MB);
     id1 = mesh_get_key(mesh);
     id2 = mesh_get_key(other);
     struct {
@@ -477,12 +1757,18 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
         return;
     }
 
+    n = 0;
     iter = mesh_get_union_iterator(mesh, other, MESH_ITER_BLOCKS);
     while (mesh_iter(&iter, bpos)) {
-        block_merge(mesh, other, bpos, mode, color);
+        if (n % 64 == 0) list = realloc(list, (n + 64) * sizeof(*list));
+        memcpy(list[n++], bpos, sizeof(bpos));
     }
+    mesh_merge_blocks(mesh, other, mode, color, n, (const int (*)[3])list);
+    free(list);
 
-    cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
+    copy = mesh_copy(mesh);
+    cache_add(cache, &key, sizeof(key), copy, mesh_get_memory_size(copy),
+              mesh_del);
 }
 
 void mesh_crop(mesh_t *mesh, const float box[4][4])
@@ -504,15 +1790,17 @@ void mesh_crop(mesh_t *mesh, const float box[4][4])
 uint64_t mesh_crc64(const mesh_t *mesh)
 {
     mesh_iterator_t iter;
-    int pos[3];
-    uint8_t v[4];
+    int i, n, pos[3], p[3];
+    const uint8_t (*row)[4];
     uint64_t ret = 0;
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (!v[3]) continue;
-        ret = crc64(ret, (void*)pos, sizeof(pos));
-        ret = crc64(ret, (void*)v, sizeof(v));
+    iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
+    while ((n = mesh_iter_rows(&iter, pos, &row))) {
+        for (i = 0; i < n; i++) {
+            if (!row[i][3]) continue;
+            vec3_set(p, pos[0] + i, pos[1], pos[2]);
+            ret = crc64(ret, (void*)p, sizeof(p));
+            ret = crc64(ret, (void*)row[i], 4);
+        }
     }
     return ret;
 }
@@ -132,7 +132,8 @@ void quantization_gen_palette(const mesh_t *mesh, int nb,
                               uint8_t (*palette)[4])
 {
     uint8_t v[4];
-    int i, pos[3];
+    int i, n, pos[3];
+    const uint8_t (*row)[4];
     bucket_t *buckets, b;
     mesh_iterator_t iter;
 
@@ -140,12 +141,14 @@ void quantization_gen_palette(const mesh_t *mesh, int nb,
 
     // Fill the initial bucket.
     utarray_new(buckets[0].values, &value_icd);
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        bucket_add(&buckets[0], v, 1, true);
+    iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
+    while ((n = mesh_iter_rows(&iter, pos, &row))) {
+        for (i = 0; i < n; i++) {
+            if (row[i][3] < 127) continue;
+            memcpy(v, row[i], 3);
+            v[3] = 255;
+            bucket_add(&buckets[0], v, 1, true);
+        }
     }
 
     // Split until we get nb buckets.  I do it a bit stupidly, by sorting
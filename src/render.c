@@ -366,7 +366,7 @@ void render_init()
     init_bump_texture();
 
     // XXX: pick the proper memory size according to what is available.
-    g_items_cache = cache_create(RENDER_CACHE_SIZE);
+    g_items_cache = cache_create("render", RENDER_CACHE_SIZE);
     g_cube_model = model3d_cube();
     g_line_model = model3d_line();
     g_wire_cube_model = model3d_wire_cube();
@@ -427,7 +427,7 @@ static render_item_t *get_item_for_block(
         p[0] = block_pos[0] + x * BLOCK_SIZE;
         p[1] = block_pos[1] + y * BLOCK_SIZE;
         p[2] = block_pos[2] + z * BLOCK_SIZE;
-        mesh_get_block_data(mesh, NULL, p, &block_data_id);
+        mesh_get_block_data(mesh, NULL, p, &block_data_id, NULL);
         key.ids[i] = block_data_id;
     }
 
@@ -456,6 +456,7 @@ static render_item_t *get_item_for_block(
     }
 
     cache_add(g_items_cache, &key, sizeof(key), item,
+              sizeof(*item) +
               item->nb_elements * item->size * sizeof(*g_vertices_buffer),
               item_delete);
     return item;
@@ -74,18 +74,151 @@ static float cylinder_func(const float p[3], const float s[3],
     return min(rz, r - d);
 }
 
+/*
+ * Batch versions of the shape functions.
+ *
+ * They give the same results as the functions above, but are written as
+ * loops without branches over arrays of coordinates, so that the compiler
+ * can vectorize them (with -O3, or -Ofast for the square roots).
+ */
+
+static void sphere_func_batch(int n, const float *restrict x,
+                              const float *restrict y,
+                              const float *restrict z,
+                              const float s[3], float smoothness,
+                              float *restrict out)
+{
+    const float s012 = s[0] * s[1] * s[2], s_max = max3(s[0], s[1], s[2]);
+    const float s12 = s[1] * s[2], s02 = s[0] * s[2], s01 = s[0] * s[1];
+    float d, a, b, c, r;
+    int i;
+    for (i = 0; i < n; i++) {
+        d = sqrtf(x[i] * x[i] + y[i] * y[i] + z[i] * z[i]);
+        a = s12 * x[i] / d;
+        b = s02 * y[i] / d;
+        c = s01 * z[i] / d;
+        r = s012 / sqrtf(a * a + b * b + c * c);
+        out[i] = (x[i] == 0 && y[i] == 0 && z[i] == 0) ? s_max : r - d;
+    }
+}
+
+static void cube_func_batch(int n, const float *restrict x,
+                            const float *restrict y,
+                            const float *restrict z,
+                            const float s[3], float smoothness,
+                            float *restrict out)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        out[i] = cube_func((float[]){x[i], y[i], z[i]}, s, smoothness);
+}
+
+static void cylinder_func_batch(int n, const float *restrict x,
+                                const float *restrict y,
+                                const float *restrict z,
+                                const float s[3], float smoothness,
+                                float *restrict out)
+{
+    const float s01 = s[0] * s[1], s_max = max3(s[0], s[1], s[2]);
+    float d, a, b, r, rz;
+    int i;
+    for (i = 0; i < n; i++) {
+        d = sqrtf(x[i] * x[i] + y[i] * y[i]);
+        rz = s[2] - fabsf(z[i]);
+        a = s[1] * x[i] / d;
+        b = s[0] * y[i] / d;
+        r = s01 / sqrtf(a * a + b * b);
+        out[i] = (x[i] == 0 && y[i] == 0) ? min(rz, s_max) : min(rz, r - d);
+    }
+}
+
+// Margin used by the bound functions to ignore rounding errors.
+#define BOUND_EPS 1e-4f
+
+// Min and max of the elliptic norm sqrt(sum((p[i] / s[i])^2)) over an
+// axis aligned box, for the first n axis.
+static void box_norm_range(const float b[2][3], const float s[3], int n,
+                           float *qmin, float *qmax)
+{
+    int i;
+    float lo, hi, v;
+    *qmin = 0;
+    *qmax = 0;
+    for (i = 0; i < n; i++) {
+        lo = b[0][i] / s[i];
+        hi = b[1][i] / s[i];
+        v = lo > 0 ? lo : hi < 0 ? hi : 0;
+        *qmin += v * v;
+        v = max(fabs(lo), fabs(hi));
+        *qmax += v * v;
+    }
+    *qmin = sqrt(*qmin);
+    *qmax = sqrt(*qmax);
+}
+
+// For an ellipsoid, func = r (1 - q), with q the elliptic norm of the
+// point and r the radius in its direction, that is at least the smallest
+// axis size.
+static int sphere_bound(const float b[2][3], const float s[3],
+                        float smoothness)
+{
+    float qmin, qmax, smin = min3(s[0], s[1], s[2]);
+    if (smin <= 0) return 0;
+    box_norm_range(b, s, 3, &qmin, &qmax);
+    if (qmax <= 1 - smoothness / smin - BOUND_EPS) return +1;
+    if (qmin >= 1 + smoothness / smin + BOUND_EPS) return -1;
+    return 0;
+}
+
+static int cube_bound(const float b[2][3], const float s[3], float sm)
+{
+    int i;
+    // Outside of the max cube along any axis.
+    for (i = 0; i < 3; i++) {
+        if (b[1][i] < -s[i] - sm - BOUND_EPS) return -1;
+        if (b[0][i] >= s[i] + sm + BOUND_EPS) return -1;
+    }
+    // Inside the min cube.
+    for (i = 0; i < 3; i++) {
+        if (b[0][i] < -s[i] + sm + BOUND_EPS) return 0;
+        if (b[1][i] >= s[i] - sm - BOUND_EPS) return 0;
+    }
+    return +1;
+}
+
+static int cylinder_bound(const float b[2][3], const float s[3],
+                          float smoothness)
+{
+    float qmin, qmax, smin = min(s[0], s[1]);
+    float zmin = b[0][2] > 0 ? b[0][2] : b[1][2] < 0 ? -b[1][2] : 0;
+    float zmax = max(fabs(b[0][2]), fabs(b[1][2]));
+    if (smin <= 0) return 0;
+    box_norm_range(b, s, 2, &qmin, &qmax);
+    if (    qmax <= 1 - smoothness / smin - BOUND_EPS &&
+            zmax <= s[2] - smoothness - BOUND_EPS) return +1;
+    if (    qmin >= 1 + smoothness / smin + BOUND_EPS ||
+            zmin >= s[2] + smoothness + BOUND_EPS) return -1;
+    return 0;
+}
+
 void shapes_init(void)
 {
     shape_sphere = (shape_t){
         .id     = "sphere",
         .func   = sphere_func,
+        .func_batch = sphere_func_batch,
+        .bound  = sphere_bound,
     };
     shape_cube = (shape_t){
         .id     = "cube",
         .func   = cube_func,
+        .func_batch = cube_func_batch,
+        .bound  = cube_bound,
     };
     shape_cylinder = (shape_t){
         .id     = "cylinder",
-        .func = cylinder_func,
+        .func   = cylinder_func,
+        .func_batch = cylinder_func_batch,
+        .bound  = cylinder_bound,
     };
 }
@@ -18,6 +18,8 @@
 
 #include "goxel.h"
 
+#include <pthread.h>
+
 #define TEST(cond) \
     do { \
         if (!(cond)) { \
@@ -121,8 +123,808 @@ static void test_load_corrupt(void)
     action_exec2("import", "p", "/tmp/goxel_test.gox");
 }
 
+// Add and remove many blocks, to make sure the blocks table stays
+// consistent, and that we release all the blocks memory.
+static void test_mesh_blocks(void)
+{
+    mesh_t *mesh, *copy;
+    mesh_iterator_t iter;
+    mesh_memory_stats_t stats, stats2;
+    int i, nb, pos[3], bbox[2][3];
+    uint8_t v[4];
+
+    mesh_get_memory_stats(&stats);
+    mesh = mesh_new();
+    for (i = 0; i < 1000; i++) {
+        vec3_set(pos, (i % 10) * 16, (i / 10 % 10) * 16, (i / 100) * 16 - 80);
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){i % 256, 0, 0, 255});
+    }
+    copy = mesh_copy(mesh);
+    for (i = 0; i < 1000; i += 2) {
+        vec3_set(pos, (i % 10) * 16, (i / 10 % 10) * 16, (i / 100) * 16 - 80);
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){0, 0, 0, 0});
+    }
+    mesh_remove_empty_blocks(mesh, false);
+
+    TEST(mesh_count_voxels(mesh) == 500);
+    mesh_get_bbox(mesh, bbox, true);
+    TEST(memcmp(bbox, (int[2][3]){{16, 0, -80}, {145, 145, 65}},
+                sizeof(bbox)) == 0);
+    // Modify a block after we cached its extents.
+    mesh_set_at(mesh, NULL, (int[]){150, 3, 70}, (uint8_t[]){1, 1, 1, 255});
+    TEST(mesh_count_voxels(mesh) == 501);
+    mesh_get_bbox(mesh, bbox, true);
+    TEST(memcmp(bbox, (int[2][3]){{16, 0, -80}, {151, 145, 71}},
+                sizeof(bbox)) == 0);
+
+    nb = 0;
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, pos)) nb++;
+    TEST(nb == 500);
+    for (i = 0; i < 1000; i++) {
+        vec3_set(pos, (i % 10) * 16, (i / 10 % 10) * 16, (i / 100) * 16 - 80);
+        mesh_get_at(mesh, NULL, pos, v);
+        TEST(v[3] == ((i % 2) ? 255 : 0));
+        TEST(v[3] == 0 || v[0] == i % 256);
+        mesh_get_at(copy, NULL, pos, v);
+        TEST(v[3] == 255 && v[0] == i % 256);
+    }
+    mesh_delete(mesh);
+    mesh_delete(copy);
+    mesh_get_memory_stats(&stats2);
+    TEST(stats2.nb_blocks == stats.nb_blocks);
+    TEST(stats2.nb_datas == stats.nb_datas);
+    TEST(stats2.bytes == stats.bytes);
+}
+
+// Write blocks with an increasing number of colors, so that we go through
+// all the blocks encodings, and check the voxels and occupancy masks.
+static void test_block_encoding(void)
+{
+    const int nb_colors[] = {1, 2, 3, 5, 17, 255, 256, 257, 4096};
+    mesh_t *mesh;
+    int i, j, c, pos[3];
+    uint8_t v[4];
+    uint64_t mask[BLOCK_MASK_SIZE], opaque[BLOCK_MASK_SIZE];
+
+    for (i = 0; i < ARRAY_SIZE(nb_colors); i++) {
+        mesh = mesh_new();
+        for (j = 0; j < 4096 * 2; j++) {
+            c = (j * 7) % nb_colors[i];
+            vec3_set(pos, j % 16, j / 16 % 16, j / 256 % 16);
+            mesh_set_at(mesh, NULL, pos, (uint8_t[]){c, c >> 8, 1, 255});
+        }
+        for (j = 0; j < 4096; j++) {
+            c = ((j + 4096) * 7) % nb_colors[i];
+            vec3_set(pos, j % 16, j / 16 % 16, j / 256 % 16);
+            mesh_get_at(mesh, NULL, pos, v);
+            TEST(v[0] == (c & 255) && v[1] == c >> 8 && v[2] == 1);
+        }
+        // Check the occupancy masks.
+        for (j = 0; j < 4096; j += 3) {
+            vec3_set(pos, j % 16, j / 16 % 16, j / 256 % 16);
+            mesh_set_at(mesh, NULL, pos, (uint8_t[]){0, 0, 0, j % 2 * 100});
+        }
+        mesh_get_block_mask(mesh, NULL, (int[]){0, 0, 0}, mask, opaque);
+        for (j = 0; j < 4096; j++) {
+            vec3_set(pos, j % 16, j / 16 % 16, j / 256 % 16);
+            mesh_get_at(mesh, NULL, pos, v);
+            TEST(((mask[j / 64] >> (j % 64)) & 1) == (v[3] != 0));
+            TEST(((opaque[j / 64] >> (j % 64)) & 1) == (v[3] >= 127));
+        }
+        mesh_delete(mesh);
+    }
+}
+
+// Write and read back unaligned regions of voxels.
+static void test_mesh_region(void)
+{
+    const int pos[3] = {-7, 3, -20}, size[3] = {37, 20, 19};
+    mesh_t *mesh;
+    mesh_iterator_t iter;
+    uint8_t *data, v[4];
+    uint64_t ids[2];
+    int i, nb, p[3];
+
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){1, 2, 3, 255});
+    mesh_set_at(mesh, NULL, (int[]){-8, 5, -5}, (uint8_t[]){1, 2, 3, 255});
+    data = calloc(size[0] * size[1] * size[2], 4);
+    for (i = 0; i < size[0] * size[1] * size[2]; i++) {
+        if (i % 3 == 0) continue;
+        memcpy(&data[i * 4], (uint8_t[]){i, i / 256, i % 7, 255}, 4);
+    }
+    mesh_write_region(mesh, pos, size, data);
+    memset(data, 0, size[0] * size[1] * size[2] * 4);
+    mesh_read_region(mesh, pos, size, data);
+    for (i = 0; i < size[0] * size[1] * size[2]; i++) {
+        TEST(data[i * 4 + 3] == (i % 3 ? 255 : 0));
+        TEST(i % 3 == 0 || data[i * 4] == (i & 255));
+    }
+    // The voxels outside of the region should not change.
+    mesh_get_at(mesh, NULL, (int[]){-8, 5, -5}, v);
+    TEST(v[3] == 255);
+    mesh_get_at(mesh, NULL, (int[]){0, 0, 0}, v);
+    TEST(v[3] == 255 && v[0] == 1);
+    // Clearing the region removes its blocks.
+    memset(data, 0, size[0] * size[1] * size[2] * 4);
+    mesh_write_region(mesh, pos, size, data);
+    TEST(mesh_count_voxels(mesh) == 2);
+    nb = 0;
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, p)) nb++;
+    TEST(nb == 2);
+    // Empty regions don't touch the blocks.
+    mesh_write_region(mesh, (int[]){-7, 3, -5}, (int[]){0, 5, 5}, data);
+    mesh_read_region(mesh, (int[]){-7, 3, -5}, (int[]){0, 5, 5}, data);
+    TEST(mesh_count_voxels(mesh) == 2);
+
+    // Block aligned regions: writing back the same values keeps the data,
+    // and new values replace the whole blocks.
+    mesh_fill_block(mesh, (int[]){16, 0, 0}, (uint8_t[]){1, 2, 3, 255});
+    mesh_read_region(mesh, (int[]){0, 0, 0}, (int[]){32, 16, 16}, data);
+    mesh_write_region(mesh, (int[]){0, 0, 0}, (int[]){32, 16, 16}, data);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &ids[0], NULL);
+    mesh_write_region(mesh, (int[]){0, 0, 0}, (int[]){32, 16, 16}, data);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &ids[1], NULL);
+    TEST(ids[0] == ids[1]);
+    TEST(mesh_count_voxels(mesh) == 2 + 16 * 16 * 16);
+    for (i = 0; i < 32 * 16 * 16; i++) data[i * 4 + 3] = i % 32 < 16;
+    mesh_write_region(mesh, (int[]){0, 0, 0}, (int[]){32, 16, 16}, data);
+    TEST(mesh_count_voxels(mesh) == 1 + 16 * 16 * 16);
+    TEST(!mesh_get_block_data(mesh, NULL, (int[]){16, 0, 0}, NULL, NULL));
+    free(data);
+    mesh_delete(mesh);
+}
+
+static void test_mesh_diff_func(const int bpos[3], void *user)
+{
+    int *count = user;
+    count[0]++;
+    if (bpos[0] == 32 && bpos[1] == 0 && bpos[2] == 16) count[1]++;
+    if (bpos[0] == -16 && bpos[1] == 0 && bpos[2] == 0) count[2]++;
+}
+
+// Check that mesh_diff_blocks only reports the modified blocks.
+static void test_mesh_diff(void)
+{
+    mesh_t *mesh, *copy;
+    mesh_accessor_t accessor;
+    int pos[3], count[3] = {};
+
+    mesh = mesh_new();
+    accessor = mesh_get_accessor(mesh);
+    for (pos[2] = 0; pos[2] < 128; pos[2]++)
+    for (pos[1] = 0; pos[1] < 128; pos[1]++)
+    for (pos[0] = 0; pos[0] < 128; pos[0] += 3) {
+        mesh_set_at(mesh, &accessor, pos,
+                    (uint8_t[]){pos[0], pos[1], pos[2], 255});
+    }
+    copy = mesh_copy(mesh);
+    mesh_diff_blocks(mesh, copy, test_mesh_diff_func, count);
+    TEST(count[0] == 0);
+    // Setting a voxel to its current value doesn't change the block.
+    mesh_set_at(copy, NULL, (int[]){3, 3, 3}, (uint8_t[]){3, 3, 3, 255});
+    mesh_set_at(copy, NULL, (int[]){40, 5, 20}, (uint8_t[]){1, 2, 3, 255});
+    mesh_set_at(copy, NULL, (int[]){-10, 5, 5}, (uint8_t[]){1, 2, 3, 255});
+    mesh_diff_blocks(mesh, copy, test_mesh_diff_func, count);
+    TEST(count[0] == 2 && count[1] == 1 && count[2] == 1);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+// Check the mesh_map_voxels based functions against the voxels values.
+static void test_mesh_map(void)
+{
+    mesh_t *mesh, *copy;
+    mesh_iterator_t iter;
+    uint8_t v[4], v2[4];
+    int pos[3];
+
+    mesh = mesh_new();
+    for (pos[2] = 0; pos[2] < 40; pos[2]++)
+    for (pos[1] = 0; pos[1] < 40; pos[1]++)
+    for (pos[0] = 0; pos[0] < 40; pos[0]++) {
+        mesh_set_at(mesh, NULL, pos,
+                    (uint8_t[]){pos[0] * 6, pos[1] * 6, 250, pos[2] * 6});
+    }
+    // A uniform block.
+    mesh_fill_block(mesh, (int[]){64, 0, 0}, (uint8_t[]){10, 20, 30, 100});
+
+    copy = mesh_copy(mesh);
+    mesh_shift_brightness(copy, 10);
+    mesh_threshold_alpha(copy, 60);
+    iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_at(mesh, NULL, pos, v);
+        mesh_get_at(copy, NULL, pos, v2);
+        if (v[3] < 60) {
+            TEST(v2[3] == 0);
+            continue;
+        }
+        TEST(v2[0] == v[0] + 10 && v2[1] == v[1] + 10);
+        TEST(v2[2] == min(v[2] + 10, 255));
+        TEST(v2[3] == 255);
+    }
+    TEST(mesh_count_voxels(copy) == 30 * 40 * 40 + 16 * 16 * 16);
+
+    mesh_replace_color(copy, (uint8_t[]){20, 30, 40, 255},
+                             (uint8_t[]){1, 2, 3, 4});
+    mesh_get_at(copy, NULL, (int[]){64, 0, 0}, v);
+    TEST(memcmp(v, (uint8_t[]){1, 2, 3, 4}, 4) == 0);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+// Check mesh_move with the transformations that map voxels to voxels
+// against moving each voxel one by one.
+static void test_mesh_move(void)
+{
+    mesh_t *mesh, *moved, *ref;
+    mesh_iterator_t iter;
+    float mats[4][4][4], p[3];
+    uint8_t v[4], v2[4];
+    uint32_t r = 1;
+    int i, j, pos[3], q[3];
+
+    mesh = mesh_new();
+    for (i = 0; i < 3000; i++) {
+        r = r * 1103515245 + 12345;
+        pos[0] = (int)(r >> 8) % 40 - 10;
+        pos[1] = (int)(r >> 14) % 30 - 5;
+        pos[2] = (int)(r >> 20) % 20;
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){r, r >> 8, i, 255});
+    }
+    mesh_fill_block(mesh, (int[]){32, 32, 0}, (uint8_t[]){10, 20, 30, 255});
+
+    // Rotation around z with an odd translation.
+    mat4_set_identity(mats[0]);
+    mat4_itranslate(mats[0], 3, -7, 5);
+    mat4_irotate(mats[0], M_PI / 2, 0, 0, 1);
+    // Flip along x.
+    mat4_set_identity(mats[1]);
+    mat4_iscale(mats[1], -1, 1, 1);
+    // Permutation of all the axes, with flips.
+    mat4_set_identity(mats[2]);
+    mat4_irotate(mats[2], M_PI / 2, 1, 0, 0);
+    mat4_irotate(mats[2], -M_PI / 2, 0, 1, 0);
+    mat4_iscale(mats[2], 1, -1, 1);
+    mat4_itranslate(mats[2], 1, 2, 3);
+    // Block aligned translation.
+    mat4_set_identity(mats[3]);
+    mat4_itranslate(mats[3], 16, -32, 48);
+
+    for (i = 0; i < 4; i++) {
+        moved = mesh_copy(mesh);
+        mesh_move(moved, mats[i]);
+        ref = mesh_new();
+        iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
+        while (mesh_iter(&iter, pos)) {
+            mesh_get_at(mesh, NULL, pos, v);
+            vec3_set(p, pos[0], pos[1], pos[2]);
+            mat4_mul_vec3(mats[i], p, p);
+            for (j = 0; j < 3; j++) q[j] = round(p[j]);
+            mesh_set_at(ref, NULL, q, v);
+        }
+        TEST(mesh_count_voxels(moved) == mesh_count_voxels(ref));
+        iter = mesh_get_iterator(ref, MESH_ITER_SKIP_EMPTY);
+        while (mesh_iter(&iter, pos)) {
+            mesh_get_at(ref, NULL, pos, v);
+            mesh_get_at(moved, NULL, pos, v2);
+            TEST(memcmp(v, v2, 4) == 0);
+        }
+        mesh_delete(ref);
+        mesh_delete(moved);
+    }
+    mesh_delete(mesh);
+}
+
+// Check that a symmetric mesh_op gives the same result as applying the
+// mirrored painters one after another.
+static void test_mesh_op_symmetry(void)
+{
+    const int modes[] = {MODE_OVER, MODE_SUB};
+    const int symmetries[] = {1, 3, 7};
+    // On the grid, on the half voxels, and off the grid.
+    const float origins[][3] = {{0, 0, 0}, {2.5, -1.5, 0.5}, {0.3, 0, 0}};
+    mesh_t *mesh, *sym, *ref;
+    mesh_iterator_t iter;
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .color = {255, 128, 0, 255},
+    };
+    float boxes[2][4][4], box[4][4];
+    uint8_t v[4], v2[4];
+    int i, j, k, b, m, a, pos[3];
+
+    mesh = mesh_new();
+    bbox_from_extents(box, VEC(-4, 0, 2), 10, 8, 6);
+    painter.mode = MODE_OVER;
+    painter.shape = &shape_cube;
+    mesh_op(mesh, &painter, box);
+    painter.shape = &shape_sphere;
+
+    // One box away from the symmetry planes, one across them.
+    bbox_from_extents(boxes[0], VEC(9, 5, 4), 5, 4, 3);
+    bbox_from_extents(boxes[1], VEC(1, 1, 0), 4, 4, 4);
+
+    for (i = 0; i < ARRAY_SIZE(modes); i++)
+    for (j = 0; j < ARRAY_SIZE(symmetries); j++)
+    for (k = 0; k < ARRAY_SIZE(origins); k++)
+    for (b = 0; b < 2; b++) {
+        painter.mode = modes[i];
+        vec3_copy(origins[k], painter.symmetry_origin);
+        painter.symmetry = symmetries[j];
+        sym = mesh_copy(mesh);
+        mesh_op(sym, &painter, boxes[b]);
+
+        painter.symmetry = 0;
+        ref = mesh_copy(mesh);
+        for (m = 0; m < 8; m++) {
+            if (m & ~symmetries[j]) continue;
+            mat4_set_identity(box);
+            mat4_itranslate(box, origins[k][0], origins[k][1], origins[k][2]);
+            for (a = 0; a < 3; a++) {
+                if (!(m & (1 << a))) continue;
+                mat4_iscale(box, a == 0 ? -1 : 1, a == 1 ? -1 : 1,
+                                 a == 2 ? -1 : 1);
+            }
+            mat4_itranslate(box, -origins[k][0], -origins[k][1],
+                                 -origins[k][2]);
+            mat4_imul(box, boxes[b]);
+            mesh_op(ref, &painter, box);
+        }
+
+        TEST(mesh_count_voxels(sym) == mesh_count_voxels(ref));
+        iter = mesh_get_iterator(ref, MESH_ITER_SKIP_EMPTY);
+        while (mesh_iter(&iter, pos)) {
+            mesh_get_at(ref, NULL, pos, v);
+            mesh_get_at(sym, NULL, pos, v2);
+            TEST(memcmp(v, v2, 4) == 0);
+        }
+        mesh_delete(ref);
+        mesh_delete(sym);
+    }
+    mesh_delete(mesh);
+}
+
+// Check that mesh_op_stroke covers the voxels of the dabs the brush used
+// to paint every shape width along the segments.
+static void test_mesh_op_stroke(void)
+{
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    const float radii[] = {1, 4};
+    // Include a zero length segment.
+    const float points[][3] = {{0, 0, 0}, {20, 10, 0}, {25, -5, 8},
+                               {25, -5, 8}};
+    mesh_t *stroke, *dabs;
+    mesh_iterator_t iter;
+    painter_t painter = {
+        .mode = MODE_MAX,
+        .color = {255, 255, 255, 255},
+    };
+    float box[4][4], pos[3], r;
+    uint8_t v[4], v2[4];
+    int i, j, k, l, nb, vpos[3];
+
+    for (i = 0; i < ARRAY_SIZE(shapes); i++)
+    for (j = 0; j < ARRAY_SIZE(radii); j++) {
+        painter.shape = shapes[i];
+        r = radii[j];
+        stroke = mesh_new();
+        bbox_from_extents(box, VEC(0, 0, 0), r, r, r);
+        mesh_op_stroke(stroke, &painter, box, ARRAY_SIZE(points), points);
+
+        dabs = mesh_new();
+        bbox_from_extents(box, points[0], r, r, r);
+        mesh_op(dabs, &painter, box);
+        for (k = 0; k < ARRAY_SIZE(points) - 1; k++) {
+            nb = ceil(vec3_dist(points[k], points[k + 1]) / (2 * r));
+            nb = max(nb, 1);
+            for (l = 0; l < nb; l++) {
+                vec3_mix(points[k], points[k + 1], (l + 1.0) / nb, pos);
+                bbox_from_extents(box, pos, r, r, r);
+                mesh_op(dabs, &painter, box);
+            }
+        }
+
+        TEST(mesh_count_voxels(dabs) > 0);
+        iter = mesh_get_iterator(dabs, MESH_ITER_SKIP_EMPTY);
+        while (mesh_iter(&iter, vpos)) {
+            mesh_get_at(dabs, NULL, vpos, v);
+            mesh_get_at(stroke, NULL, vpos, v2);
+            TEST(v2[3] >= v[3]);
+        }
+        // The other shapes are the same dabs, rendered in one pass.
+        if (shapes[i] != &shape_sphere)
+            TEST(mesh_count_voxels(stroke) == mesh_count_voxels(dabs));
+        mesh_delete(dabs);
+        mesh_delete(stroke);
+    }
+}
+
+static int test_cache_del(void *data)
+{
+    (*(int*)data)++;
+    return 0;
+}
+
+static int test_cache_stats(const cache_stats_t *stats, void *user)
+{
+    if (strcmp(stats->name, "test") != 0) return 0;
+    memcpy(user, stats, sizeof(*stats));
+    return 1;
+}
+
+// Check the LRU order and the statistics of the caches.
+static void test_cache(void)
+{
+    cache_t *cache;
+    cache_stats_t stats;
+    int i, deleted = 0;
+    int64_t budget = cache_get_budget();
+
+    // Room for three items, with their overhead.
+    cache = cache_create("test", 35000);
+    for (i = 0; i < 3; i++)
+        cache_add(cache, &i, sizeof(i), &deleted, 10000, test_cache_del);
+    i = 0;
+    TEST(cache_get(cache, &i, sizeof(i)));
+    i = 3;
+    cache_add(cache, &i, sizeof(i), &deleted, 10000, test_cache_del);
+    TEST(deleted == 1);
+    for (i = 0; i < 4; i++)
+        TEST(!cache_get(cache, &i, sizeof(i)) == (i == 1));
+
+    caches_iter(test_cache_stats, &stats);
+    TEST(stats.nb_items == 3 && stats.evictions == 1);
+    TEST(stats.hits == 4 && stats.misses == 1);
+    TEST(stats.bytes > 30000 && stats.bytes <= 35000);
+
+    // The global budget evicts from all the caches.
+    cache_set_budget(1);
+    caches_iter(test_cache_stats, &stats);
+    TEST(stats.nb_items == 0 && deleted == 4);
+    cache_set_budget(budget);
+}
+
+// Check that the compacted and spilled undo snapshots are restored with
+// the same content.
+static void test_image_history(void)
+{
+    image_t *img = goxel.image;
+    mesh_t *mesh;
+    image_history_stats_t stats;
+    uint64_t crcs[9], keys[9];
+    int64_t budget;
+    bool spill;
+    int i, j;
+
+    budget = image_history_get_budget(&spill);
+    // Too small to keep anything but the last snapshot uncompacted.
+    image_history_set_budget(1, true);
+    for (i = 0; i < 9; i++) {
+        mesh = img->active_layer->mesh;
+        crcs[i] = mesh_crc64(mesh);
+        keys[i] = mesh_get_key(mesh);
+        if (i == 8) break;
+        image_history_push(img);
+        mesh = img->active_layer->mesh;
+        mesh_fill_block(mesh, (int[]){16 * i, 0, 0},
+                        (uint8_t[]){i, 128, 0, 255});
+        for (j = 0; j < 16; j++) {
+            mesh_set_at(mesh, NULL, (int[]){j, 16 + i, j},
+                        (uint8_t[]){j, i, 255, 255});
+        }
+        if (i >= 2) {
+            mesh_fill_block(mesh, (int[]){16 * (i - 2), 0, 0},
+                            (uint8_t[]){0, 0, 0, 0});
+            mesh_remove_empty_blocks(mesh, false);
+        }
+    }
+    image_history_get_stats(img, &stats);
+    TEST(stats.nb_entries == 8 && stats.nb_compacted == 7);
+    TEST(stats.nb_spilled == 7 && stats.disk_bytes > 0);
+
+    for (i = 7; i >= 0; i--) {
+        image_undo(img);
+        mesh = img->active_layer->mesh;
+        TEST(mesh_crc64(mesh) == crcs[i] && mesh_get_key(mesh) == keys[i]);
+    }
+    image_history_get_stats(img, &stats);
+    TEST(stats.nb_compacted == 0 && stats.nb_spilled == 0);
+    for (i = 1; i < 9; i++) {
+        image_redo(img);
+        mesh = img->active_layer->mesh;
+        TEST(mesh_crc64(mesh) == crcs[i] && mesh_get_key(mesh) == keys[i]);
+    }
+
+    image_history_set_budget(budget, spill);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    goxel_update_meshes(-1);
+}
+
+// Check that mesh_intern_blocks shares the identical blocks of two meshes
+// without changing them.
+static void test_mesh_intern(void)
+{
+    mesh_t *meshes[2], *copy, *mesh;
+    mesh_memory_stats_t stats;
+    uint64_t crcs[2], keys[2], ids[3];
+    int64_t saved;
+    int i, nb_datas, nb_datas_start, pos[3];
+
+    mesh_intern_clear();
+    mesh_get_memory_stats(&stats);
+    nb_datas_start = stats.nb_datas;
+    for (i = 0; i < 2; i++) {
+        meshes[i] = mesh_new();
+        mesh_fill_block(meshes[i], (int[]){0, 0, 0},
+                        (uint8_t[]){255, 0, 0, 255});
+        for (pos[2] = 16; pos[2] < 48; pos[2]++)
+        for (pos[1] = 0; pos[1] < 16; pos[1]++)
+        for (pos[0] = 0; pos[0] < 16; pos[0]++) {
+            mesh_set_at(meshes[i], NULL, pos,
+                        (uint8_t[]){pos[0] * 16, pos[1], pos[2] % 4, 255});
+        }
+        crcs[i] = mesh_crc64(meshes[i]);
+        keys[i] = mesh_get_key(meshes[i]);
+    }
+    mesh_get_memory_stats(&stats);
+    nb_datas = stats.nb_datas;
+
+    // The two patterned blocks of a mesh are also the same.
+    saved = mesh_intern_blocks(meshes[0], NULL);
+    TEST(saved > 0);
+    saved += mesh_intern_blocks(meshes[1], NULL);
+    TEST(mesh_intern_get_saved() == saved);
+    mesh_get_memory_stats(&stats);
+    TEST(stats.nb_datas == nb_datas - 4);
+    for (i = 0; i < 2; i++) {
+        TEST(mesh_crc64(meshes[i]) == crcs[i]);
+        TEST(mesh_get_key(meshes[i]) == keys[i]);
+    }
+
+    // Writing to a shared data doesn't change the other meshes.
+    copy = mesh_copy(meshes[1]);
+    mesh_set_at(meshes[1], NULL, (int[]){1, 1, 1}, (uint8_t[]){0, 0, 0, 0});
+    mesh_set_at(meshes[1], NULL, (int[]){1, 1, 17}, (uint8_t[]){0, 0, 0, 0});
+    TEST(mesh_crc64(meshes[0]) == crcs[0]);
+    TEST(mesh_crc64(meshes[1]) != crcs[1]);
+    // Only the modified blocks are looked up.
+    mesh_set_at(meshes[1], NULL, (int[]){1, 1, 1},
+                (uint8_t[]){255, 0, 0, 255});
+    TEST(mesh_intern_blocks(meshes[1], copy) > 0);
+    mesh_delete(copy);
+
+    // Interning a block shared with a copy doesn't change the copy.
+    mesh = mesh_new();
+    mesh_fill_block(mesh, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    copy = mesh_copy(mesh);
+    mesh_get_block_data(meshes[0], NULL, (int[]){0, 0, 0}, &ids[0], NULL);
+    mesh_get_block_data(copy, NULL, (int[]){0, 0, 0}, &ids[1], NULL);
+    TEST(ids[0] != ids[1]);
+    mesh_intern_blocks(mesh, NULL);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &ids[2], NULL);
+    TEST(ids[2] == ids[0]);
+    mesh_get_block_data(copy, NULL, (int[]){0, 0, 0}, &ids[2], NULL);
+    TEST(ids[2] == ids[1]);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+
+    for (i = 0; i < 2; i++) mesh_delete(meshes[i]);
+    // The table only releases the data once pruned.
+    mesh_get_memory_stats(&stats);
+    TEST(stats.nb_datas > nb_datas_start);
+    mesh_intern_prune();
+    mesh_get_memory_stats(&stats);
+    TEST(stats.nb_datas == nb_datas_start);
+    TEST(mesh_intern_get_saved() == 0);
+    mesh_intern_clear();
+}
+
+// Reference floating point version of the blend modes.
+static void test_blend_ref(const uint8_t a[4], const uint8_t b[4], int mode,
+                           uint8_t out[4])
+{
+    int i, aa = a[3], ba = b[3];
+    memcpy(out, a, 4);
+    switch (mode) {
+    case MODE_OVER:
+        if (255 * ba + aa * (255 - ba)) {
+            for (i = 0; i < 3; i++) {
+                out[i] = (255 * b[i] * ba + a[i] * aa * (255 - ba)) /
+                         (255 * ba + aa * (255 - ba));
+            }
+        }
+        out[3] = ba + aa * (255 - ba) / 255;
+        break;
+    case MODE_SUB:
+        out[3] = max(0, aa - ba);
+        break;
+    case MODE_SUB_CLAMP:
+        out[3] = min(aa, 255 - ba);
+        break;
+    case MODE_PAINT:
+        for (i = 0; i < 3; i++) out[i] = mix(a[i], b[i], ba / 255.);
+        break;
+    case MODE_MAX:
+        memcpy(out, b, 3);
+        out[3] = max(aa, ba);
+        break;
+    case MODE_INTERSECT:
+        out[3] = min(aa, ba);
+        break;
+    case MODE_MULT_ALPHA:
+        for (i = 0; i < 4; i++) out[i] = a[i] * ba / 255;
+        break;
+    }
+}
+
+// Check the blend modes against the reference version, using mesh_merge.
+static void test_blend_modes(void)
+{
+    const int N = BLOCK_SIZE, size[3] = {N, N, N};
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_SUB_CLAMP, MODE_PAINT,
+                         MODE_MAX, MODE_INTERSECT, MODE_MULT_ALPHA};
+    const uint8_t alphas[] = {0, 1, 127, 128, 254, 255};
+    mesh_t *a, *b, *mesh;
+    uint8_t (*va)[4], (*vb)[4], (*v)[4], ref[4];
+    int i, j, c;
+    uint32_t r = 1;
+
+    va = calloc(3 * N * N * N, 4);
+    vb = va + N * N * N;
+    v = vb + N * N * N;
+    for (i = 0; i < N * N * N; i++) {
+        for (c = 0; c < 4; c++) {
+            r = r * 1103515245 + 12345;
+            va[i][c] = r >> 16;
+            vb[i][c] = r >> 8;
+        }
+        if (i % 2) va[i][3] = alphas[i / 2 % ARRAY_SIZE(alphas)];
+        if (i % 3) vb[i][3] = alphas[i / 3 % ARRAY_SIZE(alphas)];
+        if (!va[i][3]) memset(va[i], 0, 4);
+        if (!vb[i][3]) memset(vb[i], 0, 4);
+    }
+    a = mesh_new();
+    b = mesh_new();
+    mesh_write_region(a, (int[]){0, 0, 0}, size, (uint8_t*)va);
+    mesh_write_region(b, (int[]){0, 0, 0}, size, (uint8_t*)vb);
+    for (j = 0; j < ARRAY_SIZE(modes); j++) {
+        mesh = mesh_copy(a);
+        mesh_merge(mesh, b, modes[j], NULL);
+        mesh_read_region(mesh, (int[]){0, 0, 0}, size, (uint8_t*)v);
+        for (i = 0; i < N * N * N; i++) {
+            test_blend_ref(va[i], vb[i], modes[j], ref);
+            TEST(abs(v[i][3] - ref[3]) <= 1);
+            if (!v[i][3] || !ref[3]) continue;
+            for (c = 0; c < 3; c++) TEST(abs(v[i][c] - ref[c]) <= 1);
+        }
+        mesh_delete(mesh);
+    }
+    mesh_delete(a);
+    mesh_delete(b);
+    free(va);
+}
+
+typedef struct {
+    pthread_t   thread;
+    const mesh_t *base;
+    int         id;
+    bool        ok;
+} test_thread_t;
+
+// Read a shared base mesh, and modify copies of it.
+static void *test_mesh_threads_func(void *arg)
+{
+    test_thread_t *t = arg;
+    mesh_t *mesh, *copy;
+    mesh_accessor_t accessor;
+    int i, j, pos[3];
+    uint8_t v[4];
+
+    for (i = 0; i < 50; i++) {
+        mesh = mesh_copy(t->base);
+        accessor = mesh_get_accessor(mesh);
+        for (j = 0; j < 256; j++) {
+            vec3_set(pos, (j * 7 + i) % 64, (j * 13) % 64, j % 64);
+            mesh_set_at(mesh, &accessor, pos, (uint8_t[]){t->id, i, j, 255});
+            mesh_get_at(mesh, &accessor, pos, v);
+            t->ok &= v[0] == t->id && v[1] == i && v[2] == j;
+            if (j == 128) {
+                copy = mesh_copy(mesh);
+                mesh_delete(mesh);
+                mesh = copy;
+                accessor = mesh_get_accessor(mesh);
+            }
+        }
+        mesh_delete(mesh);
+        mesh_get_at(t->base, NULL, (int[]){i, i, i}, v);
+        t->ok &= v[0] == (i % 3) * 100 && v[3] == 255;
+    }
+    return NULL;
+}
+
+// Stress test of the meshes copy on write from several threads.
+static void test_mesh_threads(void)
+{
+    test_thread_t threads[4] = {};
+    mesh_t *base;
+    mesh_accessor_t accessor;
+    mesh_memory_stats_t stats, stats2;
+    int i, pos[3];
+
+    mesh_get_memory_stats(&stats);
+    base = mesh_new();
+    accessor = mesh_get_accessor(base);
+    for (pos[2] = 0; pos[2] < 64; pos[2]++)
+    for (pos[1] = 0; pos[1] < 64; pos[1]++)
+    for (pos[0] = 0; pos[0] < 64; pos[0]++) {
+        mesh_set_at(base, &accessor, pos,
+                    (uint8_t[]){(pos[0] % 3) * 100, 0, 0, 255});
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        threads[i].base = base;
+        threads[i].id = i + 1;
+        threads[i].ok = true;
+        pthread_create(&threads[i].thread, NULL, test_mesh_threads_func,
+                       &threads[i]);
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        pthread_join(threads[i].thread, NULL);
+        TEST(threads[i].ok);
+    }
+    mesh_delete(base);
+    mesh_get_memory_stats(&stats2);
+    TEST(stats2.nb_blocks == stats.nb_blocks);
+    TEST(stats2.nb_datas == stats.nb_datas);
+}
+
+static void test_worker_pool_func(int i, int worker, void *user)
+{
+    int *counts = user;
+    __atomic_fetch_add(&counts[i], 1, __ATOMIC_RELAXED);
+    if (worker < 0 || worker >= worker_get_count())
+        __atomic_fetch_add(&counts[i], 100, __ATOMIC_RELAXED);
+}
+
+static void test_worker_pool_nested(int i, int worker, void *user)
+{
+    int *counts = user;
+    worker_parallel_for(10, test_worker_pool_func, counts + i * 10);
+}
+
+// Check that worker_parallel_for calls the function once for each index,
+// also when called from a worker thread.
+static void test_worker_pool(void)
+{
+    int i, counts[1000] = {};
+
+    worker_parallel_for(ARRAY_SIZE(counts), test_worker_pool_func, counts);
+    for (i = 0; i < ARRAY_SIZE(counts); i++) TEST(counts[i] == 1);
+    worker_parallel_for(ARRAY_SIZE(counts) / 10, test_worker_pool_nested,
+                        counts);
+    for (i = 0; i < ARRAY_SIZE(counts); i++) TEST(counts[i] == 2);
+}
+
 void tests_run(void)
 {
+    test_mesh_blocks();
+    test_block_encoding();
+    test_mesh_region();
+    test_mesh_diff();
+    test_mesh_map();
+    test_mesh_move();
+    test_mesh_op_symmetry();
+    test_mesh_op_stroke();
+    test_cache();
+    test_image_history();
+    test_mesh_intern();
+    test_blend_modes();
+    test_mesh_threads();
+    test_worker_pool();
     test_load_file_v2();
     test_load_file_v1_with_preview();
     test_load_corrupt();
@@ -116,8 +116,7 @@ static int on_drag(gesture3d_t *gest, void *user)
     cursor_t *curs = gest->cursor;
     bool shift = curs->flags & CURSOR_SHIFT;
     float r = goxel.tool_radius;
-    int nb, i;
-    float pos[3];
+    float points[2][3];
 
     if (gest->state == GESTURE_BEGIN) {
         mesh_set(brush->mesh_orig, goxel.image->active_layer->mesh);
@@ -144,15 +143,11 @@ static int on_drag(gesture3d_t *gest, void *user)
     painter2.mode = MODE_MAX;
     vec4_set(painter2.color, 255, 255, 255, 255);
 
-    // Render several times if the space between the current pos
-    // and the last pos is larger than the size of the tool shape.
-    nb = ceil(vec3_dist(curs->pos, brush->last_pos) / (2 * r));
-    nb = max(nb, 1);
-    for (i = 0; i < nb; i++) {
-        vec3_mix(brush->last_pos, curs->pos, (i + 1.0) / nb, pos);
-        get_box(pos, NULL, curs->normal, r, NULL, box);
-        mesh_op(brush->mesh, &painter2, box);
-    }
+    // Render the whole segment from the last pos in one go.
+    get_box(VEC(0, 0, 0), NULL, curs->normal, r, NULL, box);
+    vec3_copy(brush->last_pos, points[0]);
+    vec3_copy(curs->pos, points[1]);
+    mesh_op_stroke(brush->mesh, &painter2, box, 2, points);
 
     if (!goxel.tool_mesh) goxel.tool_mesh = mesh_new();
     mesh_set(goxel.tool_mesh, brush->mesh_orig);
@@ -0,0 +1,160 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2018 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pool of worker threads used to split the big mesh operations by blocks.
+ *
+ * The threads are started the first time we need them and then wait for
+ * jobs.  A job is a function to call for a range of indices: the calling
+ * thread and all the workers take the next index from a shared atomic
+ * counter until the range is done, so a thread that finishes its items
+ * early automatically takes more of them.
+ *
+ * Only one job runs at a time.  If the pool is already busy, for example
+ * when a job function calls worker_parallel_for itself, the new job runs
+ * on the calling thread.
+ */
+
+#include "goxel.h"
+
+#ifndef __EMSCRIPTEN__
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 32
+
+static struct {
+    int             nb_threads; // Not counting the calling thread.
+    pthread_t       threads[MAX_WORKERS];
+    pthread_mutex_t mutex;
+    pthread_cond_t  start_cond;
+    pthread_cond_t  done_cond;
+    uint64_t        generation; // Incremented for each new job.
+    int             busy;
+
+    // Current job.
+    void            (*func)(int i, int worker, void *user);
+    void            *user;
+    int             n;
+    int             next;       // Next index to process.
+    int             nb_running; // Number of workers still on the job.
+} g_pool;
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+
+static void run_job(int worker)
+{
+    int i;
+    while (true) {
+        i = __atomic_fetch_add(&g_pool.next, 1, __ATOMIC_RELAXED);
+        if (i >= g_pool.n) break;
+        g_pool.func(i, worker, g_pool.user);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    int worker = (int)(intptr_t)arg;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&g_pool.mutex);
+    while (true) {
+        while (g_pool.generation == generation)
+            pthread_cond_wait(&g_pool.start_cond, &g_pool.mutex);
+        generation = g_pool.generation;
+        pthread_mutex_unlock(&g_pool.mutex);
+        run_job(worker);
+        pthread_mutex_lock(&g_pool.mutex);
+        if (--g_pool.nb_running == 0)
+            pthread_cond_signal(&g_pool.done_cond);
+    }
+    return NULL;
+}
+
+static void pool_init(void)
+{
+    int i, nb = 4;
+#ifdef _SC_NPROCESSORS_ONLN
+    nb = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    nb = clamp(nb - 1, 0, MAX_WORKERS);
+    pthread_mutex_init(&g_pool.mutex, NULL);
+    pthread_cond_init(&g_pool.start_cond, NULL);
+    pthread_cond_init(&g_pool.done_cond, NULL);
+    for (i = 0; i < nb; i++) {
+        if (pthread_create(&g_pool.threads[i], NULL, worker_thread,
+                           (void*)(intptr_t)i) != 0) break;
+        pthread_detach(g_pool.threads[i]);
+    }
+    g_pool.nb_threads = i;
+    LOG_D("Start %d worker threads", g_pool.nb_threads);
+}
+
+int worker_get_count(void)
+{
+    pthread_once(&g_once, pool_init);
+    return g_pool.nb_threads + 1;
+}
+
+void worker_parallel_for(int n, void (*func)(int i, int worker, void *user),
+                         void *user)
+{
+    int i;
+    pthread_once(&g_once, pool_init);
+    if (    n < 2 || g_pool.nb_threads == 0 ||
+            __atomic_exchange_n(&g_pool.busy, 1, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < n; i++) func(i, 0, user);
+        return;
+    }
+
+    pthread_mutex_lock(&g_pool.mutex);
+    g_pool.func = func;
+    g_pool.user = user;
+    g_pool.n = n;
+    g_pool.next = 0;
+    g_pool.nb_running = g_pool.nb_threads;
+    g_pool.generation++;
+    pthread_cond_broadcast(&g_pool.start_cond);
+    pthread_mutex_unlock(&g_pool.mutex);
+
+    // The calling thread works too, with the last worker index.
+    run_job(g_pool.nb_threads);
+
+    pthread_mutex_lock(&g_pool.mutex);
+    while (g_pool.nb_running)
+        pthread_cond_wait(&g_pool.done_cond, &g_pool.mutex);
+    pthread_mutex_unlock(&g_pool.mutex);
+    __atomic_store_n(&g_pool.busy, 0, __ATOMIC_RELEASE);
+}
+
+#else // No threads support: run everything on the calling thread.
+
+int worker_get_count(void)
+{
+    return 1;
+}
+
+void worker_parallel_for(int n, void (*func)(int i, int worker, void *user),
+                         void *user)
+{
+    int i;
+    for (i = 0; i < n; i++) func(i, 0, user);
+}
+
+#endif